@@ -1,135 +1,154 @@
-double smoothing_kernel(double r, double dst) {
-    if(dst >= r) return 0;
-    double volume = M_PI * pow(r, 4) / 6;
-    return (r - dst) * (r - dst) / volume;
-}
+#include "particles.h"
+#include <stdio.h>
+#include <math.h>
 
-double smoothing_kernel_gradient(double dst, double r) {
-    if (dst >= r) return 0;
-    double scale = 12 / (M_PI * pow(r,4));
-    return scale * (dst - r);
+void init_smoothing_constants(SmoothingConstants* constants, double h) {
+    double h2 = h * h;
+    double h4 = h2 * h2;
+    double s = h / 2;
+    double cubic_norm = 10 / (7 * M_PI * s * s);
+    double wendland_norm = 7 / (M_PI * h2);
+    constants->h = (real_t)h;
+    constants->h2 = (real_t)h2;
+    constants->inv_h = (real_t)(1 / h);
+    constants->spiky_value = (real_t)(6 / (M_PI * h4));
+    constants->spiky_slope = (real_t)(12 / (M_PI * h4));
+    constants->poly6_value = (real_t)(4 / (M_PI * h4 * h4));
+    constants->poly6_slope = (real_t)(24 / (M_PI * h4 * h4));
+    constants->cubic_inv_s = (real_t)(1 / s);
+    constants->cubic_value = (real_t)(cubic_norm / 4);
+    constants->cubic_slope = (real_t)(3 * cubic_norm / (4 * s));
+    constants->wendland_value = (real_t)wendland_norm;
+    constants->wendland_slope = (real_t)(20 * wendland_norm / h2);
 }
 
-double convert_density_to_pressure(double density) {
-    double density_error = density - TARGET_DENSITY;
-    double pressure = P_MULT * density_error;
-    return pressure;
+// The selected density, pressure and viscosity kernels for an arbitrary radius, for
+// callers outside the solver loops. Those use the precomputed particles->kernel instead.
+real_t smoothing_kernel(real_t r, real_t dst) {
+    SmoothingConstants constants;
+    init_smoothing_constants(&constants, r);
+    return density_kernel(&constants, dst * dst);
 }
 
-double calculate_shared_pressure(double d_a, double d_b) {
-    double p_a = convert_density_to_pressure(d_a);
-    double p_b = convert_density_to_pressure(d_b);
-    return (p_a + p_b) / 2;
+real_t smoothing_kernel_gradient(real_t dst, real_t r) {
+    SmoothingConstants constants;
+    init_smoothing_constants(&constants, r);
+    return pressure_slope(&constants, dst * dst);
 }
 
-double calculate_all_densities(Particles* particles, double** densities) {
-    double max_density = -DBL_MAX;
-    double total_density = 0; // Variable to store total density
-    #pragma omp parallel for reduction(+:total_density) reduction(max:max_density)
-    for (int x = 0; x < WIN_WIDTH; ++x) {
-        for (int y = 0; y < WIN_HEIGHT; ++y) {
-            double p[2] = {x, y};
-            double density = calculate_density(particles, p);
-            densities[x][y] = density;
-            total_density += density; // Accumulate density
-            if (density > max_density) {
-                max_density = density;
-            }
-        }
-    }
-    // Calculate mean density
-    double mean_density = total_density / (WIN_WIDTH * WIN_HEIGHT);
-    printf("Mean Density: %lf\n", mean_density);
-    printf("Max Density: %lf\n", max_density);
-    printf("Total Density: %lf\n", total_density);
-    return max_density;
-}
-
-void calculate_all_pressures(Particles* particles, double** pressures, double minmax[2]) {
-    double max_pressure = -DBL_MAX;
-    double total_pressure = 0; // Variable to store total pressure
-    double min_pressure = DBL_MAX;
-    #pragma omp parallel for reduction(+:total_pressure) reduction(max:max_pressure) reduction(min:min_pressure)
-    for (int x = 0; x < WIN_WIDTH; ++x) {
-        for (int y = 0; y < WIN_HEIGHT; ++y) {
-            double p[2] = {x, y};
-            double density = calculate_density(particles, p);
-            double pressure = convert_density_to_pressure(density);
-            pressures[x][y] = pressure;
-            total_pressure += pressure; // Accumulate pressure
-            if (pressure > max_pressure) {
-               max_pressure = pressure;
-            }
-            if (pressure < min_pressure) {
-                min_pressure = pressure;
-            }
-        }
-    }
-    // Calculate mean pressure
-    double mean_pressure = total_pressure / (WIN_WIDTH * WIN_HEIGHT);
-    printf("Mean Pressure: %lf\n", mean_pressure);
-    printf("Max Pressure: %lf\n", max_pressure);
-
-    minmax[0] = min_pressure;
-    minmax[1] = max_pressure;
-}
-
-void draw_densities(SDL_Renderer* renderer, double** densities, double max_density) {
-    #pragma omp parallel for 
-    for (int x = 0; x < WIN_WIDTH; ++x) {
-        for (int y = 0; y < WIN_HEIGHT; ++y) {
-            int color = (int)(255 * densities[x][y] / max_density);
-            SDL_SetRenderDrawColor(renderer, color, color, color, SDL_ALPHA_OPAQUE);
-            SDL_RenderDrawPoint(renderer, x, y);
-        }
-    }
+real_t viscosity_kernel(real_t r, real_t dst) {
+    SmoothingConstants constants;
+    init_smoothing_constants(&constants, r);
+    return viscosity_weight(&constants, dst * dst);
 }
 
-void draw_pressures(SDL_Renderer* renderer, double** pressures, double minmax[2]) {
-    #pragma omp parallel for
-    for (int x = 0; x < WIN_WIDTH; ++x) {
-        for (int y = 0; y < WIN_HEIGHT; ++y) {
-            int r,g,b;
-            calculateColor(pressures[x][y], minmax, &r, &g, &b);
-            SDL_SetRenderDrawColor(renderer, r, g, b, SDL_ALPHA_OPAQUE);
-            SDL_RenderDrawPoint(renderer, x, y);
-        }
-    }
+real_t convert_density_to_pressure(const Particles* particles, real_t density) {
+    real_t density_error = density - (real_t)particles->target_density;
+    real_t pressure = (real_t)particles->pressure_multiplier * density_error;
+    return pressure;
 }
 
-void calculateColor(double pressure, double minmax[2], int *red, int *green, int *blue) {
-    // Normalize the pressure value between 0 and 1
-    double normalizedPressure = (pressure - minmax[0]) / (minmax[1] - minmax[0]);
-    // Initialize RGB values
-    *red = 255;
-    *green = 255;
-    *blue = 255;
-    
-    // Interpolate between blue, white, and red based on pressure
-    if (normalizedPressure < 0.5) {
-        *red = (int)(255 * normalizedPressure * 2);
-        *green = (int)(255 * normalizedPressure * 2);
-        *blue = 255;
-    } else {
-        *red = 255;
-        *green = (int)((1-(normalizedPressure - 0.5) * 2) * 255);
-        *blue = (int)((1-(normalizedPressure - 0.5) * 2) * 255);
-    }
+real_t calculate_shared_pressure(const Particles* particles, real_t d_a, real_t d_b) {
+    real_t p_a = convert_density_to_pressure(particles, d_a);
+    real_t p_b = convert_density_to_pressure(particles, d_b);
+    return (p_a + p_b) / 2;
 }
 
-void position_to_cell_coord(double position[2], int cell[2], double influence_radius) {
-    cell[0] = (int)(position[0] / influence_radius);
-    cell[1] = (int)(position[1] / influence_radius);
+void position_to_cell_coord(real_t x, real_t y, int cell[2], real_t influence_radius) {
+    cell[0] = (int)(x / influence_radius);
+    cell[1] = (int)(y / influence_radius);
 }
 
 uint hash_cell(int x, int y) {
     return (uint)(x * 15823 + y * 9737333);
 }
 
+// Interleaves the low 16 bits of x and y, cells close in both directions get close keys
+uint morton_key(int x, int y) {
+    uint key[2] = {(uint)(x < 0 ? 0 : x > 0xFFFF ? 0xFFFF : x), (uint)(y < 0 ? 0 : y > 0xFFFF ? 0xFFFF : y)};
+    for (int k = 0; k < 2; k++) {
+        key[k] = (key[k] | (key[k] << 8)) & 0x00FF00FF;
+        key[k] = (key[k] | (key[k] << 4)) & 0x0F0F0F0F;
+        key[k] = (key[k] | (key[k] << 2)) & 0x33333333;
+        key[k] = (key[k] | (key[k] << 1)) & 0x55555555;
+    }
+    return key[0] | (key[1] << 1);
+}
+
 uint get_key_from_hash(uint hash, int n) {
     return (uint)(hash % n);
 }
 
+// Key of cell (cx, cy) in the active index: the row-major cell id, clamped to the grid,
+// or the folded hash
+uint get_cell_key(Particles* particles, int cx, int cy) {
+#ifdef SPATIAL_HASH
+    return get_key_from_hash(hash_cell(cx, cy), particles->num_cells);
+#else
+    if (cx < 0) cx = 0;
+    if (cy < 0) cy = 0;
+    if (cx >= particles->grid_cols) cx = particles->grid_cols - 1;
+    if (cy >= particles->grid_rows) cy = particles->grid_rows - 1;
+    return (uint)(cy * particles->grid_cols + cx);
+#endif
+}
+
+uint position_to_cell_key(Particles* particles, real_t x, real_t y) {
+    int cell[2];
+    position_to_cell_coord(x, y, cell, (real_t)particles->cell_size);
+    return get_cell_key(particles, cell[0], cell[1]);
+}
+
+// Ranges [start, end) of spatial_lookup holding the 3x3 cells around cell (cx, cy).
+// On the dense grid each row of the block is one contiguous span; on the hashed table
+// there is one span per distinct bucket, so a bucket shared by two cells is visited once.
+int cell_neighbor_spans(Particles* particles, int cx, int cy, int spans[MAX_NEIGHBOR_SPANS][2]) {
+    int num_spans = 0;
+#ifdef SPATIAL_HASH
+    uint keys[9];
+    for (int i = -1; i <= 1; i++) {
+        for (int j = -1; j <= 1; j++) {
+            uint key = get_cell_key(particles, cx + i, cy + j);
+            bool seen = false;
+            for (int s = 0; s < num_spans; s++) seen |= keys[s] == key;
+            if (seen) continue;
+            keys[num_spans] = key;
+            spans[num_spans][0] = particles->cell_start[key];
+            spans[num_spans][1] = particles->cell_start[key + 1];
+            num_spans++;
+        }
+    }
+#else
+    int x0 = cx > 0 ? cx - 1 : 0;
+    int x1 = cx + 1 < particles->grid_cols ? cx + 1 : particles->grid_cols - 1;
+    if (x0 > x1) return 0;
+    for (int y = cy - 1; y <= cy + 1; y++) {
+        if (y < 0 || y >= particles->grid_rows) continue;
+        int row = y * particles->grid_cols;
+        int start = particles->cell_start[row + x0];
+        int end = particles->cell_start[row + x1 + 1];
+        if (start < end) {
+            spans[num_spans][0] = start;
+            spans[num_spans][1] = end;
+            num_spans++;
+        }
+    }
+#endif
+    return num_spans;
+}
+
+int neighbor_spans(Particles* particles, real_t x, real_t y, int spans[MAX_NEIGHBOR_SPANS][2]) {
+    int cell[2];
+    position_to_cell_coord(x, y, cell, (real_t)particles->cell_size);
+#ifndef SPATIAL_HASH
+    if (cell[0] < 0) cell[0] = 0;
+    if (cell[1] < 0) cell[1] = 0;
+    if (cell[0] >= particles->grid_cols) cell[0] = particles->grid_cols - 1;
+    if (cell[1] >= particles->grid_rows) cell[1] = particles->grid_rows - 1;
+#endif
+    return cell_neighbor_spans(particles, cell[0], cell[1], spans);
+}
+
 // Function to find the maximum value
 int getMax(Particles* particles, int n) {
     int mx = particles->spatial_lookup[0].cell_key;
@@ -185,52 +204,65 @@ void radixsort(Particles* particles) {
         countSort(particles, n, exp);
 }
 
-bool check_sorted(Particles* particles){
-    for(int i = 0; i < particles->num_particles - 1; i++){
-        if(particles->spatial_lookup[i].cell_key > particles->spatial_lookup[i + 1].cell_key){
-            return false;
-        }
+// LSD radix sort on cell_key with RADIX_BITS wide digits. Each pass builds per-thread
+// histograms over a contiguous slice, turns them into per-thread bucket offsets and
+// scatters stably into sort_buffer; the two buffers are then swapped, so no pass allocates.
+void parallel_radixsort(Particles* particles) {
+    int n = particles->num_particles;
+    if (n <= 1) return;
+
+    uint max_key = 0;
+    #pragma omp parallel for reduction(max:max_key) num_threads(particles->sort_threads)
+    for (int i = 0; i < n; i++) {
+        if (particles->spatial_lookup[i].cell_key > max_key)
+            max_key = particles->spatial_lookup[i].cell_key;
     }
-    return true;
-}
 
-void paint_each_point_within_radius(SDL_Renderer* renderer, Particles* particles, double sample_point[2]){
-    int centre[2];
-    position_to_cell_coord(sample_point, centre, particles->influence_radius);
-    double dir[2];
+    for (int shift = 0; shift < 32 && (max_key >> shift) > 0; shift += RADIX_BITS) {
+        Entry* src = particles->spatial_lookup;
+        Entry* dst = particles->sort_buffer;
 
-    double offset_x[3] = {0, -1, 1};
-    double offset_y[3] = {0, -1, 1};
+        #pragma omp parallel num_threads(particles->sort_threads)
+        {
+            int t = omp_get_thread_num();
+            int nt = omp_get_num_threads();
+            int begin = (int)((long)n * t / nt);
+            int end = (int)((long)n * (t + 1) / nt);
+            int* count = particles->sort_histograms + t * RADIX_BUCKETS;
 
-    for(int i = 0; i < 3; i++){
-        for(int j = 0; j < 3; j++){
-            uint key = get_key_from_hash(hash_cell(centre[0] + offset_x[i], centre[1] + offset_y[j]), particles->num_particles);
-            int cell_start_index = particles->start_indices[key];
+            memset(count, 0, RADIX_BUCKETS * sizeof(int));
+            for (int i = begin; i < end; i++)
+                count[(src[i].cell_key >> shift) & (RADIX_BUCKETS - 1)]++;
 
-            for(int k = cell_start_index; k < particles->num_particles; k++){
-                if (particles->spatial_lookup[k].cell_key != key){
-                    break;
-                }
-                int particle_index = particles->spatial_lookup[k].idx;
-                double dst = hypot(sample_point[0] - particles->particles[particle_index].position[0], sample_point[1] - particles->particles[particle_index].position[1]);
-                SDL_SetRenderDrawColor(renderer, 255, 0, 0, SDL_ALPHA_OPAQUE);
-                for (int i = 0; i < particles->num_particles; ++i) {
-                    int centerX = (int)particles->particles[particle_index].position[0];
-                    int centerY = (int)particles->particles[particle_index].position[1];
-                    int radius = BALL_RADIUS;
-
-                    for (int y = -radius; y <= radius; ++y) {
-                        for (int x = -radius; x <= radius; ++x) {
-                            if (x*x + y*y <= radius*radius) {
-                                SDL_RenderDrawPoint(renderer, centerX + x, centerY + y);
-                            }
-                        }
+            #pragma omp barrier
+            #pragma omp single
+            {
+                // Bucket-major, thread-minor prefix sum keeps the scatter stable
+                int offset = 0;
+                for (int b = 0; b < RADIX_BUCKETS; b++) {
+                    for (int k = 0; k < nt; k++) {
+                        int* c = &particles->sort_histograms[k * RADIX_BUCKETS + b];
+                        int tmp = *c;
+                        *c = offset;
+                        offset += tmp;
                     }
                 }
-                
             }
 
-            
+            for (int i = begin; i < end; i++)
+                dst[count[(src[i].cell_key >> shift) & (RADIX_BUCKETS - 1)]++] = src[i];
         }
+
+        particles->spatial_lookup = dst;
+        particles->sort_buffer = src;
     }
-}
\ No newline at end of file
+}
+
+bool check_sorted(Particles* particles){
+    for(int i = 0; i < particles->num_particles - 1; i++){
+        if(particles->spatial_lookup[i].cell_key > particles->spatial_lookup[i + 1].cell_key){
+            return false;
+        }
+    }
+    return true;
+}
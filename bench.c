@@ -0,0 +1,418 @@
+// Kernel benchmark suite: times each hot kernel of the solver in isolation over a sweep
+// of particle counts, thread counts and seeded scenarios, and writes CSV or JSON.
+//
+//   make bench
+//   ./bench -sizes 1000,10000,100000,1000000 -threads 1,2,4,8 -o results.csv
+//   ./bench -scenarios dam_break -kernels step,density -format json -o results.json
+//
+// The domain grows with the particle count so the number density (and therefore the
+// neighbor count per particle) stays at the level of the default 4000-particle scene.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <stdbool.h>
+#include <float.h>
+#include "particles.h"
+#include "simd.h"
+#include "neighbor_list.h"
+#include "checkpoint.h"
+#include "trajectory.h"
+#include "sdf.h"
+#include "scenarios.h"
+#include "field.h"
+#include "profile.h"
+
+#define BENCH_MAX_LIST 32
+#define FIELD_BENCH_WIDTH (WIN_WIDTH - 1)
+#define FIELD_BENCH_HEIGHT (WIN_HEIGHT - 1)
+// Largest displacement of the incremental lookup kernel, in cells, so a few percent of
+// the particles change cell as in a typical step
+#define LOOKUP_BENCH_JITTER 0.03
+
+typedef enum {
+    KERNEL_SPATIAL_LOOKUP,
+    KERNEL_INCREMENTAL_LOOKUP,
+    KERNEL_RADIXSORT,
+    KERNEL_PARALLEL_RADIXSORT,
+    KERNEL_DENSITY,
+    KERNEL_PRESSURE,
+    KERNEL_PAIR_PRESSURE,
+    KERNEL_STEP,
+    KERNEL_FIELD,
+    KERNEL_COUNT
+} Kernel;
+
+const char* kernel_names[KERNEL_COUNT] = {
+    "spatial_lookup", "incremental_lookup", "radixsort", "parallel_radixsort", "density", "pressure", "pair_pressure", "step", "field"
+};
+
+typedef struct {
+    int sizes[BENCH_MAX_LIST];
+    int num_sizes;
+    int threads[BENCH_MAX_LIST];
+    int num_threads;
+    bool scenarios[SCENARIO_COUNT];
+    bool kernels[KERNEL_COUNT];
+    unsigned int seed;
+    double skin;
+    double min_time;
+    int max_reps;
+    bool json;
+    const char* output;
+} BenchConfig;
+
+typedef struct {
+    int reps;
+    double mean;
+    double min;
+    double max;
+} Timing;
+
+typedef struct {
+    Particles* particles;
+    Entry* unsorted;
+    // Lookup built before the incremental lookup kernel moved the particles
+    Entry* built_lookup;
+    uint* built_cells;
+    int* built_cell_start;
+    Field* field;
+    Kernel kernel;
+} BenchState;
+
+int parse_int_list(const char* text, int* values) {
+    int count = 0;
+    char* copy = strdup(text);
+    for (char* tok = strtok(copy, ","); tok != NULL && count < BENCH_MAX_LIST; tok = strtok(NULL, ",")) {
+        values[count++] = atoi(tok);
+    }
+    free(copy);
+    return count;
+}
+
+bool parse_name_list(const char* text, const char** names, int num_names, bool* selected) {
+    memset(selected, 0, num_names * sizeof(bool));
+    char* copy = strdup(text);
+    bool ok = true;
+    for (char* tok = strtok(copy, ","); tok != NULL; tok = strtok(NULL, ",")) {
+        bool found = false;
+        for (int i = 0; i < num_names; i++) {
+            if (strcmp(tok, names[i]) == 0) {
+                selected[i] = found = true;
+            }
+        }
+        if (!found) {
+            fprintf(stderr, "Unknown name %s\n", tok);
+            ok = false;
+        }
+    }
+    free(copy);
+    return ok;
+}
+
+void print_usage(const char* program) {
+    fprintf(stderr, "Usage: %s [options]\n", program);
+    fprintf(stderr, "  -sizes <list>      particle counts (default 1000,10000,100000,1000000)\n");
+    fprintf(stderr, "  -threads <list>    thread counts (default powers of two up to all cores)\n");
+    fprintf(stderr, "  -scenarios <list>  uniform,dam_break,clustered (default all)\n");
+    fprintf(stderr, "  -kernels <list>    spatial_lookup,incremental_lookup,radixsort,parallel_radixsort,density,pressure,pair_pressure,step,field (default all)\n");
+    fprintf(stderr, "  -seed <seed>       scenario seed (default 1)\n");
+    fprintf(stderr, "  -skin <s>          Verlet neighbor-list skin, 0 disables the lists (default 0)\n");
+    fprintf(stderr, "  -time <seconds>    minimum measuring time per kernel (default 0.2)\n");
+    fprintf(stderr, "  -reps <count>      maximum repetitions per kernel (default 50)\n");
+    fprintf(stderr, "  -format csv|json   output format (default csv)\n");
+    fprintf(stderr, "  -o <path>          output file (default stdout)\n");
+}
+
+bool parse_args(int argc, char** argv, BenchConfig* config) {
+    for (int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        if (strcmp(arg, "--help") == 0 || i + 1 >= argc) {
+            return false;
+        }
+        const char* value = argv[++i];
+        if (strcmp(arg, "-sizes") == 0) config->num_sizes = parse_int_list(value, config->sizes);
+        else if (strcmp(arg, "-threads") == 0) config->num_threads = parse_int_list(value, config->threads);
+        else if (strcmp(arg, "-scenarios") == 0) {
+            if (!parse_name_list(value, scenario_names, SCENARIO_COUNT, config->scenarios)) return false;
+        }
+        else if (strcmp(arg, "-kernels") == 0) {
+            if (!parse_name_list(value, kernel_names, KERNEL_COUNT, config->kernels)) return false;
+        }
+        else if (strcmp(arg, "-seed") == 0) config->seed = (unsigned int)strtoul(value, NULL, 10);
+        else if (strcmp(arg, "-skin") == 0) config->skin = atof(value);
+        else if (strcmp(arg, "-time") == 0) config->min_time = atof(value);
+        else if (strcmp(arg, "-reps") == 0) config->max_reps = atoi(value);
+        else if (strcmp(arg, "-format") == 0) config->json = strcmp(value, "json") == 0;
+        else if (strcmp(arg, "-o") == 0) config->output = value;
+        else {
+            fprintf(stderr, "Unknown option %s\n", arg);
+            return false;
+        }
+    }
+    return config->num_sizes > 0 && config->num_threads > 0;
+}
+
+// Stride near 7919 sharing no factor with n, so i * stride % n visits every index once
+int coprime_stride(int n) {
+    if (n <= 1) return 1;
+    int stride = 7919;
+    for (;;) {
+        int a = stride;
+        int b = n;
+        while (b != 0) {
+            int r = a % b;
+            a = b;
+            b = r;
+        }
+        if (a == 1) return stride;
+        stride++;
+    }
+}
+
+// Puts the lookup back into its unsorted state so every sort repetition does the same work
+void reset_lookup(BenchState* state) {
+    memcpy(state->particles->spatial_lookup, state->unsorted, state->particles->num_particles * sizeof(Entry));
+}
+
+// Puts back the lookup of the unmoved particles so every patch moves the same particles
+void reset_incremental_lookup(BenchState* state) {
+    Particles* particles = state->particles;
+    memcpy(particles->spatial_lookup, state->built_lookup, particles->num_particles * sizeof(Entry));
+    memcpy(particles->prev_cell, state->built_cells, particles->num_particles * sizeof(uint));
+    memcpy(particles->cell_start, state->built_cell_start, (particles->num_cells + 1) * sizeof(int));
+    particles->lookup_valid = true;
+}
+
+// Builds the lookup, saves it and moves every particle by up to LOOKUP_BENCH_JITTER cells
+void prepare_incremental_lookup(BenchState* state) {
+    Particles* particles = state->particles;
+    int n = particles->num_particles;
+    memcpy(state->built_lookup, particles->spatial_lookup, n * sizeof(Entry));
+    memcpy(state->built_cells, particles->prev_cell, n * sizeof(uint));
+    memcpy(state->built_cell_start, particles->cell_start, (particles->num_cells + 1) * sizeof(int));
+
+    real_t jitter = (real_t)(LOOKUP_BENCH_JITTER * particles->cell_size);
+    real_t max_x = (real_t)particles->max_x - jitter;
+    real_t max_y = (real_t)particles->max_y - jitter;
+    for (int i = 0; i < n; i++) {
+        // Fixed pattern of offsets in [-1, 1] so the movers are the same for every thread count
+        real_t dx = ((i * 7) % 11 - 5) / (real_t)5;
+        real_t dy = ((i * 5) % 13 - 6) / (real_t)6;
+        particles->x[i] = (real_t)fmin(fmax(particles->x[i] + dx * jitter, jitter), max_x);
+        particles->y[i] = (real_t)fmin(fmax(particles->y[i] + dy * jitter, jitter), max_y);
+    }
+}
+
+void run_kernel(BenchState* state, int rep) {
+    Particles* particles = state->particles;
+    switch (state->kernel) {
+    case KERNEL_SPATIAL_LOOKUP:
+        particles->lookup_valid = false;
+        update_spatial_lookup(particles);
+        break;
+    case KERNEL_INCREMENTAL_LOOKUP:
+        update_spatial_lookup(particles);
+        break;
+    case KERNEL_RADIXSORT:
+        radixsort(particles);
+        break;
+    case KERNEL_PARALLEL_RADIXSORT:
+        parallel_radixsort(particles);
+        break;
+    case KERNEL_DENSITY:
+        #pragma omp parallel for
+        for (int i = 0; i < particles->num_particles; i++) {
+            particles->density[i] = calculate_density(particles, particles->x[i], particles->y[i]);
+        }
+        break;
+    case KERNEL_PRESSURE:
+        #pragma omp parallel for
+        for (int i = 0; i < particles->num_particles; i++) {
+            real_t pressure_force[2] = {0, 0};
+            real_t p[2] = {particles->x[i], particles->y[i]};
+            for_each_point_within_radius(particles, p, pressure_force, i);
+        }
+        break;
+    case KERNEL_PAIR_PRESSURE:
+        compute_pair_accelerations(particles, particles->num_particles);
+        break;
+    case KERNEL_STEP:
+        update_particles(particles, 1, rep);
+        break;
+    case KERNEL_FIELD:
+        sample_field(particles, state->field);
+        break;
+    default:
+        break;
+    }
+}
+
+bool kernel_needs_reset(Kernel kernel) {
+    return kernel == KERNEL_RADIXSORT || kernel == KERNEL_PARALLEL_RADIXSORT;
+}
+
+Timing time_kernel(BenchState* state, const BenchConfig* config) {
+    Timing timing = {0, 0, DBL_MAX, 0};
+    double total = 0;
+
+    // One untimed warm-up call
+    if (kernel_needs_reset(state->kernel)) reset_lookup(state);
+    if (state->kernel == KERNEL_INCREMENTAL_LOOKUP) reset_incremental_lookup(state);
+    run_kernel(state, 0);
+
+    while (timing.reps < config->max_reps && (total < config->min_time || timing.reps < 3)) {
+        if (kernel_needs_reset(state->kernel)) reset_lookup(state);
+        if (state->kernel == KERNEL_INCREMENTAL_LOOKUP) reset_incremental_lookup(state);
+        double start = omp_get_wtime();
+        run_kernel(state, timing.reps + 1);
+        double elapsed = omp_get_wtime() - start;
+
+        total += elapsed;
+        timing.reps++;
+        if (elapsed < timing.min) timing.min = elapsed;
+        if (elapsed > timing.max) timing.max = elapsed;
+    }
+    timing.mean = total / timing.reps;
+    return timing;
+}
+
+// Items processed per call, used for the throughput column
+double kernel_items(Kernel kernel, int num_particles) {
+    if (kernel == KERNEL_FIELD) return (double)FIELD_BENCH_WIDTH * FIELD_BENCH_HEIGHT;
+    return num_particles;
+}
+
+void write_result(FILE* out, const BenchConfig* config, bool* first, Scenario scenario, Kernel kernel, int n, int threads, Timing t) {
+    double throughput = kernel_items(kernel, n) / t.mean;
+    if (config->json) {
+        fprintf(out, "%s\n  {\"scenario\": \"%s\", \"kernel\": \"%s\", \"particles\": %d, \"threads\": %d, \"precision\": %d, "
+                     "\"simd\": \"%s\", \"reps\": %d, \"mean_s\": %.9g, \"min_s\": %.9g, \"max_s\": %.9g, \"items_per_s\": %.6g}",
+                *first ? "" : ",", scenario_name(scenario), kernel_names[kernel], n, threads, (int)(8 * sizeof(real_t)),
+                simd_level_name(get_simd_level()), t.reps, t.mean, t.min, t.max, throughput);
+    } else {
+        fprintf(out, "%s,%s,%d,%d,%d,%s,%d,%.9g,%.9g,%.9g,%.6g\n",
+                scenario_name(scenario), kernel_names[kernel], n, threads, (int)(8 * sizeof(real_t)),
+                simd_level_name(get_simd_level()), t.reps, t.mean, t.min, t.max, throughput);
+    }
+    *first = false;
+    fflush(out);
+}
+
+int main(int argc, char** argv) {
+    int max_threads = omp_get_max_threads();
+    BenchConfig config = {
+        .sizes = {1000, 10000, 100000, 1000000},
+        .num_sizes = 4,
+        .num_threads = 0,
+        .seed = 1,
+        .skin = NEIGHBOR_SKIN,
+        .min_time = 0.2,
+        .max_reps = 50,
+        .json = false,
+        .output = NULL,
+    };
+    for (int t = 1; t < max_threads && config.num_threads < BENCH_MAX_LIST - 1; t *= 2) {
+        config.threads[config.num_threads++] = t;
+    }
+    config.threads[config.num_threads++] = max_threads;
+    for (int i = 0; i < SCENARIO_COUNT; i++) config.scenarios[i] = true;
+    for (int i = 0; i < KERNEL_COUNT; i++) config.kernels[i] = true;
+
+    if (!parse_args(argc, argv, &config)) {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    // The per-thread sort buffers are sized for omp_get_max_threads() at init
+    int num_threads = 0;
+    for (int ti = 0; ti < config.num_threads; ti++) {
+        int threads = config.threads[ti];
+        if (threads < 1 || threads > max_threads) {
+            fprintf(stderr, "Skipping %d threads, only 1 to %d are available (raise OMP_NUM_THREADS to oversubscribe)\n", threads, max_threads);
+            continue;
+        }
+        config.threads[num_threads++] = threads;
+    }
+    config.num_threads = num_threads;
+
+    FILE* out = config.output ? fopen(config.output, "w") : stdout;
+    if (out == NULL) {
+        perror("Could not open the output file");
+        return EXIT_FAILURE;
+    }
+    if (config.json) fprintf(out, "[");
+    else fprintf(out, "scenario,kernel,particles,threads,precision,simd,reps,mean_s,min_s,max_s,items_per_s\n");
+
+    // Full-resolution density overlay over a window-sized area
+    Field field;
+    init_field(&field, FIELD_DENSITY, FIELD_BENCH_WIDTH, FIELD_BENCH_HEIGHT, 1);
+
+    bool first = true;
+    for (int s = 0; s < SCENARIO_COUNT; s++) {
+        if (!config.scenarios[s]) continue;
+        for (int si = 0; si < config.num_sizes; si++) {
+            int n = config.sizes[si];
+            double scale = sqrt((double)n / NUM_PARTICLES);
+
+            Particles particles;
+            double gravity[2];
+            scenario_gravity((Scenario)s, gravity);
+            init_particles(&particles, n, WIN_WIDTH * scale, WIN_HEIGHT * scale, gravity, BALL_RADIUS, COLLISION_LOSS, INFLUENCE_RADIUS);
+            set_neighbor_skin(&particles, config.skin);
+            Entry* unsorted = malloc(n * sizeof(Entry));
+            int stride = coprime_stride(n);
+            Entry* built_lookup = malloc(n * sizeof(Entry));
+            uint* built_cells = malloc(n * sizeof(uint));
+            int* built_cell_start = malloc((particles.num_cells + 1) * sizeof(int));
+            if (unsorted == NULL || built_lookup == NULL || built_cells == NULL || built_cell_start == NULL) {
+                perror("Memory allocation failed for the benchmark state.");
+                exit(EXIT_FAILURE);
+            }
+
+            for (int ti = 0; ti < config.num_threads; ti++) {
+                int threads = config.threads[ti];
+                omp_set_num_threads(threads);
+                particles.sort_threads = threads;
+
+                for (int k = 0; k < KERNEL_COUNT; k++) {
+                    if (!config.kernels[k]) continue;
+                    fprintf(stderr, "%s %s n=%d threads=%d\n", scenario_name((Scenario)s), kernel_names[k], n, threads);
+
+                    // Every measurement starts from the same seeded state
+                    apply_scenario(&particles, (Scenario)s, config.seed);
+                    particles.lookup_valid = false;
+                    particles.neighbor_lists_valid = false;
+                    update_spatial_lookup(&particles);
+                    #pragma omp parallel for
+                    for (int i = 0; i < n; i++) {
+                        particles.density[i] = calculate_density(&particles, particles.x[i], particles.y[i]);
+                    }
+                    for (int i = 0; i < n; i++) {
+                        unsorted[i] = particles.spatial_lookup[(i * (long)stride) % n];
+                    }
+
+                    BenchState state = {&particles, unsorted, built_lookup, built_cells, built_cell_start, &field, (Kernel)k};
+                    if (k == KERNEL_INCREMENTAL_LOOKUP) {
+                        prepare_incremental_lookup(&state);
+                        reset_incremental_lookup(&state);
+                        patch_spatial_lookup(&particles);
+                        fprintf(stderr, "  %d of %d particles change cell\n", particles.last_lookup_movers, n);
+                    }
+                    Timing timing = time_kernel(&state, &config);
+                    write_result(out, &config, &first, (Scenario)s, (Kernel)k, n, threads, timing);
+                }
+            }
+            free(unsorted);
+            free(built_lookup);
+            free(built_cells);
+            free(built_cell_start);
+            free_particles(&particles);
+        }
+    }
+
+    free_field(&field);
+    if (config.json) fprintf(out, "\n]\n");
+    if (out != stdout) fclose(out);
+    return 0;
+}
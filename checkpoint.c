@@ -0,0 +1,172 @@
+#include "checkpoint.h"
+#include "neighbor_list.h"
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+uint64_t checkpoint_align(uint64_t offset) {
+    return (offset + CHECKPOINT_ALIGN - 1) / CHECKPOINT_ALIGN * CHECKPOINT_ALIGN;
+}
+
+// Writes to path.tmp and renames it over path once the data is on disk, so a crash while
+// saving leaves the previous checkpoint intact
+bool save_checkpoint(Particles* particles, const char* path) {
+    CheckpointHeader header = {0};
+    memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+    header.version = CHECKPOINT_VERSION;
+    header.header_size = sizeof(CheckpointHeader);
+    header.real_size = sizeof(real_t);
+    header.num_particles = particles->num_particles;
+    header.max_x = particles->max_x;
+    header.max_y = particles->max_y;
+    header.forces[0] = particles->forces[0];
+    header.forces[1] = particles->forces[1];
+    header.radius = particles->radius;
+    header.influence_radius = particles->influence_radius;
+    header.collision_loss = particles->collision_loss;
+    header.target_density = particles->target_density;
+    header.pressure_multiplier = particles->pressure_multiplier;
+    header.viscosity = particles->viscosity;
+    header.neighbor_skin = particles->neighbor_skin;
+    header.seed = particles->seed;
+    header.step = particles->step;
+    header.emitted = particles->emitted;
+
+    const real_t* arrays[CHECKPOINT_ARRAYS] = {particles->x, particles->y, particles->vx, particles->vy, particles->density};
+    size_t array_size = (size_t)particles->num_particles * sizeof(real_t);
+    uint64_t offset = checkpoint_align(sizeof(CheckpointHeader));
+    for (int k = 0; k < CHECKPOINT_ARRAYS; k++) {
+        header.array_offsets[k] = offset;
+        offset = checkpoint_align(offset + array_size);
+    }
+    header.file_size = offset;
+
+    size_t path_length = strlen(path);
+    char* tmp_path = malloc(path_length + 5);
+    if (tmp_path == NULL) {
+        perror("Memory allocation failed for the checkpoint path.");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(tmp_path, path, path_length);
+    memcpy(tmp_path + path_length, ".tmp", 5);
+
+    // Reordered state is written in id order, so the file does not depend on the layout
+    real_t* ordered = NULL;
+    if (particles->slots != NULL && array_size > 0) {
+        ordered = malloc(array_size);
+        if (ordered == NULL) {
+            perror("Memory allocation failed for the checkpoint.");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    FILE* file = fopen(tmp_path, "wb");
+    if (file == NULL) {
+        perror("Could not open the checkpoint file");
+        free(tmp_path);
+        free(ordered);
+        return false;
+    }
+
+    static const char padding[CHECKPOINT_ALIGN] = {0};
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+    uint64_t written = sizeof(header);
+    for (int k = 0; k < CHECKPOINT_ARRAYS && ok; k++) {
+        ok = fwrite(padding, 1, header.array_offsets[k] - written, file) == header.array_offsets[k] - written;
+        const real_t* values = arrays[k];
+        if (ordered != NULL) {
+            gather_by_id(particles, arrays[k], ordered);
+            values = ordered;
+        }
+        ok = ok && fwrite(values, 1, array_size, file) == array_size;
+        written = header.array_offsets[k] + array_size;
+    }
+    ok = ok && fwrite(padding, 1, header.file_size - written, file) == header.file_size - written;
+    ok = ok && fflush(file) == 0 && fsync(fileno(file)) == 0;
+    ok = fclose(file) == 0 && ok;
+    ok = ok && rename(tmp_path, path) == 0;
+    if (!ok) {
+        perror("Could not write the checkpoint");
+        remove(tmp_path);
+    }
+
+    free(tmp_path);
+    free(ordered);
+    return ok;
+}
+
+// Initializes particles with the state stored at path. The file is mapped privately and the
+// state arrays point into the mapping, so nothing is parsed or copied up front; pages are
+// read on first touch and copied on first write. The rest of the solver state (lookup,
+// neighbor lists, scratch arrays) is rebuilt as after init_particles. Returns false and
+// leaves particles untouched if the file is missing or was written by an incompatible build.
+bool load_checkpoint(Particles* particles, const char* path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror("Could not open the checkpoint file");
+        return false;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(CheckpointHeader)) {
+        fprintf(stderr, "Checkpoint %s is truncated\n", path);
+        close(fd);
+        return false;
+    }
+
+    void* mapping = mmap(NULL, info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        perror("Could not map the checkpoint file");
+        return false;
+    }
+
+    const CheckpointHeader* header = mapping;
+    size_t array_size = (size_t)header->num_particles * sizeof(real_t);
+    bool valid = memcmp(header->magic, CHECKPOINT_MAGIC, sizeof(header->magic)) == 0 &&
+                 header->version == CHECKPOINT_VERSION &&
+                 header->header_size == sizeof(CheckpointHeader) &&
+                 header->real_size == sizeof(real_t) &&
+                 header->num_particles >= 0 &&
+                 header->file_size == (uint64_t)info.st_size;
+    for (int k = 0; k < CHECKPOINT_ARRAYS && valid; k++) {
+        valid = header->array_offsets[k] % CHECKPOINT_ALIGN == 0 && header->array_offsets[k] + array_size <= header->file_size;
+    }
+    if (!valid) {
+        fprintf(stderr, "Checkpoint %s is not a version %d checkpoint with %zu-byte reals\n", path, CHECKPOINT_VERSION, sizeof(real_t));
+        munmap(mapping, info.st_size);
+        return false;
+    }
+
+    int n = header->num_particles;
+    double forces[2] = {header->forces[0], header->forces[1]};
+    init_particles(particles, 0, header->max_x, header->max_y, forces, header->radius, header->collision_loss, header->influence_radius);
+    particles->target_density = header->target_density;
+    particles->pressure_multiplier = header->pressure_multiplier;
+    particles->viscosity = header->viscosity;
+    particles->seed = header->seed;
+    particles->step = header->step;
+    particles->emitted = header->emitted;
+    reserve_particles(particles, n);
+    set_neighbor_skin(particles, header->neighbor_skin);
+
+    real_t** arrays[CHECKPOINT_ARRAYS] = {&particles->x, &particles->y, &particles->vx, &particles->vy, &particles->density};
+    for (int k = 0; k < CHECKPOINT_ARRAYS; k++) {
+        free(*arrays[k]);
+        *arrays[k] = (real_t*)((char*)mapping + header->array_offsets[k]);
+    }
+    particles->num_particles = n;
+    particles->mapping = mapping;
+    particles->mapping_size = info.st_size;
+
+    return true;
+}
+
+// Drops the checkpoint mapping. The state arrays must no longer point into it.
+void unmap_checkpoint(Particles* particles) {
+    if (particles->mapping == NULL) return;
+    munmap(particles->mapping, particles->mapping_size);
+    particles->mapping = NULL;
+    particles->mapping_size = 0;
+}
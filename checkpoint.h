@@ -0,0 +1,47 @@
+#pragma once
+
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <stdint.h>
+#include "particles.h"
+
+// Binary snapshot of the particle state: a fixed header followed by the x, y, vx, vy and
+// density arrays, each starting on a CHECKPOINT_ALIGN boundary. Values are stored in the
+// native byte order and real_t width, so a load maps the file and points the arrays
+// straight into it.
+#define CHECKPOINT_MAGIC "FLUIDCKP"
+#define CHECKPOINT_VERSION 3
+#define CHECKPOINT_ALIGN 64
+#define CHECKPOINT_ARRAYS 5
+#define CHECKPOINT_FILE "fluid.ckpt"
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint32_t real_size;
+    int32_t num_particles;
+    double max_x;
+    double max_y;
+    double forces[2];
+    double radius;
+    double influence_radius;
+    double collision_loss;
+    double target_density;
+    double pressure_multiplier;
+    double viscosity;
+    double neighbor_skin;
+    uint64_t seed;
+    uint32_t step;
+    uint32_t emitted;
+    uint64_t array_offsets[CHECKPOINT_ARRAYS];
+    uint64_t file_size;
+} CheckpointHeader;
+
+// Function prototypes
+bool save_checkpoint(Particles* particles, const char* path);
+bool load_checkpoint(Particles* particles, const char* path);
+void unmap_checkpoint(Particles* particles);
+
+#endif /* CHECKPOINT_H */
@@ -0,0 +1,279 @@
+#include "distributed.h"
+#include "profile.h"
+#include <stdio.h>
+#include <math.h>
+
+// Values packed per particle in the ghost and migration messages
+#define GHOST_VALUES 4
+#define MIGRANT_VALUES 5
+
+bool init_domain(Domain* domain, MPI_Comm comm, double max_x, double influence_radius) {
+    memset(domain, 0, sizeof(*domain));
+    domain->comm = comm;
+    MPI_Comm_rank(comm, &domain->rank);
+    MPI_Comm_size(comm, &domain->size);
+    domain->left = domain->rank > 0 ? domain->rank - 1 : MPI_PROC_NULL;
+    domain->right = domain->rank < domain->size - 1 ? domain->rank + 1 : MPI_PROC_NULL;
+    domain->slab_min = max_x * domain->rank / domain->size;
+    domain->slab_max = max_x * (domain->rank + 1) / domain->size;
+    return domain->size == 1 || max_x / domain->size >= 2 * influence_radius;
+}
+
+void free_domain(Domain* domain) {
+    free(domain->send_left);
+    free(domain->send_right);
+    free(domain->send_buffer);
+    free(domain->recv_buffer);
+}
+
+void reserve_exchange_buffer(real_t** buffer, size_t* capacity, size_t count) {
+    if (count <= *capacity) return;
+    free(*buffer);
+    *buffer = malloc(count * sizeof(real_t));
+    if (*buffer == NULL) {
+        perror("Memory allocation failed for the exchange buffers.");
+        exit(EXIT_FAILURE);
+    }
+    *capacity = count;
+}
+
+// Swaps counts and then values with both neighbors. send holds the values for the left
+// neighbor followed by those for the right one; recv gets the values from the left
+// followed by those from the right.
+void exchange_with_neighbors(Domain* domain, const real_t* send, int send_left, int send_right, int values, int* recv_left, int* recv_right) {
+    MPI_Sendrecv(&send_right, 1, MPI_INT, domain->right, 0, recv_left, 1, MPI_INT, domain->left, 0, domain->comm, MPI_STATUS_IGNORE);
+    MPI_Sendrecv(&send_left, 1, MPI_INT, domain->left, 1, recv_right, 1, MPI_INT, domain->right, 1, domain->comm, MPI_STATUS_IGNORE);
+    if (domain->left == MPI_PROC_NULL) *recv_left = 0;
+    if (domain->right == MPI_PROC_NULL) *recv_right = 0;
+
+    reserve_exchange_buffer(&domain->recv_buffer, &domain->recv_buffer_capacity, (size_t)(*recv_left + *recv_right) * values + 1);
+    MPI_Sendrecv(send + (size_t)send_left * values, send_right * values, MPI_REAL_T, domain->right, 2,
+                 domain->recv_buffer, *recv_left * values, MPI_REAL_T, domain->left, 2, domain->comm, MPI_STATUS_IGNORE);
+    MPI_Sendrecv(send, send_left * values, MPI_REAL_T, domain->left, 3,
+                 domain->recv_buffer + (size_t)*recv_left * values, *recv_right * values, MPI_REAL_T, domain->right, 3, domain->comm, MPI_STATUS_IGNORE);
+}
+
+// One step: the phases of update_particles on the owned particles, with the ghosts
+// refreshed after the prediction and their densities after the density pass
+void distributed_step(Domain* domain, Particles* particles, double dt) {
+    int owned = domain->num_owned;
+    particles->num_particles = owned;
+    PROFILE_BEGIN(STEP);
+    predict_positions(particles, dt, owned);
+    exchange_ghosts(domain, particles);
+
+    // Ghost indices change every step, so the lookup is rebuilt rather than patched
+    particles->lookup_valid = false;
+    update_spatial_lookup(particles);
+    compute_densities(particles, owned);
+    exchange_ghost_densities(domain, particles);
+    compute_accelerations(particles, owned);
+    integrate_particles(particles, dt, owned);
+    PROFILE_END(STEP);
+    particles->step++;
+
+    particles->num_particles = owned;
+    migrate_particles(domain, particles);
+}
+
+// Sends every owned particle whose predicted position is close enough to a slab boundary
+// to matter for the neighbor, and appends the ones received. Predicted positions can lie
+// past the slab edge, so the margin is the influence radius plus the largest excursion.
+void exchange_ghosts(Domain* domain, Particles* particles) {
+    int owned = domain->num_owned;
+    real_t slab_min = (real_t)domain->slab_min;
+    real_t slab_max = (real_t)domain->slab_max;
+
+    double excursion = 0;
+    #pragma omp parallel for reduction(max:excursion)
+    for (int i = 0; i < owned; i++) {
+        double outside = fmax(slab_min - particles->x[i], particles->x[i] - slab_max);
+        if (outside > excursion) excursion = outside;
+    }
+    MPI_Allreduce(MPI_IN_PLACE, &excursion, 1, MPI_DOUBLE, MPI_MAX, domain->comm);
+    real_t margin = (real_t)(particles->influence_radius + excursion);
+
+    if (owned > domain->send_capacity) {
+        free(domain->send_left);
+        free(domain->send_right);
+        domain->send_left = malloc(owned * sizeof(int));
+        domain->send_right = malloc(owned * sizeof(int));
+        if (domain->send_left == NULL || domain->send_right == NULL) {
+            perror("Memory allocation failed for the ghost lists.");
+            exit(EXIT_FAILURE);
+        }
+        domain->send_capacity = owned;
+    }
+    domain->num_send_left = domain->num_send_right = 0;
+    for (int i = 0; i < owned; i++) {
+        if (domain->left != MPI_PROC_NULL && particles->x[i] < slab_min + margin) {
+            domain->send_left[domain->num_send_left++] = i;
+        }
+        if (domain->right != MPI_PROC_NULL && particles->x[i] >= slab_max - margin) {
+            domain->send_right[domain->num_send_right++] = i;
+        }
+    }
+
+    int num_send = domain->num_send_left + domain->num_send_right;
+    reserve_exchange_buffer(&domain->send_buffer, &domain->send_buffer_capacity, (size_t)num_send * GHOST_VALUES + 1);
+    real_t* out = domain->send_buffer;
+    for (int k = 0; k < num_send; k++) {
+        int i = k < domain->num_send_left ? domain->send_left[k] : domain->send_right[k - domain->num_send_left];
+        *out++ = particles->x[i];
+        *out++ = particles->y[i];
+        *out++ = particles->vx[i];
+        *out++ = particles->vy[i];
+    }
+
+    int recv_left, recv_right;
+    exchange_with_neighbors(domain, domain->send_buffer, domain->num_send_left, domain->num_send_right, GHOST_VALUES, &recv_left, &recv_right);
+
+    domain->num_ghosts = recv_left + recv_right;
+    domain->ghosts_received += domain->num_ghosts;
+    reserve_particles(particles, owned + domain->num_ghosts);
+    const real_t* in = domain->recv_buffer;
+    for (int i = owned; i < owned + domain->num_ghosts; i++) {
+        particles->x[i] = *in++;
+        particles->y[i] = *in++;
+        particles->vx[i] = *in++;
+        particles->vy[i] = *in++;
+    }
+    particles->num_particles = owned + domain->num_ghosts;
+}
+
+// Densities of the ghosts, in the order exchange_ghosts appended them
+void exchange_ghost_densities(Domain* domain, Particles* particles) {
+    int num_send = domain->num_send_left + domain->num_send_right;
+    for (int k = 0; k < num_send; k++) {
+        int i = k < domain->num_send_left ? domain->send_left[k] : domain->send_right[k - domain->num_send_left];
+        domain->send_buffer[k] = particles->density[i];
+    }
+
+    int recv_left, recv_right;
+    exchange_with_neighbors(domain, domain->send_buffer, domain->num_send_left, domain->num_send_right, 1, &recv_left, &recv_right);
+    memcpy(particles->density + domain->num_owned, domain->recv_buffer, domain->num_ghosts * sizeof(real_t));
+}
+
+// Hands the owned particles that left the slab to the neighbor on that side. A particle
+// that crossed more than one slab is passed on again at the next step.
+void migrate_particles(Domain* domain, Particles* particles) {
+    int owned = domain->num_owned;
+    real_t slab_min = (real_t)domain->slab_min;
+    real_t slab_max = (real_t)domain->slab_max;
+
+    reserve_exchange_buffer(&domain->send_buffer, &domain->send_buffer_capacity, (size_t)owned * MIGRANT_VALUES + 1);
+    // Left-bound migrants fill the buffer from the front, right-bound ones from the back
+    real_t* left_out = domain->send_buffer;
+    real_t* right_out = domain->send_buffer + (size_t)owned * MIGRANT_VALUES;
+    int send_left = 0, send_right = 0;
+    int kept = 0;
+    for (int i = 0; i < owned; i++) {
+        bool to_left = domain->left != MPI_PROC_NULL && particles->x[i] < slab_min;
+        bool to_right = domain->right != MPI_PROC_NULL && particles->x[i] >= slab_max;
+        if (to_left || to_right) {
+            real_t* out = to_left ? left_out + (size_t)send_left++ * MIGRANT_VALUES : (right_out -= MIGRANT_VALUES);
+            send_right += to_right;
+            out[0] = particles->x[i];
+            out[1] = particles->y[i];
+            out[2] = particles->vx[i];
+            out[3] = particles->vy[i];
+            out[4] = particles->density[i];
+            continue;
+        }
+        particles->x[kept] = particles->x[i];
+        particles->y[kept] = particles->y[i];
+        particles->vx[kept] = particles->vx[i];
+        particles->vy[kept] = particles->vy[i];
+        particles->density[kept] = particles->density[i];
+        kept++;
+    }
+    // Close the gap so the right-bound block follows the left-bound one
+    memmove(domain->send_buffer + (size_t)send_left * MIGRANT_VALUES, right_out, (size_t)send_right * MIGRANT_VALUES * sizeof(real_t));
+
+    int recv_left, recv_right;
+    exchange_with_neighbors(domain, domain->send_buffer, send_left, send_right, MIGRANT_VALUES, &recv_left, &recv_right);
+
+    int received = recv_left + recv_right;
+    reserve_particles(particles, kept + received);
+    const real_t* in = domain->recv_buffer;
+    for (int i = kept; i < kept + received; i++) {
+        particles->x[i] = *in++;
+        particles->y[i] = *in++;
+        particles->vx[i] = *in++;
+        particles->vy[i] = *in++;
+        particles->density[i] = *in++;
+    }
+    domain->num_owned = particles->num_particles = kept + received;
+    domain->num_ghosts = 0;
+    domain->particles_migrated += send_left + send_right;
+    particles->lookup_valid = false;
+    particles->neighbor_lists_valid = false;
+}
+
+// Drops the particles outside this rank's slab, for starts where every rank generated
+// the whole domain
+void keep_slab_particles(Domain* domain, Particles* particles) {
+    if (domain->left != MPI_PROC_NULL) {
+        remove_particles(particles, (Region) { -INFINITY, -INFINITY, nextafter(domain->slab_min, -INFINITY), INFINITY });
+    }
+    if (domain->right != MPI_PROC_NULL) {
+        remove_particles(particles, (Region) { domain->slab_max, -INFINITY, INFINITY, INFINITY });
+    }
+    domain->num_owned = particles->num_particles;
+    domain->num_ghosts = 0;
+}
+
+long global_particle_count(Domain* domain) {
+    long count = domain->num_owned;
+    MPI_Allreduce(MPI_IN_PLACE, &count, 1, MPI_LONG, MPI_SUM, domain->comm);
+    return count;
+}
+
+// Collects every rank's owned particles into global on rank 0, which then owns it.
+// Returns true on rank 0.
+bool gather_particles(Domain* domain, Particles* particles, Particles* global) {
+    int* counts = NULL;
+    int* offsets = NULL;
+    int total = 0;
+    if (domain->rank == 0) {
+        counts = malloc(domain->size * sizeof(int));
+        offsets = malloc(domain->size * sizeof(int));
+        if (counts == NULL || offsets == NULL) {
+            perror("Memory allocation failed for the particle gather.");
+            exit(EXIT_FAILURE);
+        }
+    }
+    MPI_Gather(&domain->num_owned, 1, MPI_INT, counts, 1, MPI_INT, 0, domain->comm);
+    if (domain->rank == 0) {
+        for (int r = 0; r < domain->size; r++) {
+            offsets[r] = total;
+            total += counts[r];
+        }
+        double forces[2] = {particles->forces[0], particles->forces[1]};
+        init_particles(global, 0, particles->max_x, particles->max_y, forces, particles->radius, particles->collision_loss, particles->influence_radius);
+        global->target_density = particles->target_density;
+        global->pressure_multiplier = particles->pressure_multiplier;
+        global->viscosity = particles->viscosity;
+        global->seed = particles->seed;
+        global->step = particles->step;
+        reserve_particles(global, total);
+        global->num_particles = total;
+    }
+
+    real_t* local[5] = {particles->x, particles->y, particles->vx, particles->vy, particles->density};
+    real_t* gathered[5] = {NULL};
+    if (domain->rank == 0) {
+        gathered[0] = global->x;
+        gathered[1] = global->y;
+        gathered[2] = global->vx;
+        gathered[3] = global->vy;
+        gathered[4] = global->density;
+    }
+    for (int k = 0; k < 5; k++) {
+        MPI_Gatherv(local[k], domain->num_owned, MPI_REAL_T, gathered[k], counts, offsets, MPI_REAL_T, 0, domain->comm);
+    }
+
+    free(counts);
+    free(offsets);
+    return domain->rank == 0;
+}
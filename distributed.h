@@ -0,0 +1,55 @@
+#pragma once
+
+#ifndef DISTRIBUTED_H
+#define DISTRIBUTED_H
+
+#include <mpi.h>
+#include "particles.h"
+
+#ifdef USE_FLOAT32
+#define MPI_REAL_T MPI_FLOAT
+#else
+#define MPI_REAL_T MPI_DOUBLE
+#endif
+
+// Slab decomposition along x: rank r owns the particles with x in [slab_min, slab_max).
+// Every rank keeps an ordinary Particles over the whole domain, holding its owned
+// particles first and, during a step, copies of its neighbors' boundary particles (ghosts)
+// after them. Ghosts come from the adjacent slabs only, so slabs must be at least two
+// influence radii wide.
+typedef struct {
+    MPI_Comm comm;
+    int rank;
+    int size;
+    int left;
+    int right;
+    double slab_min;
+    double slab_max;
+    int num_owned;
+    int num_ghosts;
+    // Owned particles sent as ghosts to each neighbor, reused for the density exchange
+    int* send_left;
+    int* send_right;
+    int num_send_left;
+    int num_send_right;
+    int send_capacity;
+    real_t* send_buffer;
+    real_t* recv_buffer;
+    size_t send_buffer_capacity;
+    size_t recv_buffer_capacity;
+    long ghosts_received;
+    long particles_migrated;
+} Domain;
+
+// Function prototypes
+bool init_domain(Domain* domain, MPI_Comm comm, double max_x, double influence_radius);
+void free_domain(Domain* domain);
+void distributed_step(Domain* domain, Particles* particles, double dt);
+void exchange_ghosts(Domain* domain, Particles* particles);
+void exchange_ghost_densities(Domain* domain, Particles* particles);
+void migrate_particles(Domain* domain, Particles* particles);
+void keep_slab_particles(Domain* domain, Particles* particles);
+long global_particle_count(Domain* domain);
+bool gather_particles(Domain* domain, Particles* particles, Particles* global);
+
+#endif /* DISTRIBUTED_H */
@@ -0,0 +1,311 @@
+// Ensemble driver: runs the cartesian product of the given parameter lists as independent
+// simulations in one process and writes one summary row per member.
+//
+//   make ensemble
+//   ./ensemble -n 1000,2000 -target-density 0.02:0.035:4 -pressure 0.25,0.5,1 -steps 500 -o sweep.csv
+//
+// Lists are comma separated values or start:stop:count ranges. Members small enough that
+// their own parallel loops would not scale run one per thread, several threads at a time;
+// larger ones run one after another on the whole team.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <stdbool.h>
+#include <float.h>
+#include "particles.h"
+#include "simd.h"
+#include "neighbor_list.h"
+#include "checkpoint.h"
+#include "trajectory.h"
+#include "sdf.h"
+#include "scenarios.h"
+#include "profile.h"
+
+#define ENSEMBLE_MAX_LIST 64
+// Members with at least this many particles get the whole team to themselves
+#define ENSEMBLE_SHARED_LIMIT 20000
+
+typedef enum {
+    PARAM_PARTICLES,
+    PARAM_TARGET_DENSITY,
+    PARAM_PRESSURE,
+    PARAM_VISCOSITY,
+    PARAM_INFLUENCE_RADIUS,
+    PARAM_COLLISION_LOSS,
+    PARAM_GRAVITY_X,
+    PARAM_GRAVITY_Y,
+    PARAM_SEED,
+    PARAM_COUNT
+} Param;
+
+const char* param_options[PARAM_COUNT] = {
+    "-n", "-target-density", "-pressure", "-viscosity", "-influence", "-loss", "-gx", "-gy", "-seed"
+};
+
+typedef struct {
+    double values[PARAM_COUNT][ENSEMBLE_MAX_LIST];
+    int counts[PARAM_COUNT];
+    bool given[PARAM_COUNT];
+    Scenario scenario;
+    int steps;
+    double dt;
+    const char* output;
+} EnsembleConfig;
+
+typedef struct {
+    int id;
+    double params[PARAM_COUNT];
+    int thread;
+    double elapsed;
+    double mean_density;
+    double density_error;
+    double max_density;
+    double kinetic_energy;
+    double max_speed;
+} EnsembleMember;
+
+int parse_value_list(const char* text, double* values) {
+    double start, stop;
+    int steps;
+    if (sscanf(text, "%lf:%lf:%d", &start, &stop, &steps) == 3 && steps > 0) {
+        if (steps > ENSEMBLE_MAX_LIST) steps = ENSEMBLE_MAX_LIST;
+        for (int i = 0; i < steps; i++) {
+            values[i] = steps == 1 ? start : start + (stop - start) * i / (steps - 1);
+        }
+        return steps;
+    }
+
+    int count = 0;
+    char* copy = strdup(text);
+    for (char* tok = strtok(copy, ","); tok != NULL && count < ENSEMBLE_MAX_LIST; tok = strtok(NULL, ",")) {
+        values[count++] = atof(tok);
+    }
+    free(copy);
+    return count;
+}
+
+void print_usage(const char* program) {
+    fprintf(stderr, "Usage: %s [options]\n", program);
+    fprintf(stderr, "  -n <list>               particle counts (default %d)\n", NUM_PARTICLES);
+    fprintf(stderr, "  -target-density <list>  rest densities (default %g)\n", TARGET_DENSITY);
+    fprintf(stderr, "  -pressure <list>        pressure multipliers (default %g)\n", P_MULT);
+    fprintf(stderr, "  -viscosity <list>       viscosity strengths (default %d)\n", VISCOSITY_STRENGTH);
+    fprintf(stderr, "  -influence <list>       influence radii (default %d)\n", INFLUENCE_RADIUS);
+    fprintf(stderr, "  -loss <list>            wall collision losses (default %g)\n", COLLISION_LOSS);
+    fprintf(stderr, "  -gx <list>, -gy <list>  gravity (default %d, %d, or %g downward for dam_break)\n", GRAVITY_X, GRAVITY_Y, SCENARIO_GRAVITY);
+    fprintf(stderr, "  -seed <list>            scenario seeds (default 1)\n");
+    fprintf(stderr, "  -scenario <s>           uniform, dam_break or clustered (default uniform)\n");
+    fprintf(stderr, "  -steps <count>          steps per member (default 500)\n");
+    fprintf(stderr, "  -dt <dt>                time step (default 1)\n");
+    fprintf(stderr, "  -o <path>               output file (default stdout)\n");
+}
+
+bool parse_args(int argc, char** argv, EnsembleConfig* config) {
+    for (int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        if (strcmp(arg, "--help") == 0 || i + 1 >= argc) {
+            return false;
+        }
+        const char* value = argv[++i];
+        bool found = false;
+        for (int p = 0; p < PARAM_COUNT && !found; p++) {
+            if (strcmp(arg, param_options[p]) == 0) {
+                config->counts[p] = parse_value_list(value, config->values[p]);
+                config->given[p] = true;
+                found = true;
+            }
+        }
+        if (found) continue;
+        if (strcmp(arg, "-steps") == 0) config->steps = atoi(value);
+        else if (strcmp(arg, "-dt") == 0) config->dt = atof(value);
+        else if (strcmp(arg, "-o") == 0) config->output = value;
+        else if (strcmp(arg, "-scenario") == 0) {
+            if (!parse_scenario(value, &config->scenario)) {
+                fprintf(stderr, "Unknown scenario %s\n", value);
+                return false;
+            }
+        }
+        else {
+            fprintf(stderr, "Unknown option %s\n", arg);
+            return false;
+        }
+    }
+
+    if (!config->given[PARAM_GRAVITY_X] && !config->given[PARAM_GRAVITY_Y]) {
+        double gravity[2];
+        scenario_gravity(config->scenario, gravity);
+        config->values[PARAM_GRAVITY_X][0] = gravity[0];
+        config->values[PARAM_GRAVITY_Y][0] = gravity[1];
+    }
+    for (int p = 0; p < PARAM_COUNT; p++) {
+        if (config->counts[p] == 0) {
+            fprintf(stderr, "Empty list for %s\n", param_options[p]);
+            return false;
+        }
+    }
+    return config->steps >= 0 && config->dt > 0;
+}
+
+// Expands the parameter lists into members, the first parameter varying slowest
+EnsembleMember* build_members(const EnsembleConfig* config, int* num_members) {
+    int total = 1;
+    for (int p = 0; p < PARAM_COUNT; p++) total *= config->counts[p];
+
+    EnsembleMember* members = calloc(total, sizeof(EnsembleMember));
+    if (members == NULL) {
+        perror("Memory allocation failed for the ensemble.");
+        exit(EXIT_FAILURE);
+    }
+    for (int m = 0; m < total; m++) {
+        members[m].id = m;
+        int rest = m;
+        for (int p = PARAM_COUNT - 1; p >= 0; p--) {
+            members[m].params[p] = config->values[p][rest % config->counts[p]];
+            rest /= config->counts[p];
+        }
+    }
+    *num_members = total;
+    return members;
+}
+
+void run_member(const EnsembleConfig* config, EnsembleMember* member) {
+    const double* params = member->params;
+    int n = (int)params[PARAM_PARTICLES];
+    // Same number density as the default scene, as in the benchmarks
+    double scale = sqrt((double)n / NUM_PARTICLES);
+    double forces[2] = {params[PARAM_GRAVITY_X], params[PARAM_GRAVITY_Y]};
+
+    Particles particles;
+    init_particles(&particles, n, WIN_WIDTH * scale, WIN_HEIGHT * scale, forces, BALL_RADIUS, params[PARAM_COLLISION_LOSS], params[PARAM_INFLUENCE_RADIUS]);
+    apply_scenario(&particles, config->scenario, (unsigned int)params[PARAM_SEED]);
+    particles.target_density = params[PARAM_TARGET_DENSITY];
+    particles.pressure_multiplier = params[PARAM_PRESSURE];
+    particles.viscosity = params[PARAM_VISCOSITY];
+
+    double start_time = omp_get_wtime();
+    for (int step = 0; step < config->steps; step++) {
+        update_particles(&particles, config->dt, step);
+    }
+    member->elapsed = omp_get_wtime() - start_time;
+    member->thread = omp_get_thread_num();
+
+    double density_sum = 0, error_sum = 0, energy_sum = 0;
+    double max_density = 0, max_speed = 0;
+    for (int i = 0; i < particles.num_particles; i++) {
+        double density = particles.density[i];
+        double error = density - particles.target_density;
+        double speed2 = particles.vx[i] * particles.vx[i] + particles.vy[i] * particles.vy[i];
+        density_sum += density;
+        error_sum += error * error;
+        energy_sum += speed2 / 2;
+        if (density > max_density) max_density = density;
+        if (speed2 > max_speed) max_speed = speed2;
+    }
+    int count = particles.num_particles > 0 ? particles.num_particles : 1;
+    member->mean_density = density_sum / count;
+    member->density_error = sqrt(error_sum / count) / particles.target_density;
+    member->max_density = max_density;
+    member->kinetic_energy = energy_sum / count;
+    member->max_speed = sqrt(max_speed);
+
+    free_particles(&particles);
+}
+
+// Warns about members that differ only in gy but end with the same kinetic energy, which
+// means the gravity sweep did not reach the simulation. Members must be in id order.
+void check_gravity_sweep(const EnsembleConfig* config, const EnsembleMember* members, int num_members) {
+    if (config->steps == 0) return;
+    // Member ids are mixed-radix numbers over the parameters, seed varying fastest
+    int stride = config->counts[PARAM_SEED];
+    int count = config->counts[PARAM_GRAVITY_Y];
+    for (int m = 0; m < num_members; m++) {
+        if ((m / stride) % count + 1 >= count) continue;
+        const EnsembleMember* other = &members[m + stride];
+        if (members[m].params[PARAM_GRAVITY_Y] != other->params[PARAM_GRAVITY_Y] && members[m].kinetic_energy == other->kinetic_energy) {
+            fprintf(stderr, "Members %d and %d differ only in gy but have the same kinetic energy\n", members[m].id, other->id);
+        }
+    }
+}
+
+int compare_member_size(const void* a, const void* b) {
+    double na = ((const EnsembleMember*)a)->params[PARAM_PARTICLES];
+    double nb = ((const EnsembleMember*)b)->params[PARAM_PARTICLES];
+    return (na < nb) - (na > nb);
+}
+
+int compare_member_id(const void* a, const void* b) {
+    return ((const EnsembleMember*)a)->id - ((const EnsembleMember*)b)->id;
+}
+
+int main(int argc, char** argv) {
+    EnsembleConfig config = {
+        .scenario = SCENARIO_UNIFORM,
+        .steps = 500,
+        .dt = 1,
+        .output = NULL,
+    };
+    double defaults[PARAM_COUNT] = {NUM_PARTICLES, TARGET_DENSITY, P_MULT, VISCOSITY_STRENGTH, INFLUENCE_RADIUS, COLLISION_LOSS, GRAVITY_X, GRAVITY_Y, 1};
+    for (int p = 0; p < PARAM_COUNT; p++) {
+        config.values[p][0] = defaults[p];
+        config.counts[p] = 1;
+    }
+    if (!parse_args(argc, argv, &config)) {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    FILE* out = config.output ? fopen(config.output, "w") : stdout;
+    if (out == NULL) {
+        perror("Could not open the output file");
+        return EXIT_FAILURE;
+    }
+
+    int num_members;
+    EnsembleMember* members = build_members(&config, &num_members);
+    // Largest first, so the shared phase ends with the short members filling the gaps
+    qsort(members, num_members, sizeof(EnsembleMember), compare_member_size);
+    int num_large = 0;
+    while (num_large < num_members && members[num_large].params[PARAM_PARTICLES] >= ENSEMBLE_SHARED_LIMIT) num_large++;
+
+    init_simd();
+    omp_set_max_active_levels(1);
+    fprintf(stderr, "Members: %d (%d on the whole team), threads: %d, simd: %s\n",
+            num_members, num_large, omp_get_max_threads(), simd_level_name(get_simd_level()));
+
+    double start_time = omp_get_wtime();
+    for (int m = 0; m < num_large; m++) {
+        run_member(&config, &members[m]);
+    }
+    #pragma omp parallel
+    {
+        // Each member's own parallel loops run serially on the thread that owns it
+        omp_set_num_threads(1);
+        #pragma omp for schedule(dynamic, 1)
+        for (int m = num_large; m < num_members; m++) {
+            run_member(&config, &members[m]);
+        }
+    }
+    double elapsed = omp_get_wtime() - start_time;
+    fprintf(stderr, "Elapsed: %.3f s\n", elapsed);
+    PROFILE_REPORT(stderr);
+    qsort(members, num_members, sizeof(EnsembleMember), compare_member_id);
+    check_gravity_sweep(&config, members, num_members);
+
+    fprintf(out, "member,particles,target_density,pressure_multiplier,viscosity,influence_radius,collision_loss,gx,gy,seed,steps,thread,elapsed_s,mean_density,density_rms_error,max_density,kinetic_energy,max_speed\n");
+    for (int m = 0; m < num_members; m++) {
+        const EnsembleMember* member = &members[m];
+        const double* params = member->params;
+        fprintf(out, "%d,%d,%g,%g,%g,%g,%g,%g,%g,%u,%d,%d,%.6f,%.6g,%.6g,%.6g,%.6g,%.6g\n",
+                member->id, (int)params[PARAM_PARTICLES], params[PARAM_TARGET_DENSITY], params[PARAM_PRESSURE], params[PARAM_VISCOSITY],
+                params[PARAM_INFLUENCE_RADIUS], params[PARAM_COLLISION_LOSS], params[PARAM_GRAVITY_X], params[PARAM_GRAVITY_Y],
+                (unsigned int)params[PARAM_SEED], config.steps, member->thread, member->elapsed, member->mean_density,
+                member->density_error, member->max_density, member->kinetic_energy, member->max_speed);
+    }
+
+    if (out != stdout) fclose(out);
+    free(members);
+
+    return 0;
+}
@@ -0,0 +1,153 @@
+#include "field.h"
+#include "profile.h"
+#include <math.h>
+#include <float.h>
+
+void init_field(Field* field, FieldKind kind, int width, int height, int resolution) {
+    field->kind = kind;
+    field->width = width;
+    field->height = height;
+    field->values = NULL;
+    field->min = field->max = field->mean = 0;
+    set_field_resolution(field, resolution);
+}
+
+void set_field_resolution(Field* field, int resolution) {
+    if (resolution < 1) resolution = 1;
+    free(field->values);
+    field->values = NULL;
+    field->resolution = resolution;
+    // One extra sample past the far edge so interpolation covers the whole area
+    field->cols = (field->width - 1) / resolution + 2;
+    field->rows = (field->height - 1) / resolution + 2;
+}
+
+void free_field(Field* field) {
+    free(field->values);
+    field->values = NULL;
+}
+
+// Samples the field over the grid. Work is split by spatial-lookup cell: the particles
+// of a cell's 3x3 neighborhood are gathered once into a thread-local buffer and every
+// sample inside that cell is evaluated against it, so the lookup is not re-queried per
+// sample. Requires the spatial lookup to be up to date with the particle positions.
+void sample_field(Particles* particles, Field* field) {
+    if (field->values == NULL) {
+        field->values = malloc((size_t)field->cols * field->rows * sizeof(float));
+        if (field->values == NULL) {
+            perror("Memory allocation failed for the field.");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    real_t h = (real_t)particles->influence_radius;
+    real_t h2 = h * h;
+    real_t cell_size = (real_t)particles->cell_size;
+    int res = field->resolution;
+    int cells_x = (int)((field->cols - 1) * res / cell_size) + 1;
+    int cells_y = (int)((field->rows - 1) * res / cell_size) + 1;
+
+    double total = 0;
+    double min_value = DBL_MAX;
+    double max_value = -DBL_MAX;
+
+    PROFILE_BEGIN(FIELD);
+    #pragma omp parallel reduction(+:total) reduction(min:min_value) reduction(max:max_value)
+    {
+        PROFILE_WORK_BEGIN(FIELD);
+        int capacity = 256;
+        real_t* bx = malloc(capacity * sizeof(real_t));
+        real_t* by = malloc(capacity * sizeof(real_t));
+        if (bx == NULL || by == NULL) {
+            perror("Memory allocation failed for the field neighborhood.");
+            exit(EXIT_FAILURE);
+        }
+
+        #pragma omp for collapse(2) schedule(dynamic) nowait
+        for (int cx = 0; cx < cells_x; cx++) {
+            for (int cy = 0; cy < cells_y; cy++) {
+                // Samples whose coordinates fall into this cell
+                int i_begin = (int)ceil(cx * cell_size / res);
+                int i_end = (int)ceil((cx + 1) * cell_size / res);
+                int j_begin = (int)ceil(cy * cell_size / res);
+                int j_end = (int)ceil((cy + 1) * cell_size / res);
+                if (i_end > field->cols) i_end = field->cols;
+                if (j_end > field->rows) j_end = field->rows;
+                if (i_begin >= i_end || j_begin >= j_end) continue;
+
+                // Gather the neighborhood once for all samples in the cell
+                int count = 0;
+                int spans[MAX_NEIGHBOR_SPANS][2];
+                int num_spans = cell_neighbor_spans(particles, cx, cy, spans);
+                for (int s = 0; s < num_spans; s++) {
+                    for (int k = spans[s][0]; k < spans[s][1]; k++) {
+                        if (count == capacity) {
+                            capacity *= 2;
+                            real_t* grown_x = realloc(bx, capacity * sizeof(real_t));
+                            real_t* grown_y = grown_x != NULL ? realloc(by, capacity * sizeof(real_t)) : NULL;
+                            if (grown_y == NULL) {
+                                perror("Memory allocation failed for the field neighborhood.");
+                                exit(EXIT_FAILURE);
+                            }
+                            bx = grown_x;
+                            by = grown_y;
+                        }
+                        int idx = particles->spatial_lookup[k].idx;
+                        bx[count] = particles->x[idx];
+                        by[count] = particles->y[idx];
+                        count++;
+                    }
+                }
+
+                for (int j = j_begin; j < j_end; j++) {
+                    real_t py = (real_t)(j * res);
+                    for (int i = i_begin; i < i_end; i++) {
+                        real_t px = (real_t)(i * res);
+                        real_t density = 0;
+                        for (int k = 0; k < count; k++) {
+                            real_t dx = bx[k] - px;
+                            real_t dy = by[k] - py;
+                            real_t d2 = dx * dx + dy * dy;
+                            if (d2 < h2) density += density_kernel(&particles->kernel, d2);
+                        }
+
+                        double value = field->kind == FIELD_PRESSURE ? convert_density_to_pressure(particles, density) : density;
+                        field->values[j * field->cols + i] = (float)value;
+                        total += value;
+                        if (value < min_value) min_value = value;
+                        if (value > max_value) max_value = value;
+                    }
+                }
+            }
+        }
+
+        free(bx);
+        free(by);
+        PROFILE_WORK_END(FIELD);
+    }
+    PROFILE_END(FIELD);
+
+    field->min = (float)min_value;
+    field->max = (float)max_value;
+    field->mean = (float)(total / ((double)field->cols * field->rows));
+}
+
+// Bilinear interpolation of the sampled field at a pixel position
+float field_value_at(const Field* field, double x, double y) {
+    double fx = x / field->resolution;
+    double fy = y / field->resolution;
+    int i = (int)fx;
+    int j = (int)fy;
+    if (i < 0) i = 0;
+    if (j < 0) j = 0;
+    if (i > field->cols - 2) i = field->cols - 2;
+    if (j > field->rows - 2) j = field->rows - 2;
+    float tx = (float)(fx - i);
+    float ty = (float)(fy - j);
+
+    const float* row0 = field->values + j * field->cols;
+    const float* row1 = row0 + field->cols;
+    float top = row0[i] + (row0[i + 1] - row0[i]) * tx;
+    float bottom = row1[i] + (row1[i + 1] - row1[i]) * tx;
+    return top + (bottom - top) * ty;
+}
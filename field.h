@@ -0,0 +1,38 @@
+#pragma once
+
+#ifndef FIELD_H
+#define FIELD_H
+
+#include "particles.h"
+
+// Default spacing in pixels between field samples for the overlays
+#define FIELD_RESOLUTION 4
+
+typedef enum {
+    FIELD_DENSITY,
+    FIELD_PRESSURE
+} FieldKind;
+
+// Scalar field sampled on a regular grid every `resolution` pixels over a width x height
+// area. Values are stored row-major in one buffer that is allocated on first use.
+typedef struct {
+    FieldKind kind;
+    int width;
+    int height;
+    int resolution;
+    int cols;
+    int rows;
+    float* values;
+    float min;
+    float max;
+    float mean;
+} Field;
+
+// Function prototypes
+void init_field(Field* field, FieldKind kind, int width, int height, int resolution);
+void set_field_resolution(Field* field, int resolution);
+void free_field(Field* field);
+void sample_field(Particles* particles, Field* field);
+float field_value_at(const Field* field, double x, double y);
+
+#endif /* FIELD_H */
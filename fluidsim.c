@@ -0,0 +1,160 @@
+#include "fluidsim.h"
+#include "particles.h"
+#include "neighbor_list.h"
+#include "scenarios.h"
+#include "sdf.h"
+#include "rng.h"
+#include <stdio.h>
+
+_Static_assert(sizeof(fluidsim_real) == sizeof(real_t), "fluidsim.h and the solver disagree on USE_FLOAT32");
+
+struct FluidSim {
+    Particles particles;
+    Obstacles obstacles;
+    FluidSimConfig config;
+    FluidSimCallback callback;
+    void* user_data;
+    long steps;
+};
+
+void fluidsim_default_config(FluidSimConfig* config) {
+    config->num_particles = NUM_PARTICLES;
+    config->width = WIN_WIDTH;
+    config->height = WIN_HEIGHT;
+    config->seed = RANDOM_DEFAULT_SEED;
+    config->scenario = "uniform";
+    config->obstacle_path = NULL;
+    config->particle_radius = BALL_RADIUS;
+    config->influence_radius = INFLUENCE_RADIUS;
+    config->dt = 1;
+    config->gravity[0] = GRAVITY_X;
+    config->gravity[1] = GRAVITY_Y;
+    config->collision_loss = COLLISION_LOSS;
+    config->target_density = TARGET_DENSITY;
+    config->pressure_multiplier = P_MULT;
+    config->viscosity = VISCOSITY_STRENGTH;
+    config->neighbor_skin = NEIGHBOR_SKIN;
+    config->incremental_lookup = true;
+    config->pair_forces = false;
+    config->reorder_interval = REORDER_INTERVAL;
+}
+
+// Copies the settings that may change between steps into the solver
+static void apply_runtime_config(FluidSim* sim, const FluidSimConfig* config) {
+    Particles* particles = &sim->particles;
+    particles->forces[0] = config->gravity[0];
+    particles->forces[1] = config->gravity[1];
+    particles->collision_loss = config->collision_loss;
+    particles->target_density = config->target_density;
+    particles->pressure_multiplier = config->pressure_multiplier;
+    particles->viscosity = config->viscosity;
+    if (config->neighbor_skin != particles->neighbor_skin) set_neighbor_skin(particles, config->neighbor_skin);
+    particles->incremental_lookup = config->incremental_lookup;
+    particles->pair_forces = config->pair_forces;
+    particles->reorder_interval = config->reorder_interval;
+    sim->config = *config;
+    // Only read at creation, and the caller's strings may not outlive it
+    sim->config.scenario = NULL;
+    sim->config.obstacle_path = NULL;
+}
+
+// Returns NULL if the configuration is invalid or the obstacle file cannot be read
+FluidSim* fluidsim_create(const FluidSimConfig* config) {
+    Scenario scenario = SCENARIO_UNIFORM;
+    if (config->scenario != NULL && !parse_scenario(config->scenario, &scenario)) {
+        fprintf(stderr, "Unknown scenario %s\n", config->scenario);
+        return NULL;
+    }
+    if (config->num_particles < 0 || config->width <= 0 || config->height <= 0 || config->dt <= 0 ||
+        config->particle_radius <= 0 || config->influence_radius <= 0) {
+        fprintf(stderr, "Particle count, domain size, dt and radii must be positive\n");
+        return NULL;
+    }
+
+    FluidSim* sim = malloc(sizeof(FluidSim));
+    if (sim == NULL) {
+        perror("Memory allocation failed for the simulation.");
+        exit(EXIT_FAILURE);
+    }
+    Particles* particles = &sim->particles;
+    double forces[2] = {config->gravity[0], config->gravity[1]};
+    init_particles(particles, config->num_particles, config->width, config->height, forces, config->particle_radius,
+                   config->collision_loss, config->influence_radius);
+    apply_scenario(particles, scenario, config->seed);
+    apply_runtime_config(sim, config);
+
+    init_obstacles(&sim->obstacles, config->width, config->height, SDF_RESOLUTION);
+    if (config->obstacle_path != NULL) {
+        if (!load_obstacles(&sim->obstacles, config->obstacle_path)) {
+            free_obstacles(&sim->obstacles);
+            free_particles(particles);
+            free(sim);
+            return NULL;
+        }
+        particles->obstacles = &sim->obstacles;
+        relocate_covered_particles(particles);
+    }
+
+    sim->callback = NULL;
+    sim->user_data = NULL;
+    sim->steps = 0;
+    return sim;
+}
+
+// Applies the settings that may change between steps. Returns false and changes nothing
+// if a setting fixed at creation differs, those need a new simulation. The scenario and
+// obstacle file are not compared, they only matter to fluidsim_create.
+bool fluidsim_configure(FluidSim* sim, const FluidSimConfig* config) {
+    const FluidSimConfig* current = &sim->config;
+    if (config->num_particles != current->num_particles || config->width != current->width || config->height != current->height ||
+        config->seed != current->seed || config->particle_radius != current->particle_radius ||
+        config->influence_radius != current->influence_radius || config->dt <= 0) {
+        return false;
+    }
+    apply_runtime_config(sim, config);
+    return true;
+}
+
+void fluidsim_set_callback(FluidSim* sim, FluidSimCallback callback, void* user_data) {
+    sim->callback = callback;
+    sim->user_data = user_data;
+}
+
+// Runs up to steps steps and returns how many ran
+int fluidsim_step(FluidSim* sim, int steps) {
+    for (int s = 0; s < steps; s++) {
+        update_particles(&sim->particles, sim->config.dt, (int)sim->steps);
+        sim->steps++;
+        if (sim->callback != NULL) {
+            FluidSimView view = fluidsim_view(sim);
+            if (!sim->callback(&view, sim->user_data)) return s + 1;
+        }
+    }
+    return steps > 0 ? steps : 0;
+}
+
+FluidSimView fluidsim_view(const FluidSim* sim) {
+    const Particles* particles = &sim->particles;
+    FluidSimView view = {
+        .num_particles = particles->num_particles,
+        .step = sim->steps,
+        .x = particles->x,
+        .y = particles->y,
+        .vx = particles->vx,
+        .vy = particles->vy,
+        .density = particles->density,
+        .ids = particles->ids,
+    };
+    return view;
+}
+
+void fluidsim_destroy(FluidSim* sim) {
+    if (sim == NULL) return;
+    free_particles(&sim->particles);
+    free_obstacles(&sim->obstacles);
+    free(sim);
+}
+
+int fluidsim_real_size(void) {
+    return (int)sizeof(fluidsim_real);
+}
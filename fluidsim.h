@@ -0,0 +1,81 @@
+#pragma once
+
+#ifndef FLUIDSIM_H
+#define FLUIDSIM_H
+
+#include <stdbool.h>
+
+// Embedding API of the solver library (libfluidsim.a). Depends on nothing but the C
+// standard library, the solver internals stay behind the opaque FluidSim.
+//
+//   FluidSimConfig config;
+//   fluidsim_default_config(&config);
+//   config.num_particles = 20000;
+//   FluidSim* sim = fluidsim_create(&config);
+//   fluidsim_step(sim, 100);
+//   FluidSimView view = fluidsim_view(sim);
+//   fluidsim_destroy(sim);
+//
+// The library and its users must agree on the floating point type: build both with or
+// both without -DUSE_FLOAT32, fluidsim_real_size() tells which one the library has.
+#ifdef USE_FLOAT32
+typedef float fluidsim_real;
+#else
+typedef double fluidsim_real;
+#endif
+
+typedef struct FluidSim FluidSim;
+
+typedef struct {
+    // Fixed at creation
+    int num_particles;
+    double width;
+    double height;
+    unsigned int seed;
+    const char* scenario;       // "uniform", "dam_break" or "clustered"
+    const char* obstacle_path;  // obstacle file as read by headless -obstacles, or NULL
+    double particle_radius;
+    double influence_radius;
+    // May change between steps through fluidsim_configure
+    double dt;
+    double gravity[2];
+    double collision_loss;
+    double target_density;
+    double pressure_multiplier;
+    double viscosity;
+    double neighbor_skin;
+    bool incremental_lookup;
+    bool pair_forces;
+    int reorder_interval;
+} FluidSimConfig;
+
+// Read-only view straight into the solver's arrays, nothing is copied. The pointers are
+// valid until the next call that steps, configures or destroys the simulation. Particles
+// are stored in the solver's order; when it reorders them ids[i] is the stable index of
+// the particle in slot i, otherwise ids is NULL and slot and index coincide.
+typedef struct {
+    int num_particles;
+    long step;
+    const fluidsim_real* x;
+    const fluidsim_real* y;
+    const fluidsim_real* vx;
+    const fluidsim_real* vy;
+    const fluidsim_real* density;
+    const int* ids;
+} FluidSimView;
+
+// Called after every step with the state of that step. Returning false stops
+// fluidsim_step before the remaining steps.
+typedef bool (*FluidSimCallback)(const FluidSimView* view, void* user_data);
+
+// Function prototypes
+void fluidsim_default_config(FluidSimConfig* config);
+FluidSim* fluidsim_create(const FluidSimConfig* config);
+bool fluidsim_configure(FluidSim* sim, const FluidSimConfig* config);
+void fluidsim_set_callback(FluidSim* sim, FluidSimCallback callback, void* user_data);
+int fluidsim_step(FluidSim* sim, int steps);
+FluidSimView fluidsim_view(const FluidSim* sim);
+void fluidsim_destroy(FluidSim* sim);
+int fluidsim_real_size(void);
+
+#endif /* FLUIDSIM_H */
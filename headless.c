@@ -0,0 +1,310 @@
+// Headless batch driver: runs update_particles() for a fixed number of steps without
+// creating a window, and reports solver throughput. Never includes or links SDL.
+//
+//   make headless
+//   ./headless -n 20000 -w 4000 -h 2600 -dt 1 -steps 500
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <stdbool.h>
+#include <float.h>
+#include "particles.h"
+#include "simd.h"
+#include "neighbor_list.h"
+#include "checkpoint.h"
+#include "trajectory.h"
+#include "sdf.h"
+#include "scenarios.h"
+#include "profile.h"
+
+typedef struct {
+    int num_particles;
+    double width;
+    double height;
+    double dt;
+    int steps;
+    unsigned int seed;
+    Scenario scenario;
+    double gravity[2];
+    bool gravity_set;
+    int report_every;
+    bool incremental_lookup;
+    double skin;
+    double viscosity;
+    bool skin_set;
+    bool viscosity_set;
+    // First option given that a checkpoint fixes, rejected together with -load
+    const char* initial_state_option;
+    bool pair_forces;
+    int reorder_every;
+    int inflow;
+    const char* obstacle_path;
+    const char* load_path;
+    const char* save_path;
+    const char* trajectory_path;
+    int trajectory_every;
+    const char* profile_prefix;
+} HeadlessConfig;
+
+void print_usage(const char* program) {
+    printf("Usage: %s [options]\n", program);
+    printf("  -n <count>      number of particles (default %d)\n", NUM_PARTICLES);
+    printf("  -w <width>      domain width (default %d)\n", WIN_WIDTH);
+    printf("  -h <height>     domain height (default %d)\n", WIN_HEIGHT);
+    printf("  -dt <dt>        time step (default 1)\n");
+    printf("  -steps <count>  number of steps to run (default 1000)\n");
+    printf("  -seed <seed>    seed for the initial layout (default 1)\n");
+    printf("  -scenario <s>   uniform, dam_break or clustered (default uniform)\n");
+    printf("  -gx <g>, -gy <g> gravity (default %d, %d, or %g downward for dam_break)\n", GRAVITY_X, GRAVITY_Y, SCENARIO_GRAVITY);
+    printf("  -lookup <mode>  full or incremental spatial lookup updates (default incremental)\n");
+    printf("  -skin <s>       Verlet neighbor-list skin, 0 disables the lists (default %d)\n", NEIGHBOR_SKIN);
+    printf("  -viscosity <v>  strength of the viscosity term, 0 disables it (default %d)\n", VISCOSITY_STRENGTH);
+    printf("  -forces <mode>  particle (each particle gathers its neighbors) or pair (each pair evaluated once) (default particle)\n");
+    printf("  -reorder <k>    reorder the particle arrays along a Morton curve every k steps, 0 to disable (default %d)\n", REORDER_INTERVAL);
+    printf("  -inflow <k>     emit k particles per step at the left edge and remove those reaching the right edge (default 0)\n");
+    printf("  -obstacles <file> static obstacles, one circle, box, capsule or polygon per line (see sdf.c)\n");
+    printf("  -load <file>    start from a checkpoint instead of a scenario; -gx, -gy, -skin and -viscosity override its values\n");
+    printf("  -save <file>    write a checkpoint after the last step\n");
+    printf("  -trajectory <file> record a trajectory while running\n");
+    printf("  -every <k>      record every k-th step of the trajectory (default 1)\n");
+    printf("  -report <k>     print progress every k steps, 0 to disable (default 0)\n");
+    printf("  -profile <p>    write phase timings to p.csv and a Chrome trace to p.json (needs -DFLUID_PROFILE)\n");
+}
+
+bool parse_args(int argc, char** argv, HeadlessConfig* config) {
+    for (int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        if (strcmp(arg, "--help") == 0) {
+            return false;
+        }
+        if (i + 1 >= argc) {
+            printf("Missing value for %s\n", arg);
+            return false;
+        }
+        const char* value = argv[++i];
+        if (config->initial_state_option == NULL && (strcmp(arg, "-n") == 0 || strcmp(arg, "-w") == 0 || strcmp(arg, "-h") == 0 ||
+                                                     strcmp(arg, "-seed") == 0 || strcmp(arg, "-scenario") == 0)) {
+            config->initial_state_option = arg;
+        }
+        if (strcmp(arg, "-n") == 0) config->num_particles = atoi(value);
+        else if (strcmp(arg, "-w") == 0) config->width = atof(value);
+        else if (strcmp(arg, "-h") == 0) config->height = atof(value);
+        else if (strcmp(arg, "-dt") == 0) config->dt = atof(value);
+        else if (strcmp(arg, "-steps") == 0) config->steps = atoi(value);
+        else if (strcmp(arg, "-seed") == 0) config->seed = (unsigned int)strtoul(value, NULL, 10);
+        else if (strcmp(arg, "-scenario") == 0) {
+            if (!parse_scenario(value, &config->scenario)) {
+                printf("Unknown scenario %s\n", value);
+                return false;
+            }
+        }
+        else if (strcmp(arg, "-gx") == 0) {
+            config->gravity[0] = atof(value);
+            config->gravity_set = true;
+        }
+        else if (strcmp(arg, "-gy") == 0) {
+            config->gravity[1] = atof(value);
+            config->gravity_set = true;
+        }
+        else if (strcmp(arg, "-report") == 0) config->report_every = atoi(value);
+        else if (strcmp(arg, "-skin") == 0) {
+            config->skin = atof(value);
+            config->skin_set = true;
+        }
+        else if (strcmp(arg, "-viscosity") == 0) {
+            config->viscosity = atof(value);
+            config->viscosity_set = true;
+        }
+        else if (strcmp(arg, "-forces") == 0) config->pair_forces = strcmp(value, "pair") == 0;
+        else if (strcmp(arg, "-reorder") == 0) config->reorder_every = atoi(value);
+        else if (strcmp(arg, "-inflow") == 0) config->inflow = atoi(value);
+        else if (strcmp(arg, "-obstacles") == 0) config->obstacle_path = value;
+        else if (strcmp(arg, "-load") == 0) config->load_path = value;
+        else if (strcmp(arg, "-save") == 0) config->save_path = value;
+        else if (strcmp(arg, "-trajectory") == 0) config->trajectory_path = value;
+        else if (strcmp(arg, "-every") == 0) config->trajectory_every = atoi(value);
+        else if (strcmp(arg, "-profile") == 0) config->profile_prefix = value;
+        else if (strcmp(arg, "-lookup") == 0) config->incremental_lookup = strcmp(value, "full") != 0;
+        else {
+            printf("Unknown option %s\n", arg);
+            return false;
+        }
+    }
+
+#ifndef FLUID_PROFILE
+    if (config->profile_prefix != NULL) {
+        printf("Built without -DFLUID_PROFILE, -profile is ignored\n");
+    }
+#endif
+    if (config->num_particles <= 0 || config->width <= 0 || config->height <= 0 || config->dt <= 0 || config->steps < 0) {
+        printf("Particle count, domain size and dt must be positive\n");
+        return false;
+    }
+    if (config->load_path != NULL && config->initial_state_option != NULL) {
+        printf("%s cannot be combined with -load, the checkpoint fixes it\n", config->initial_state_option);
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char** argv) {
+    HeadlessConfig config = {
+        .num_particles = NUM_PARTICLES,
+        .width = WIN_WIDTH,
+        .height = WIN_HEIGHT,
+        .dt = 1,
+        .steps = 1000,
+        .seed = 1,
+        .scenario = SCENARIO_UNIFORM,
+        .gravity = { GRAVITY_X, GRAVITY_Y },
+        .gravity_set = false,
+        .report_every = 0,
+        .incremental_lookup = true,
+        .skin = NEIGHBOR_SKIN,
+        .viscosity = VISCOSITY_STRENGTH,
+        .skin_set = false,
+        .viscosity_set = false,
+        .initial_state_option = NULL,
+        .pair_forces = false,
+        .reorder_every = REORDER_INTERVAL,
+        .inflow = 0,
+        .obstacle_path = NULL,
+        .load_path = NULL,
+        .save_path = NULL,
+        .trajectory_path = NULL,
+        .trajectory_every = 1,
+        .profile_prefix = NULL,
+    };
+    if (!parse_args(argc, argv, &config)) {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    Particles particles;
+    if (config.load_path != NULL) {
+        // The checkpoint carries the domain and physical parameters
+        double load_start = omp_get_wtime();
+        if (!load_checkpoint(&particles, config.load_path)) {
+            return EXIT_FAILURE;
+        }
+        printf("Loaded %s in %.3f ms\n", config.load_path, (omp_get_wtime() - load_start) * 1000);
+        config.num_particles = particles.num_particles;
+        config.width = particles.max_x;
+        config.height = particles.max_y;
+        if (config.gravity_set) {
+            particles.forces[0] = config.gravity[0];
+            particles.forces[1] = config.gravity[1];
+        }
+        if (config.skin_set) set_neighbor_skin(&particles, config.skin);
+        if (config.viscosity_set) particles.viscosity = config.viscosity;
+    } else {
+        if (!config.gravity_set) scenario_gravity(config.scenario, config.gravity);
+        init_particles(&particles, config.num_particles, config.width, config.height, config.gravity, BALL_RADIUS, COLLISION_LOSS, INFLUENCE_RADIUS);
+        apply_scenario(&particles, config.scenario, config.seed);
+        set_neighbor_skin(&particles, config.skin);
+        particles.viscosity = config.viscosity;
+    }
+    particles.incremental_lookup = config.incremental_lookup;
+    particles.pair_forces = config.pair_forces;
+    particles.reorder_interval = config.reorder_every;
+    Obstacles obstacles;
+    init_obstacles(&obstacles, particles.max_x, particles.max_y, SDF_RESOLUTION);
+    if (config.obstacle_path != NULL) {
+        double build_start = omp_get_wtime();
+        if (!load_obstacles(&obstacles, config.obstacle_path)) {
+            free_obstacles(&obstacles);
+            free_particles(&particles);
+            return EXIT_FAILURE;
+        }
+        particles.obstacles = &obstacles;
+        // A checkpoint was saved with the obstacles in place
+        int moved = config.load_path == NULL ? relocate_covered_particles(&particles) : 0;
+        printf("Obstacles: %d shapes on a %d x %d field in %.1f ms, %d particles moved out of them\n", obstacles.num_shapes, obstacles.cols,
+               obstacles.rows, (omp_get_wtime() - build_start) * 1000, moved);
+    }
+    if (config.trajectory_path != NULL) {
+        particles.trajectory = open_trajectory(config.trajectory_path, config.trajectory_every, particles.max_x, particles.max_y);
+        if (particles.trajectory == NULL) {
+            free_particles(&particles);
+            free_obstacles(&obstacles);
+            return EXIT_FAILURE;
+        }
+    }
+
+    printf("Scenario: %s, particles: %d, domain: %.0f x %.0f, dt: %g, steps: %d, threads: %d, simd: %s\n",
+           config.load_path != NULL ? config.load_path : scenario_name(config.scenario), config.num_particles, config.width, config.height, config.dt, config.steps, omp_get_max_threads(),
+           simd_level_name(get_simd_level()));
+    printf("Kernels: density %s, pressure %s, viscosity %s\n", SMOOTHING_NAME(DENSITY_KERNEL), SMOOTHING_NAME(PRESSURE_KERNEL), SMOOTHING_NAME(VISCOSITY_KERNEL));
+
+    // Inflow and outflow strips along the left and right walls
+    double strip = config.width / 20;
+    Region source = { 0, 0, strip, config.height };
+    Region sink = { config.width - strip, 0, config.width, config.height };
+    long particle_updates = 0;
+
+    double start_time = omp_get_wtime();
+    double report_time = start_time;
+    for (int step = 0; step < config.steps; step++) {
+        if (config.inflow > 0) {
+            emit_particles(&particles, config.inflow, source);
+            remove_particles(&particles, sink);
+        }
+        update_particles(&particles, config.dt, step);
+        particle_updates += particles.num_particles;
+
+        if (config.report_every > 0 && (step + 1) % config.report_every == 0) {
+            double now = omp_get_wtime();
+            printf("Step %d: %.2f steps/s\n", step + 1, config.report_every / (now - report_time));
+            PROFILE_REPORT(stdout);
+            report_time = now;
+        }
+    }
+    double elapsed = omp_get_wtime() - start_time;
+
+    double steps_per_second = elapsed > 0 ? config.steps / elapsed : 0;
+    printf("Elapsed: %.3f s\n", elapsed);
+    printf("Steps/s: %.2f\n", steps_per_second);
+    printf("Particle updates/s: %.0f\n", elapsed > 0 ? particle_updates / elapsed : 0);
+    if (config.inflow > 0) {
+        printf("Final particles: %d (capacity %d)\n", particles.num_particles, particles.capacity);
+    }
+    if (particles.neighbor_skin > 0) {
+        printf("Neighbor list builds: %d\n", particles.neighbor_list_builds);
+    }
+
+    if (particles.trajectory != NULL) {
+        int written, dropped;
+        int64_t size = close_trajectory(particles.trajectory, &written, &dropped);
+        particles.trajectory = NULL;
+        if (size < 0) {
+            fprintf(stderr, "Trajectory: writing failed after %d frames, %d dropped\n", written, dropped);
+        } else {
+            printf("Trajectory: %d frames written, %d dropped, %.2f MB\n", written, dropped, size / 1e6);
+        }
+    }
+
+    if (config.report_every <= 0) {
+        PROFILE_REPORT(stdout);
+    }
+    if (config.profile_prefix != NULL) {
+        char csv_path[1024], trace_path[1024];
+        snprintf(csv_path, sizeof(csv_path), "%s.csv", config.profile_prefix);
+        snprintf(trace_path, sizeof(trace_path), "%s.json", config.profile_prefix);
+        if (PROFILE_EXPORT(csv_path, trace_path)) {
+            printf("Profile: %s, %s\n", csv_path, trace_path);
+        }
+    }
+
+    if (config.save_path != NULL && !save_checkpoint(&particles, config.save_path)) {
+        free_particles(&particles);
+        free_obstacles(&obstacles);
+        return EXIT_FAILURE;
+    }
+
+    free_particles(&particles);
+    free_obstacles(&obstacles);
+
+    return 0;
+}
@@ -0,0 +1,123 @@
+#pragma once
+
+#ifndef KERNELS_H
+#define KERNELS_H
+
+// Smoothing kernel library (2D). Each kernel is written once as an expression over the
+// squared distance d2, the distance d where the shape needs it, and a clamp-at-zero POS,
+// so the same text serves the scalar loops and the vector span kernels. The shapes are
+// zero outside the support by construction, so callers need no range test beyond the
+// one that skips far candidates. Included by particles.h after real_t is defined.
+//
+// The kernel of each interaction term is picked at compile time, for example
+//   -DDENSITY_KERNEL=WENDLAND -DPRESSURE_KERNEL=WENDLAND -DVISCOSITY_KERNEL=POLY6
+// Density and pressure should use the same kernel, the pressure force is its gradient.
+#ifndef DENSITY_KERNEL
+#define DENSITY_KERNEL SPIKY
+#endif
+#ifndef PRESSURE_KERNEL
+#define PRESSURE_KERNEL SPIKY
+#endif
+#ifndef VISCOSITY_KERNEL
+#define VISCOSITY_KERNEL POLY6
+#endif
+
+// Normalisations and scales for one influence radius h, filled by init_smoothing_constants
+typedef struct {
+    real_t h;
+    real_t h2;
+    real_t inv_h;
+    real_t spiky_value;
+    real_t spiky_slope;
+    real_t poly6_value;
+    real_t poly6_slope;
+    real_t cubic_inv_s;
+    real_t cubic_value;
+    real_t cubic_slope;
+    real_t wendland_value;
+    real_t wendland_slope;
+} SmoothingConstants;
+
+#define SMOOTHING_CONCAT_(a, b) a##b
+#define SMOOTHING_CONCAT(a, b) SMOOTHING_CONCAT_(a, b)
+#define SMOOTHING_STRING_(kind) #kind
+#define SMOOTHING_STRING(kind) SMOOTHING_STRING_(kind)
+
+// Kernel value W(d)
+#define SMOOTHING_VALUE(kind, c, d2, d, POS) SMOOTHING_CONCAT(SMOOTHING_VALUE_, kind)(c, d2, d, POS)
+// Radial slope dW/dd
+#define SMOOTHING_SLOPE(kind, c, d2, d, POS) SMOOTHING_CONCAT(SMOOTHING_SLOPE_, kind)(c, d2, d, POS)
+// dW/dd / d for d > 0, so a gradient is offset * this without normalising the offset
+#define SMOOTHING_SLOPE_OVER_DISTANCE(kind, c, d2, d, POS) SMOOTHING_CONCAT(SMOOTHING_SLOPE_OVER_DISTANCE_, kind)(c, d2, d, POS)
+// Whether the shape reads d, if not callers can skip the square root
+#define SMOOTHING_NEEDS_DISTANCE(kind) SMOOTHING_CONCAT(SMOOTHING_NEEDS_DISTANCE_, kind)
+#define SMOOTHING_NAME(kind) SMOOTHING_STRING(kind)
+
+// Spiky: 6 / (pi h^4) (h - d)^2
+#define SMOOTHING_NEEDS_DISTANCE_SPIKY 1
+#define SMOOTHING_VALUE_SPIKY(c, d2, d, POS) ({ __typeof__(d2) u_ = POS((c)->h - (d)); (c)->spiky_value * u_ * u_; })
+#define SMOOTHING_SLOPE_SPIKY(c, d2, d, POS) (-(c)->spiky_slope * POS((c)->h - (d)))
+#define SMOOTHING_SLOPE_OVER_DISTANCE_SPIKY(c, d2, d, POS) (SMOOTHING_SLOPE_SPIKY(c, d2, d, POS) / (d))
+
+// Poly6: 4 / (pi h^8) (h^2 - d^2)^3, no square root anywhere
+#define SMOOTHING_NEEDS_DISTANCE_POLY6 0
+#define SMOOTHING_VALUE_POLY6(c, d2, d, POS) ({ __typeof__(d2) u_ = POS((c)->h2 - (d2)); (c)->poly6_value * u_ * u_ * u_; })
+#define SMOOTHING_SLOPE_POLY6(c, d2, d, POS) (SMOOTHING_SLOPE_OVER_DISTANCE_POLY6(c, d2, d, POS) * (d))
+#define SMOOTHING_SLOPE_OVER_DISTANCE_POLY6(c, d2, d, POS) ({ __typeof__(d2) u_ = POS((c)->h2 - (d2)); -(c)->poly6_slope * u_ * u_; })
+
+// Cubic B-spline with smoothing length s = h / 2 and q = d / s:
+// 10 / (7 pi s^2) / 4 ((2 - q)^3 - 4 (1 - q)^3), each bracket clamped at zero
+#define SMOOTHING_NEEDS_DISTANCE_CUBIC_SPLINE 1
+#define SMOOTHING_VALUE_CUBIC_SPLINE(c, d2, d, POS) ({ \
+    __typeof__(d2) q_ = (d) * (c)->cubic_inv_s; \
+    __typeof__(d2) a_ = POS(2 - q_); \
+    __typeof__(d2) b_ = POS(1 - q_); \
+    (c)->cubic_value * (a_ * a_ * a_ - 4 * b_ * b_ * b_); })
+#define SMOOTHING_SLOPE_CUBIC_SPLINE(c, d2, d, POS) ({ \
+    __typeof__(d2) q_ = (d) * (c)->cubic_inv_s; \
+    __typeof__(d2) a_ = POS(2 - q_); \
+    __typeof__(d2) b_ = POS(1 - q_); \
+    (c)->cubic_slope * (4 * b_ * b_ - a_ * a_); })
+#define SMOOTHING_SLOPE_OVER_DISTANCE_CUBIC_SPLINE(c, d2, d, POS) (SMOOTHING_SLOPE_CUBIC_SPLINE(c, d2, d, POS) / (d))
+
+// Wendland C2: 7 / (pi h^2) (1 - q)^4 (1 + 4 q) with q = d / h
+#define SMOOTHING_NEEDS_DISTANCE_WENDLAND 1
+#define SMOOTHING_VALUE_WENDLAND(c, d2, d, POS) ({ \
+    __typeof__(d2) q_ = (d) * (c)->inv_h; \
+    __typeof__(d2) u_ = POS(1 - q_); \
+    (c)->wendland_value * u_ * u_ * u_ * u_ * (1 + 4 * q_); })
+#define SMOOTHING_SLOPE_WENDLAND(c, d2, d, POS) (SMOOTHING_SLOPE_OVER_DISTANCE_WENDLAND(c, d2, d, POS) * (d))
+#define SMOOTHING_SLOPE_OVER_DISTANCE_WENDLAND(c, d2, d, POS) ({ \
+    __typeof__(d2) u_ = POS(1 - (d) * (c)->inv_h); \
+    -(c)->wendland_slope * u_ * u_ * u_; })
+
+#define REAL_POS(x) ((x) > 0 ? (x) : 0)
+
+// The selected kernel of each term, for the scalar loops. Inlined with the choice fixed,
+// so no branch or unused square root is left behind.
+static inline __attribute__((always_inline)) real_t density_kernel(const SmoothingConstants* c, real_t d2) {
+    real_t d = SMOOTHING_NEEDS_DISTANCE(DENSITY_KERNEL) ? REAL_SQRT(d2) : 0;
+    (void)d;
+    return SMOOTHING_VALUE(DENSITY_KERNEL, c, d2, d, REAL_POS);
+}
+
+// Off the hot path (coincident particles), so it always takes the root
+static inline __attribute__((always_inline)) real_t pressure_slope(const SmoothingConstants* c, real_t d2) {
+    real_t d = REAL_SQRT(d2);
+    return SMOOTHING_SLOPE(PRESSURE_KERNEL, c, d2, d, REAL_POS);
+}
+
+// d2 > 0
+static inline __attribute__((always_inline)) real_t pressure_slope_over_distance(const SmoothingConstants* c, real_t d2) {
+    real_t d = SMOOTHING_NEEDS_DISTANCE(PRESSURE_KERNEL) ? REAL_SQRT(d2) : 0;
+    (void)d;
+    return SMOOTHING_SLOPE_OVER_DISTANCE(PRESSURE_KERNEL, c, d2, d, REAL_POS);
+}
+
+static inline __attribute__((always_inline)) real_t viscosity_weight(const SmoothingConstants* c, real_t d2) {
+    real_t d = SMOOTHING_NEEDS_DISTANCE(VISCOSITY_KERNEL) ? REAL_SQRT(d2) : 0;
+    (void)d;
+    return SMOOTHING_VALUE(VISCOSITY_KERNEL, c, d2, d, REAL_POS);
+}
+
+#endif /* KERNELS_H */
@@ -5,14 +5,21 @@
 #include <float.h>
 #include <SDL2/SDL.h>
 #include "particles.h"
-#include "particles.c"
-#include "aux_functions.c"
+#include "simd.h"
+#include "neighbor_list.h"
+#include "checkpoint.h"
+#include "trajectory.h"
+#include "sdf.h"
+#include "field.h"
+#include "render.h"
+#include "pipeline.h"
+#include "profile.h"
 
 bool x = false;
 int frames = 0;
 
 // Function to handle events
-void handle_events(Particles* particles, bool* running, bool* pause, bool* draw_density, bool* draw_pressure, bool* draw_radius, double** densities, double** pressures, SDL_Renderer* renderer) {
+void handle_events(Particles* particles, bool* running, bool* pause, bool* draw_density, bool* draw_pressure, bool* draw_radius, Field* density_field, Field* pressure_field, ParticleColoring* coloring, ParticleBatch* batch, SDL_Renderer* renderer) {
     SDL_Event event;
     while (SDL_PollEvent(&event)) {
         switch (event.type) {
@@ -22,6 +29,7 @@ void handle_events(Particles* particles, bool* running, bool* pause, bool* draw_
         case SDL_KEYDOWN:
             switch (event.key.keysym.sym) {
             case SDLK_r:
+                free_particles(particles);
                 init_particles(particles, NUM_PARTICLES, WIN_WIDTH, WIN_HEIGHT, (double[]) { GRAVITY_X, GRAVITY_Y }, BALL_RADIUS, COLLISION_LOSS, INFLUENCE_RADIUS);
                 break;
             case SDLK_SPACE:
@@ -29,32 +37,55 @@ void handle_events(Particles* particles, bool* running, bool* pause, bool* draw_
                 frames = 0;
                 break;
             case SDLK_d:
-                if ((*pause)) {
-                    if(*draw_density == true) {
-                        *draw_density = false;
-                    }
-                    else {
-                        *draw_density = true;
-                        double max_density = calculate_all_densities(particles, densities);
-                        draw_densities(renderer, densities, max_density);
-                    }
+                if(*draw_density == true) {
+                    *draw_density = false;
+                }
+                else {
+                    *draw_density = true;
+                    *draw_pressure = false;
+                    update_spatial_lookup(particles);
+                    sample_field(particles, density_field);
+                    printf("Mean Density: %lf\n", density_field->mean);
+                    printf("Max Density: %lf\n", density_field->max);
                 }
                 break;
             case SDLK_p:
-                if ((*pause)) {
-                    if(*draw_pressure == true) {
-                        *draw_pressure = false;
-                    }
-                    else {
-                        *draw_pressure = true;
-                        double minmax[2];
-                        calculate_all_pressures(particles, pressures, minmax);
-                        printf("Min Pressure: %lf\n", minmax[0]);
-                        printf("Max Pressure: %lf\n", minmax[1]);
-                        draw_pressures(renderer, pressures, minmax);
-                    }
+                if(*draw_pressure == true) {
+                    *draw_pressure = false;
+                }
+                else {
+                    *draw_pressure = true;
+                    *draw_density = false;
+                    update_spatial_lookup(particles);
+                    sample_field(particles, pressure_field);
+                    printf("Mean Pressure: %lf\n", pressure_field->mean);
+                    printf("Min Pressure: %lf\n", pressure_field->min);
+                    printf("Max Pressure: %lf\n", pressure_field->max);
+                }
+                break;
+            case SDLK_s:
+                if (save_checkpoint(particles, CHECKPOINT_FILE)) {
+                    printf("Saved %d particles to %s\n", particles->num_particles, CHECKPOINT_FILE);
+                }
+                break;
+            case SDLK_l: {
+                Particles loaded;
+                if (load_checkpoint(&loaded, CHECKPOINT_FILE)) {
+                    free_particles(particles);
+                    *particles = loaded;
+                    printf("Loaded %d particles from %s\n", particles->num_particles, CHECKPOINT_FILE);
                 }
                 break;
+            }
+            case SDLK_c:
+                *coloring = (ParticleColoring)((*coloring + 1) % COLORING_COUNT);
+                break;
+            case SDLK_f:
+                // Cycle the overlay sample spacing through 1, 2, 4 and 8 pixels
+                set_field_resolution(density_field, density_field->resolution >= 8 ? 1 : density_field->resolution * 2);
+                set_field_resolution(pressure_field, density_field->resolution);
+                printf("Field resolution: %d px\n", density_field->resolution);
+                break;
             default:
                 break;
             }
@@ -66,7 +97,8 @@ void handle_events(Particles* particles, bool* running, bool* pause, bool* draw_
                 double p[2];
                 p[0] = x / 1.0;
                 p[1] = y / 1.0;
-                printf("Density at (%f, %f): %lf\n", p[0], p[1], calculate_density(particles, p));
+                update_spatial_lookup(particles);
+                printf("Density at (%f, %f): %lf\n", p[0], p[1], (double)calculate_density(particles, p[0], p[1]));
                 }
             if (event.button.button == SDL_BUTTON_RIGHT) {
                 int x,y;
@@ -81,7 +113,7 @@ void handle_events(Particles* particles, bool* running, bool* pause, bool* draw_
                     else if (x){
                         *draw_radius = true;
                         x = false;
-                        paint_each_point_within_radius(renderer, particles, p);
+                        paint_each_point_within_radius(renderer, batch, particles, p);
                     }
                 }
             break;
@@ -91,8 +123,140 @@ void handle_events(Particles* particles, bool* running, bool* pause, bool* draw_
     }
 }
 
+// Event handling of the pipelined mode: everything that touches the particles becomes a
+// command for the solver thread. The toggles mirror the solver state to build them.
+void handle_pipeline_events(Pipeline* pipeline, bool* running, bool* redraw, ParticleColoring* coloring, int* overlay, int* resolution, bool* highlight) {
+    SDL_Event event;
+    while (SDL_PollEvent(&event)) {
+        PipelineCommand command = {0};
+        bool send = true;
+        switch (event.type) {
+        case SDL_QUIT:
+            *running = false;
+            send = false;
+            break;
+        case SDL_KEYDOWN:
+            switch (event.key.keysym.sym) {
+            case SDLK_r:
+                command.type = PIPELINE_RESET;
+                break;
+            case SDLK_SPACE:
+                command.type = PIPELINE_PAUSE;
+                break;
+            case SDLK_d:
+            case SDLK_p: {
+                int kind = event.key.keysym.sym == SDLK_d ? FIELD_DENSITY : FIELD_PRESSURE;
+                *overlay = *overlay == kind ? PIPELINE_NO_OVERLAY : kind;
+                command.type = PIPELINE_OVERLAY;
+                command.value = *overlay;
+                break;
+            }
+            case SDLK_f:
+                *resolution = *resolution >= 8 ? 1 : *resolution * 2;
+                printf("Field resolution: %d px\n", *resolution);
+                command.type = PIPELINE_RESOLUTION;
+                command.value = *resolution;
+                break;
+            case SDLK_s:
+                command.type = PIPELINE_SAVE;
+                break;
+            case SDLK_l:
+                command.type = PIPELINE_LOAD;
+                break;
+            case SDLK_c:
+                *coloring = (ParticleColoring)((*coloring + 1) % COLORING_COUNT);
+                *redraw = true;
+                send = false;
+                break;
+            default:
+                send = false;
+                break;
+            }
+            break;
+        case SDL_MOUSEBUTTONDOWN:
+            command.x = event.button.x;
+            command.y = event.button.y;
+            if (event.button.button == SDL_BUTTON_LEFT) {
+                command.type = PIPELINE_PROBE;
+            } else if (event.button.button == SDL_BUTTON_RIGHT) {
+                *highlight = !*highlight;
+                command.type = PIPELINE_HIGHLIGHT;
+                command.value = *highlight;
+            } else {
+                send = false;
+            }
+            break;
+        default:
+            send = false;
+            break;
+        }
+        if (send && !send_pipeline_command(pipeline, command)) {
+            printf("Solver busy, input dropped\n");
+        }
+    }
+}
+
+// Pipelined main loop: the solver steps on its own thread and this loop only handles
+// events and draws the newest published step, so frame rate and step rate are independent
+void run_pipeline(SDL_Renderer* renderer, Particles* particles, FieldTexture* field_texture, ParticleBatch* batch) {
+    Pipeline pipeline;
+    if (!start_pipeline(&pipeline, particles, true)) return;
+    // The drawing loops stay serial on this thread, the cores belong to the solver team
+    int threads = omp_get_max_threads();
+    omp_set_num_threads(1);
+
+    bool running = true;
+    bool redraw = true;
+    ParticleColoring coloring = COLORING_SOLID;
+    int overlay = PIPELINE_NO_OVERLAY;
+    int resolution = FIELD_RESOLUTION;
+    bool highlight = false;
+    SDL_Color red = {255, 0, 0, SDL_ALPHA_OPAQUE};
+    int frames_drawn = 0;
+    int steps_start = 0;
+    double report_start = SDL_GetTicks();
+
+    while (running) {
+        handle_pipeline_events(&pipeline, &running, &redraw, &coloring, &overlay, &resolution, &highlight);
+
+        bool fresh;
+        RenderFrame* frame = acquire_render_frame(&pipeline, &fresh);
+        if (fresh || redraw) {
+            PROFILE_BEGIN(RENDER);
+            SDL_SetRenderDrawColor(renderer, 38, 44, 77, SDL_ALPHA_OPAQUE);
+            SDL_RenderClear(renderer);
+            if (frame->overlay != PIPELINE_NO_OVERLAY) {
+                draw_field(renderer, field_texture, &frame->field);
+            }
+            draw_particles(renderer, batch, &frame->view, coloring);
+            draw_particle_batch(renderer, batch, &frame->view, frame->selected, frame->num_selected, COLORING_SOLID, red);
+            SDL_RenderPresent(renderer);
+            PROFILE_END(RENDER);
+            frames_drawn++;
+            redraw = false;
+        } else {
+            SDL_Delay(1);
+        }
+
+        if (SDL_GetTicks() - report_start >= 5000) {
+            double elapsed_seconds = (SDL_GetTicks() - report_start) / 1000.0;
+            int steps = atomic_load(&pipeline.steps);
+            printf("FPS: %.2f, steps/s: %.2f\n", frames_drawn / elapsed_seconds, (steps - steps_start) / elapsed_seconds);
+            PROFILE_REPORT(stdout);
+            report_start = SDL_GetTicks();
+            frames_drawn = 0;
+            steps_start = steps;
+        }
+    }
+
+    stop_pipeline(&pipeline);
+    omp_set_num_threads(threads);
+}
+
+int main(int argc, char** argv) {
+    // -pipelined runs the solver on its own thread, decoupled from drawing
+    bool pipelined = argc > 1 && strcmp(argv[1], "-pipelined") == 0;
 
-int main() {
     // Initialize SDL
     if (SDL_Init(SDL_INIT_VIDEO) != 0) {
         printf("SDL initialization failed: %s\n", SDL_GetError());
@@ -123,13 +287,13 @@ int main() {
     init_particles(&particles, NUM_PARTICLES, WIN_WIDTH, WIN_HEIGHT, (double[]) { GRAVITY_X, GRAVITY_Y }, BALL_RADIUS, COLLISION_LOSS, INFLUENCE_RADIUS);
 
     
-    // create a 2D array to store densities with allocated memory
-    double** densities = (double**)malloc(WIN_WIDTH * sizeof(double*));
-    double** pressures = (double**)malloc(WIN_WIDTH * sizeof(double*));
-    for (int i = 0; i < WIN_WIDTH; ++i) {
-        densities[i] = (double*)malloc(WIN_HEIGHT * sizeof(double));
-        pressures[i] = (double*)malloc(WIN_HEIGHT * sizeof(double));
-    }
+    // Overlay fields, their sample buffers are allocated the first time they are shown
+    Field density_field, pressure_field;
+    init_field(&density_field, FIELD_DENSITY, WIN_WIDTH, WIN_HEIGHT, FIELD_RESOLUTION);
+    init_field(&pressure_field, FIELD_PRESSURE, WIN_WIDTH, WIN_HEIGHT, FIELD_RESOLUTION);
+    FieldTexture field_texture = {0};
+    ParticleBatch particle_batch = {0};
+    ParticleColoring coloring = COLORING_SOLID;
 
     double frame_start_time = SDL_GetTicks();
 
@@ -141,34 +305,36 @@ int main() {
     bool draw_pressure = false;
     bool draw_radius = false;
 
+    if (pipelined) {
+        run_pipeline(renderer, &particles, &field_texture, &particle_batch);
+        running = false;
+    }
+
     // Main game loop
     while (running) {
         // Handle events
-        handle_events(&particles, &running, &pause, &draw_density, &draw_pressure, &draw_radius, densities, pressures, renderer);
+        handle_events(&particles, &running, &pause, &draw_density, &draw_pressure, &draw_radius, &density_field, &pressure_field, &coloring, &particle_batch, renderer);
 
         // Fill the background color
-        if(!draw_density && !draw_pressure && !draw_radius) {
+        PROFILE_BEGIN(RENDER);
+        if(!draw_radius) {
             SDL_SetRenderDrawColor(renderer, 38, 44, 77, SDL_ALPHA_OPAQUE);
             SDL_RenderClear(renderer);
         }
 
+        // Resample and draw the active overlay
+        if(!draw_radius && (draw_density || draw_pressure)) {
+            Field* field = draw_density ? &density_field : &pressure_field;
+            update_spatial_lookup(&particles);
+            sample_field(&particles, field);
+            draw_field(renderer, &field_texture, field);
+        }
+
         // Draw particles
         if(!draw_radius){
-            SDL_SetRenderDrawColor(renderer, 255, 255, 255, SDL_ALPHA_OPAQUE);
-            for (int i = 0; i < particles.num_particles; ++i) {
-                int centerX = (int)particles.particles[i].position[0];
-                int centerY = (int)particles.particles[i].position[1];
-                int radius = BALL_RADIUS;
-
-                for (int y = -radius; y <= radius; ++y) {
-                    for (int x = -radius; x <= radius; ++x) {
-                        if (x*x + y*y <= radius*radius) {
-                            SDL_RenderDrawPoint(renderer, centerX + x, centerY + y);
-                        }
-                    }
-                }
-            }
+            draw_particles(renderer, &particle_batch, &particles, coloring);
         }
+        PROFILE_END(RENDER);
 
 
 
@@ -182,6 +348,7 @@ int main() {
             float elapsed_seconds = (SDL_GetTicks() - frame_start_time) / 1000.0;
             float fps = frames / elapsed_seconds;
             printf("FPS: %.2f\n", fps);
+            PROFILE_REPORT(stdout);
             frame_start_time = SDL_GetTicks();
             frames = 0;
         }
@@ -191,7 +358,16 @@ int main() {
         SDL_Delay(10);
     }
 
+    if (PROFILE_EXPORT(PROFILE_CSV_FILE, PROFILE_TRACE_FILE)) {
+        printf("Profile written to %s and %s\n", PROFILE_CSV_FILE, PROFILE_TRACE_FILE);
+    }
+
     // Cleanup and quit SDL
+    free_particle_batch(&particle_batch);
+    free_field_texture(&field_texture);
+    free_field(&density_field);
+    free_field(&pressure_field);
+    free_particles(&particles);
     SDL_DestroyRenderer(renderer);
     SDL_DestroyWindow(win);
     SDL_Quit();
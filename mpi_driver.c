@@ -0,0 +1,200 @@
+// Distributed batch driver: splits the domain into one vertical slab per MPI rank and runs
+// the solver on each slab, exchanging boundary particles with the neighboring ranks.
+//
+//   make fluid_mpi
+//   mpirun -np 4 ./fluid_mpi -n 200000 -w 12000 -h 4000 -steps 500
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <stdbool.h>
+#include <float.h>
+#include "particles.h"
+#include "simd.h"
+#include "neighbor_list.h"
+#include "checkpoint.h"
+#include "trajectory.h"
+#include "sdf.h"
+#include "scenarios.h"
+#include "distributed.h"
+#include "profile.h"
+
+typedef struct {
+    int num_particles;
+    double width;
+    double height;
+    double dt;
+    int steps;
+    unsigned int seed;
+    Scenario scenario;
+    double gravity[2];
+    bool gravity_set;
+    double viscosity;
+    int report_every;
+    const char* save_path;
+} DistributedConfig;
+
+void print_usage(const char* program) {
+    printf("Usage: mpirun -np <ranks> %s [options]\n", program);
+    printf("  -n <count>      number of particles (default %d)\n", NUM_PARTICLES);
+    printf("  -w <width>      domain width, split evenly between the ranks (default %d)\n", WIN_WIDTH);
+    printf("  -h <height>     domain height (default %d)\n", WIN_HEIGHT);
+    printf("  -dt <dt>        time step (default 1)\n");
+    printf("  -steps <count>  number of steps to run (default 1000)\n");
+    printf("  -seed <seed>    seed for the initial layout (default 1)\n");
+    printf("  -scenario <s>   uniform, dam_break or clustered (default uniform)\n");
+    printf("  -gx <g>, -gy <g> gravity (default %d, %d, or %g downward for dam_break)\n", GRAVITY_X, GRAVITY_Y, SCENARIO_GRAVITY);
+    printf("  -viscosity <v>  strength of the viscosity term, 0 disables it (default %d)\n", VISCOSITY_STRENGTH);
+    printf("  -save <file>    gather the particles and write a checkpoint after the last step\n");
+    printf("  -report <k>     print progress every k steps, 0 to disable (default 0)\n");
+}
+
+bool parse_args(int argc, char** argv, DistributedConfig* config) {
+    for (int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        if (strcmp(arg, "--help") == 0) {
+            return false;
+        }
+        if (i + 1 >= argc) {
+            printf("Missing value for %s\n", arg);
+            return false;
+        }
+        const char* value = argv[++i];
+        if (strcmp(arg, "-n") == 0) config->num_particles = atoi(value);
+        else if (strcmp(arg, "-w") == 0) config->width = atof(value);
+        else if (strcmp(arg, "-h") == 0) config->height = atof(value);
+        else if (strcmp(arg, "-dt") == 0) config->dt = atof(value);
+        else if (strcmp(arg, "-steps") == 0) config->steps = atoi(value);
+        else if (strcmp(arg, "-seed") == 0) config->seed = (unsigned int)strtoul(value, NULL, 10);
+        else if (strcmp(arg, "-scenario") == 0) {
+            if (!parse_scenario(value, &config->scenario)) {
+                printf("Unknown scenario %s\n", value);
+                return false;
+            }
+        }
+        else if (strcmp(arg, "-gx") == 0) {
+            config->gravity[0] = atof(value);
+            config->gravity_set = true;
+        }
+        else if (strcmp(arg, "-gy") == 0) {
+            config->gravity[1] = atof(value);
+            config->gravity_set = true;
+        }
+        else if (strcmp(arg, "-viscosity") == 0) config->viscosity = atof(value);
+        else if (strcmp(arg, "-save") == 0) config->save_path = value;
+        else if (strcmp(arg, "-report") == 0) config->report_every = atoi(value);
+        else {
+            printf("Unknown option %s\n", arg);
+            return false;
+        }
+    }
+
+    if (config->num_particles <= 0 || config->width <= 0 || config->height <= 0 || config->dt <= 0 || config->steps < 0) {
+        printf("Particle count, domain size and dt must be positive\n");
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char** argv) {
+    int provided;
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
+    int rank;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+
+    DistributedConfig config = {
+        .num_particles = NUM_PARTICLES,
+        .width = WIN_WIDTH,
+        .height = WIN_HEIGHT,
+        .dt = 1,
+        .steps = 1000,
+        .seed = 1,
+        .scenario = SCENARIO_UNIFORM,
+        .gravity = { GRAVITY_X, GRAVITY_Y },
+        .gravity_set = false,
+        .viscosity = VISCOSITY_STRENGTH,
+        .report_every = 0,
+        .save_path = NULL,
+    };
+    if (!parse_args(argc, argv, &config)) {
+        if (rank == 0) print_usage(argv[0]);
+        MPI_Finalize();
+        return EXIT_FAILURE;
+    }
+
+    Domain domain;
+    if (!init_domain(&domain, MPI_COMM_WORLD, config.width, INFLUENCE_RADIUS)) {
+        if (rank == 0) printf("Slabs of %.0f are narrower than two influence radii, use fewer ranks or a wider domain\n", config.width / domain.size);
+        MPI_Finalize();
+        return EXIT_FAILURE;
+    }
+
+    // Every rank lays out the whole scene from the same seed and keeps its own slab, so
+    // the start does not depend on the number of ranks
+    Particles particles;
+    if (!config.gravity_set) scenario_gravity(config.scenario, config.gravity);
+    init_particles(&particles, config.num_particles, config.width, config.height, config.gravity, BALL_RADIUS, COLLISION_LOSS, INFLUENCE_RADIUS);
+    apply_scenario(&particles, config.scenario, config.seed);
+    keep_slab_particles(&domain, &particles);
+    // The ghosts change every step, which neither the neighbor lists nor the incremental
+    // lookup can follow
+    set_neighbor_skin(&particles, 0);
+    particles.incremental_lookup = false;
+    particles.viscosity = config.viscosity;
+
+    if (rank == 0) {
+        printf("Scenario: %s, particles: %d, domain: %.0f x %.0f, dt: %g, steps: %d, ranks: %d, threads per rank: %d, simd: %s\n",
+               scenario_name(config.scenario), config.num_particles, config.width, config.height, config.dt, config.steps, domain.size,
+               omp_get_max_threads(), simd_level_name(get_simd_level()));
+    }
+
+    MPI_Barrier(MPI_COMM_WORLD);
+    double start_time = MPI_Wtime();
+    double report_time = start_time;
+    for (int step = 0; step < config.steps; step++) {
+        distributed_step(&domain, &particles, config.dt);
+
+        if (config.report_every > 0 && (step + 1) % config.report_every == 0) {
+            long total = global_particle_count(&domain);
+            double now = MPI_Wtime();
+            if (rank == 0) printf("Step %d: %.2f steps/s, %ld particles\n", step + 1, config.report_every / (now - report_time), total);
+            report_time = now;
+        }
+    }
+    MPI_Barrier(MPI_COMM_WORLD);
+    double elapsed = MPI_Wtime() - start_time;
+
+    long total = global_particle_count(&domain);
+    long counters[2] = {domain.ghosts_received, domain.particles_migrated};
+    MPI_Allreduce(MPI_IN_PLACE, counters, 2, MPI_LONG, MPI_SUM, MPI_COMM_WORLD);
+    int max_owned = domain.num_owned;
+    MPI_Allreduce(MPI_IN_PLACE, &max_owned, 1, MPI_INT, MPI_MAX, MPI_COMM_WORLD);
+    if (rank == 0) {
+        double steps_per_second = elapsed > 0 ? config.steps / elapsed : 0;
+        int steps = config.steps > 0 ? config.steps : 1;
+        printf("Elapsed: %.3f s\n", elapsed);
+        printf("Steps/s: %.2f\n", steps_per_second);
+        printf("Particle updates/s: %.0f\n", elapsed > 0 ? (double)total * config.steps / elapsed : 0);
+        printf("Ghosts per step: %.0f, migrations per step: %.1f\n", (double)counters[0] / steps, (double)counters[1] / steps);
+        printf("Final particles: %ld, largest slab: %d (%.2fx the mean)\n", total, max_owned, total > 0 ? max_owned * (double)domain.size / total : 0);
+        // Rank 0's own phases, the other slabs run the same ones
+        PROFILE_REPORT(stdout);
+    }
+
+    int status = EXIT_SUCCESS;
+    if (config.save_path != NULL) {
+        Particles global;
+        if (gather_particles(&domain, &particles, &global)) {
+            if (!save_checkpoint(&global, config.save_path)) status = EXIT_FAILURE;
+            free_particles(&global);
+        }
+        MPI_Bcast(&status, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    }
+
+    free_particles(&particles);
+    free_domain(&domain);
+    MPI_Finalize();
+
+    return status;
+}
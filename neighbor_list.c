@@ -0,0 +1,135 @@
+#include "neighbor_list.h"
+#include "profile.h"
+#include <stdio.h>
+
+// Verlet neighbor lists: every particle keeps the indices of all particles (itself
+// included) within influence_radius + skin, stored CSR-style in neighbor_indices with
+// neighbor_offsets[i] .. neighbor_offsets[i + 1]. The lists stay valid until some
+// particle has moved more than skin / 2 since the build, because until then no pair can
+// have closed from beyond influence_radius + skin to within influence_radius.
+
+bool using_neighbor_lists(Particles* particles) {
+    return particles->neighbor_skin > 0 && particles->neighbor_lists_valid;
+}
+
+// Enables the lists with the given skin, or disables them with 0. The grid cells grow to
+// influence_radius + skin so the 3x3 block still covers the list radius.
+void set_neighbor_skin(Particles* particles, double skin) {
+    particles->neighbor_skin = skin > 0 ? skin : 0;
+    particles->neighbor_lists_valid = false;
+    init_spatial_grid(particles);
+}
+
+void free_neighbor_lists(Particles* particles) {
+    free(particles->neighbor_offsets);
+    free(particles->neighbor_indices);
+    free(particles->neighbor_ref_x);
+    free(particles->neighbor_ref_y);
+    particles->neighbor_offsets = NULL;
+    particles->neighbor_indices = NULL;
+    particles->neighbor_ref_x = NULL;
+    particles->neighbor_ref_y = NULL;
+    particles->neighbor_capacity = 0;
+    particles->neighbor_list_size = 0;
+    particles->neighbor_lists_valid = false;
+}
+
+bool neighbor_lists_stale(Particles* particles) {
+    if (!particles->neighbor_lists_valid || particles->neighbor_list_size < particles->num_particles) return true;
+
+    real_t half_skin = (real_t)(particles->neighbor_skin / 2);
+    real_t limit = half_skin * half_skin;
+    int moved_too_far = 0;
+    #pragma omp parallel for reduction(||:moved_too_far)
+    for (int i = 0; i < particles->num_particles; i++) {
+        real_t dx = particles->x[i] - particles->neighbor_ref_x[i];
+        real_t dy = particles->y[i] - particles->neighbor_ref_y[i];
+        moved_too_far = moved_too_far || dx * dx + dy * dy > limit;
+    }
+    return moved_too_far;
+}
+
+void build_neighbor_lists(Particles* particles) {
+    int n = particles->num_particles;
+    // Sized to the particle capacity, so emits only reallocate when the pool grows
+    if (particles->neighbor_list_size < n) {
+        int size = particles->capacity;
+        free(particles->neighbor_offsets);
+        free(particles->neighbor_ref_x);
+        free(particles->neighbor_ref_y);
+        particles->neighbor_offsets = malloc((size + 1) * sizeof(int));
+        particles->neighbor_ref_x = malloc(size * sizeof(real_t));
+        particles->neighbor_ref_y = malloc(size * sizeof(real_t));
+        if (particles->neighbor_offsets == NULL || particles->neighbor_ref_x == NULL || particles->neighbor_ref_y == NULL) {
+            perror("Memory allocation failed for the neighbor lists.");
+            exit(EXIT_FAILURE);
+        }
+        particles->neighbor_list_size = size;
+    }
+
+    update_spatial_lookup(particles);
+
+    PROFILE_BEGIN(NEIGHBOR_LISTS);
+    real_t radius = (real_t)(particles->influence_radius + particles->neighbor_skin);
+    real_t radius2 = radius * radius;
+    int* offsets = particles->neighbor_offsets;
+
+    // First pass counts, second pass fills, so the index array is written exactly once
+    #pragma omp parallel for schedule(dynamic, 64)
+    for (int i = 0; i < n; i++) {
+        int spans[MAX_NEIGHBOR_SPANS][2];
+        int num_spans = neighbor_spans(particles, particles->x[i], particles->y[i], spans);
+        int count = 0;
+        for (int s = 0; s < num_spans; s++) {
+            for (int k = spans[s][0]; k < spans[s][1]; k++) {
+                int j = particles->spatial_lookup[k].idx;
+                real_t dx = particles->x[j] - particles->x[i];
+                real_t dy = particles->y[j] - particles->y[i];
+                count += dx * dx + dy * dy <= radius2;
+            }
+        }
+        offsets[i + 1] = count;
+    }
+
+    offsets[0] = 0;
+    for (int i = 0; i < n; i++) offsets[i + 1] += offsets[i];
+
+    long total = offsets[n];
+    if (total > particles->neighbor_capacity) {
+        long capacity = particles->neighbor_capacity > 0 ? particles->neighbor_capacity : 1024;
+        while (capacity < total) capacity *= 2;
+        free(particles->neighbor_indices);
+        particles->neighbor_indices = malloc(capacity * sizeof(int));
+        if (particles->neighbor_indices == NULL) {
+            perror("Memory allocation failed for the neighbor lists.");
+            exit(EXIT_FAILURE);
+        }
+        particles->neighbor_capacity = capacity;
+    }
+
+    #pragma omp parallel for schedule(dynamic, 64)
+    for (int i = 0; i < n; i++) {
+        int spans[MAX_NEIGHBOR_SPANS][2];
+        int num_spans = neighbor_spans(particles, particles->x[i], particles->y[i], spans);
+        int* out = particles->neighbor_indices + offsets[i];
+        for (int s = 0; s < num_spans; s++) {
+            for (int k = spans[s][0]; k < spans[s][1]; k++) {
+                int j = particles->spatial_lookup[k].idx;
+                real_t dx = particles->x[j] - particles->x[i];
+                real_t dy = particles->y[j] - particles->y[i];
+                if (dx * dx + dy * dy <= radius2) *out++ = j;
+            }
+        }
+        particles->neighbor_ref_x[i] = particles->x[i];
+        particles->neighbor_ref_y[i] = particles->y[i];
+    }
+
+    PROFILE_END(NEIGHBOR_LISTS);
+
+    particles->neighbor_lists_valid = true;
+    particles->neighbor_list_builds++;
+}
+
+void update_neighbor_lists(Particles* particles) {
+    if (neighbor_lists_stale(particles)) build_neighbor_lists(particles);
+}
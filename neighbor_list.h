@@ -0,0 +1,16 @@
+#pragma once
+
+#ifndef NEIGHBOR_LIST_H
+#define NEIGHBOR_LIST_H
+
+#include "particles.h"
+
+// Function prototypes
+void set_neighbor_skin(Particles* particles, double skin);
+void free_neighbor_lists(Particles* particles);
+bool neighbor_lists_stale(Particles* particles);
+void build_neighbor_lists(Particles* particles);
+void update_neighbor_lists(Particles* particles);
+bool using_neighbor_lists(Particles* particles);
+
+#endif /* NEIGHBOR_LIST_H */
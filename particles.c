@@ -1,4 +1,11 @@
 #include "particles.h"
+#include "simd.h"
+#include "neighbor_list.h"
+#include "checkpoint.h"
+#include "trajectory.h"
+#include "sdf.h"
+#include "profile.h"
+#include "rng.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
@@ -6,13 +13,21 @@
 #define _USE_MATH_DEFINES
 
 void init_particles(Particles* particles, int num_particles, double max_x, double max_y, double forces[2], double radius, double collision_loss, double influence_radius) {
-    particles->particles = malloc(num_particles * sizeof(Particle));
-    if (particles->particles == NULL) {
-        perror("Memory allocation failed for particles.");
-        exit(EXIT_FAILURE);
-    }
-    
-    particles->index = 0;
+    particles->x = particles->y = particles->vx = particles->vy = particles->density = NULL;
+    particles->predicted_x = particles->predicted_y = particles->accel_x = particles->accel_y = NULL;
+    particles->spatial_lookup = particles->sort_buffer = NULL;
+    particles->prev_cell = NULL;
+    particles->cell_start = NULL;
+    particles->grid_histograms = NULL;
+    particles->capacity = 0;
+    particles->mapping = NULL;
+    particles->mapping_size = 0;
+    particles->trajectory = NULL;
+    particles->obstacles = NULL;
+    particles->seed = RANDOM_DEFAULT_SEED;
+    particles->step = 0;
+    particles->emitted = 0;
+
     particles->num_particles = num_particles;
     particles->max_x = max_x;
     particles->max_y = max_y;
@@ -20,189 +35,1079 @@ void init_particles(Particles* particles, int num_particles, double max_x, doubl
     particles->forces[1] = forces[1];
     particles->radius = radius;
     particles->influence_radius = influence_radius;
+    init_smoothing_constants(&particles->kernel, influence_radius);
     particles->collision_loss = collision_loss;
-    particles->spatial_lookup = malloc(num_particles * sizeof(Entry));
-    particles->start_indices = malloc(num_particles * sizeof(int));
+    particles->target_density = TARGET_DENSITY;
+    particles->pressure_multiplier = P_MULT;
+    particles->viscosity = VISCOSITY_STRENGTH;
+    particles->reorder_interval = REORDER_INTERVAL;
+    particles->ids = NULL;
+    particles->slots = NULL;
+    particles->lookup_valid = false;
+    particles->incremental_lookup = true;
+    particles->rebuild_fraction = LOOKUP_REBUILD_FRACTION;
+    particles->last_lookup_movers = 0;
+    particles->lookup_events = NULL;
+    particles->lookup_event_capacity = 0;
+    particles->sort_threads = omp_get_max_threads();
+    particles->sort_histograms = malloc(particles->sort_threads * RADIX_BUCKETS * sizeof(int));
+    if (particles->sort_histograms == NULL) {
+        perror("Memory allocation failed for the spatial lookup.");
+        exit(EXIT_FAILURE);
+    }
+    particles->neighbor_offsets = NULL;
+    particles->neighbor_indices = NULL;
+    particles->neighbor_ref_x = NULL;
+    particles->neighbor_ref_y = NULL;
+    particles->neighbor_capacity = 0;
+    particles->neighbor_list_size = 0;
+    particles->neighbor_list_builds = 0;
+    particles->neighbor_lists_valid = false;
+    particles->neighbor_skin = NEIGHBOR_SKIN;
+    particles->pair_forces = false;
+    memset(particles->pair_chunks, 0, sizeof(particles->pair_chunks));
+    reserve_particles(particles, num_particles);
+    init_spatial_grid(particles);
+    init_simd();
 
+    #pragma omp parallel for
     for (int i = 0; i < num_particles; i++) {
-        Particle* p = &particles->particles[i];
-        p->index = i;
-        p->position[0] = (double)rand() / RAND_MAX * max_x;
-        p->position[1] = (double)rand() / RAND_MAX * max_y;
-        p->velocity[0] = p->velocity[1] = 0;
-        p->acceleration[0] = p->acceleration[1] = 0;
-        p->density = 0;
+        uint32_t r[4];
+        random_block(particles->seed, RANDOM_INIT, 0, i, 0, r);
+        particles->x[i] = (real_t)(random_unit_from(r[0]) * max_x);
+        particles->y[i] = (real_t)(random_unit_from(r[1]) * max_y);
+        particles->vx[i] = particles->vy[i] = 0;
+        particles->density[i] = 0;
+    }
+}
+
+void free_particles(Particles* particles) {
+    // State loaded from a checkpoint lives in its mapping until the pool first grows
+    if (particles->mapping != NULL) {
+        unmap_checkpoint(particles);
+    } else {
+        free(particles->x);
+        free(particles->y);
+        free(particles->vx);
+        free(particles->vy);
+        free(particles->density);
     }
+    free(particles->predicted_x);
+    free(particles->predicted_y);
+    free(particles->accel_x);
+    free(particles->accel_y);
+    free(particles->spatial_lookup);
+    free(particles->prev_cell);
+    free(particles->lookup_events);
+    particles->lookup_events = NULL;
+    particles->lookup_event_capacity = 0;
+    free(particles->cell_start);
+    free(particles->grid_histograms);
+    free(particles->sort_buffer);
+    free(particles->sort_histograms);
+    for (int c = 0; c < PAIR_CHUNKS; c++) {
+        free(particles->pair_chunks[c].ax);
+        free(particles->pair_chunks[c].ay);
+    }
+    memset(particles->pair_chunks, 0, sizeof(particles->pair_chunks));
+    free(particles->ids);
+    free(particles->slots);
+    particles->ids = particles->slots = NULL;
+    free_neighbor_lists(particles);
+    particles->num_particles = 0;
+    particles->capacity = 0;
 }
 
 void add_particle(Particles* particles, double max_x, double max_y) {
-    Particle* new_particles = realloc(particles->particles, (particles->num_particles + 1) * sizeof(Particle));
-    if (new_particles == NULL) {
-        perror("Memory reallocation failed for adding a particle.");
-        return;
+    emit_particles(particles, 1, (Region) { 0, 0, max_x, max_y });
+}
+
+// Whether values points into the checkpoint mapped by load_checkpoint
+static bool is_mapped(const Particles* particles, const real_t* values) {
+    const char* start = particles->mapping;
+    return start != NULL && (const char*)values >= start && (const char*)values < start + particles->mapping_size;
+}
+
+// Grows every per-particle array to hold at least count particles. The capacity at least
+// doubles each time, so a stream of emits reallocates only O(log n) times.
+void reserve_particles(Particles* particles, int count) {
+    if (count <= particles->capacity) return;
+    int capacity = particles->capacity * 2;
+    if (capacity < count) capacity = count;
+
+    real_t** arrays[9] = {&particles->x, &particles->y, &particles->vx, &particles->vy, &particles->density,
+                          &particles->predicted_x, &particles->predicted_y, &particles->accel_x, &particles->accel_y};
+    for (int k = 0; k < 9; k++) {
+        real_t* grown;
+        if (is_mapped(particles, *arrays[k])) {
+            // Mapped checkpoint state moves to the heap. Tested per pointer, since the
+            // predict phase swaps the mapped positions with the predicted ones.
+            grown = malloc(capacity * sizeof(real_t));
+            if (grown != NULL) memcpy(grown, *arrays[k], particles->num_particles * sizeof(real_t));
+        } else {
+            grown = realloc(*arrays[k], capacity * sizeof(real_t));
+        }
+        if (grown == NULL) {
+            perror("Memory allocation failed for particles.");
+            exit(EXIT_FAILURE);
+        }
+        *arrays[k] = grown;
+    }
+    unmap_checkpoint(particles);
+
+    Entry* lookup = realloc(particles->spatial_lookup, capacity * sizeof(Entry));
+    if (lookup != NULL) particles->spatial_lookup = lookup;
+    Entry* buffer = realloc(particles->sort_buffer, capacity * sizeof(Entry));
+    if (buffer != NULL) particles->sort_buffer = buffer;
+    uint* prev_cell = realloc(particles->prev_cell, capacity * sizeof(uint));
+    if (prev_cell != NULL) particles->prev_cell = prev_cell;
+    if (lookup == NULL || buffer == NULL || prev_cell == NULL) {
+        perror("Memory allocation failed for the spatial lookup.");
+        exit(EXIT_FAILURE);
+    }
+    if (particles->ids != NULL) {
+        int* ids = realloc(particles->ids, capacity * sizeof(int));
+        if (ids != NULL) particles->ids = ids;
+        int* slots = realloc(particles->slots, capacity * sizeof(int));
+        if (slots != NULL) particles->slots = slots;
+        if (ids == NULL || slots == NULL) {
+            perror("Memory allocation failed for particles.");
+            exit(EXIT_FAILURE);
+        }
+    }
+    particles->capacity = capacity;
+
+#ifdef SPATIAL_HASH
+    // The hashed table is folded modulo the capacity, so it is resized with it
+    if (particles->cell_start != NULL) init_spatial_grid(particles);
+#endif
+}
+
+bool region_contains(Region region, real_t x, real_t y) {
+    return x >= region.min_x && x <= region.max_x && y >= region.min_y && y <= region.max_y;
+}
+
+// Appends count particles at rest, spread uniformly over region. They enter the lookup
+// with a key past every cell, so the next incremental update inserts them like any other
+// particle that changed cell instead of forcing a rebuild.
+void emit_particles(Particles* particles, int count, Region region) {
+    if (count <= 0) return;
+    int first = particles->num_particles;
+    reserve_particles(particles, first + count);
+
+    double width = region.max_x - region.min_x;
+    double height = region.max_y - region.min_y;
+    for (int i = first; i < first + count; i++) {
+        uint32_t r[4];
+        random_block(particles->seed, RANDOM_EMIT, particles->step, particles->emitted++, 0, r);
+        particles->x[i] = (real_t)(region.min_x + random_unit_from(r[0]) * width);
+        particles->y[i] = (real_t)(region.min_y + random_unit_from(r[1]) * height);
+        particles->vx[i] = particles->vy[i] = 0;
+        particles->density[i] = 0;
+        particles->prev_cell[i] = UINT_MAX;
+        particles->spatial_lookup[i].idx = i;
+        particles->spatial_lookup[i].cell_key = UINT_MAX;
+        // Appended after every existing id, which are 0 .. first - 1
+        if (particles->ids != NULL) particles->ids[i] = particles->slots[i] = i;
     }
-    
-    particles->particles = new_particles;
-    
-    Particle* p = &particles->particles[particles->index];
-    p->index = particles->index;
-    p->position[0] = (double)rand() / RAND_MAX * max_x;
-    p->position[1] = (double)rand() / RAND_MAX * max_y;
-    p->velocity[0] = p->velocity[1] = 0;
-    p->acceleration[0] = p->acceleration[1] = 0;
-    p->density = 0;
-    
-    particles->index++;
-    particles->num_particles++;
+
+    particles->num_particles += count;
+    particles->neighbor_lists_valid = false;
+}
+
+// Removes every particle inside region and returns how many were removed. Survivors are
+// compacted in order, so the freed slots are reused by the next emit, and renumbering
+// them keeps the lookup sorted without a rebuild.
+int remove_particles(Particles* particles, Region region) {
+    int n = particles->num_particles;
+    // sort_buffer doubles as the old to new index map, -1 for removed particles
+    Entry* remap = particles->sort_buffer;
+    int kept = 0;
+
+    for (int i = 0; i < n; i++) {
+        if (region_contains(region, particles->x[i], particles->y[i])) {
+            remap[i].idx = -1;
+            continue;
+        }
+        remap[i].idx = kept;
+        if (kept != i) {
+            // Predicted positions and accelerations are rewritten every step
+            particles->x[kept] = particles->x[i];
+            particles->y[kept] = particles->y[i];
+            particles->vx[kept] = particles->vx[i];
+            particles->vy[kept] = particles->vy[i];
+            particles->density[kept] = particles->density[i];
+            particles->prev_cell[kept] = particles->prev_cell[i];
+        }
+        kept++;
+    }
+    if (kept == n) return 0;
+
+    if (particles->ids != NULL) {
+        // Survivors keep their relative id order, so ids stay 0 .. kept - 1 and match the
+        // indices an unreordered run would have
+        int next = 0;
+        for (int id = 0; id < n; id++) {
+            int slot = remap[particles->slots[id]].idx;
+            if (slot < 0) continue;
+            particles->ids[slot] = next;
+            particles->slots[next++] = slot;
+        }
+    }
+    if (particles->lookup_valid) {
+        int out = 0;
+        for (int k = 0; k < n; k++) {
+            Entry e = particles->spatial_lookup[k];
+            e.idx = remap[e.idx].idx;
+            if (e.idx >= 0) particles->spatial_lookup[out++] = e;
+        }
+    }
+    particles->num_particles = kept;
+    if (particles->lookup_valid) fill_cell_start(particles);
+    particles->neighbor_lists_valid = false;
+
+    return n - kept;
 }
 
 void update_particles(Particles* particles, double dt, int frames) {
-    #pragma omp parallel for
-    for (int i = 0; i < particles->num_particles; i++){
-        Particle* p = &particles->particles[i];
-        p->density = calculate_density(particles, p->position);
+    int n = particles->num_particles;
+    PROFILE_BEGIN(STEP);
+    predict_positions(particles, dt, n);
+    refresh_neighbors(particles);
+    compute_densities(particles, n);
+    compute_accelerations(particles, n);
+    integrate_particles(particles, dt, n);
+    particles->step++;
+    if (particles->reorder_interval > 0 && particles->step % particles->reorder_interval == 0) {
+        reorder_particles(particles);
     }
+    PROFILE_END(STEP);
 
-    if (frames / 3 == 0) update_spatial_lookup(particles);
+    if (particles->trajectory != NULL) {
+        record_trajectory_frame(particles->trajectory, particles, frames);
+    }
+}
 
-    #pragma omp parallel for
-    for (int i = 0; i < particles->num_particles; i++) {
-        Particle* p = &particles->particles[i];
-        p->velocity[0] += particles->forces[0] * dt;
-        p->velocity[1] += particles->forces[1] * dt;
+// The phases of a step, in order. Each one covers the first count particles, so callers
+// that keep extra particles after those (the ghosts of the distributed driver) can fill
+// them in between phases.
 
-        double pressure_force[2];
-        calculate_pressure_force(particles, i, pressure_force);
-        p->acceleration[0] = pressure_force[0] / p->density;
-        p->acceleration[1] = pressure_force[1] / p->density;
+// External forces first, then the neighbor search, densities and forces all run on the
+// positions the particles are predicted to reach this step. Leaves those in x and y.
+void predict_positions(Particles* particles, double dt, int count) {
+    real_t step = (real_t)dt;
+    real_t gravity_x = (real_t)(particles->forces[0] * dt);
+    real_t gravity_y = (real_t)(particles->forces[1] * dt);
 
-        p->velocity[0] += p->acceleration[0] * dt;
-        p->velocity[1] += p->acceleration[1] * dt;
+    PROFILE_BEGIN(PREDICT);
+    #pragma omp parallel
+    {
+        PROFILE_WORK_BEGIN(PREDICT);
+        #pragma omp for nowait
+        for (int i = 0; i < count; i++) {
+            particles->vx[i] += gravity_x;
+            particles->vy[i] += gravity_y;
+            particles->predicted_x[i] = particles->x[i] + particles->vx[i] * step;
+            particles->predicted_y[i] = particles->y[i] + particles->vy[i] * step;
+        }
+        PROFILE_WORK_END(PREDICT);
+    }
+    swap_predicted_positions(particles);
+    PROFILE_END(PREDICT);
+}
 
-        p->position[0] += p->velocity[0] * dt;
-        p->position[1] += p->velocity[1] * dt;
+void refresh_neighbors(Particles* particles) {
+    if (particles->neighbor_skin > 0) {
+        update_neighbor_lists(particles);
+    } else {
+        update_spatial_lookup(particles);
+    }
+}
 
-        handle_wall_collisions(particles, p);
+void compute_densities(Particles* particles, int count) {
+    PROFILE_BEGIN(DENSITY);
+    #pragma omp parallel
+    {
+        PROFILE_WORK_BEGIN(DENSITY);
+        #pragma omp for nowait
+        for (int i = 0; i < count; i++){
+            particles->density[i] = calculate_particle_density(particles, i);
+        }
+        PROFILE_WORK_END(DENSITY);
+    }
+    PROFILE_END(DENSITY);
+}
+
+// Forces go to their own arrays, nothing the sweep reads is written until every particle
+// has been visited
+void compute_accelerations(Particles* particles, int count) {
+    if (particles->pair_forces) {
+        compute_pair_accelerations(particles, count);
+        return;
+    }
+    PROFILE_BEGIN(FORCES);
+    #pragma omp parallel
+    {
+        PROFILE_WORK_BEGIN(FORCES);
+        #pragma omp for nowait
+        for (int i = 0; i < count; i++) {
+            real_t acceleration[2];
+            calculate_acceleration(particles, i, acceleration);
+            particles->accel_x[i] = acceleration[0];
+            particles->accel_y[i] = acceleration[1];
+        }
+        PROFILE_WORK_END(FORCES);
+    }
+    PROFILE_END(FORCES);
+}
+
+// Restores the current positions and advances them. Wall collisions are resolved in the
+// same pass, so they are timed as part of it.
+void integrate_particles(Particles* particles, double dt, int count) {
+    real_t step = (real_t)dt;
+    swap_predicted_positions(particles);
+
+    PROFILE_BEGIN(INTEGRATE);
+    #pragma omp parallel
+    {
+        PROFILE_WORK_BEGIN(INTEGRATE);
+        #pragma omp for nowait
+        for (int i = 0; i < count; i++) {
+            particles->vx[i] += particles->accel_x[i] * step;
+            particles->vy[i] += particles->accel_y[i] * step;
+
+            particles->x[i] += particles->vx[i] * step;
+            particles->y[i] += particles->vy[i] * step;
+
+            if (particles->obstacles != NULL) resolve_obstacle_contact(particles, i, step);
+            handle_wall_collisions(particles, i);
+        }
+        PROFILE_WORK_END(INTEGRATE);
     }
+    PROFILE_END(INTEGRATE);
 }
 
-double calculate_density(Particles* particles, double p[2]) {
-    double mass = 1;
-    double density = 0;
-    
+// Exchanges the current and predicted positions, so the neighbor queries (which all
+// read x and y) can run on the predicted ones without a second set of kernels
+void swap_predicted_positions(Particles* particles) {
+    real_t* x = particles->x;
+    real_t* y = particles->y;
+    particles->x = particles->predicted_x;
+    particles->y = particles->predicted_y;
+    particles->predicted_x = x;
+    particles->predicted_y = y;
+}
+
+// Density at an arbitrary point, gathered from the 3x3 cells around it.
+// Requires the spatial lookup to be up to date with the particle positions.
+real_t calculate_density(Particles* particles, real_t px, real_t py) {
+    real_t mass = 1;
+    real_t density = 0;
+    int spans[MAX_NEIGHBOR_SPANS][2];
+    int num_spans = neighbor_spans(particles, px, py, spans);
+
+    for (int s = 0; s < num_spans; s++) {
+        density += mass * density_span(particles, &particles->spatial_lookup[spans[s][0]].idx, ENTRY_STRIDE, spans[s][1] - spans[s][0], px, py);
+    }
+
+    return density;
+}
+
+// Density of particle idx, from its neighbor list when the lists are in use
+real_t calculate_particle_density(Particles* particles, int idx) {
+    if (using_neighbor_lists(particles)) {
+        int start = particles->neighbor_offsets[idx];
+        int count = particles->neighbor_offsets[idx + 1] - start;
+        return density_span(particles, particles->neighbor_indices + start, 1, count, particles->x[idx], particles->y[idx]);
+    }
+    return calculate_density(particles, particles->x[idx], particles->y[idx]);
+}
+
+// Brute-force O(N) density, kept as the reference for the grid version
+real_t calculate_density_reference(Particles* particles, real_t px, real_t py) {
+    real_t mass = 1;
+    real_t density = 0;
+
     for (int i = 0; i < particles->num_particles; i++) {
-        Particle* current = &particles->particles[i];
-        double dist = hypot(current->position[0] - p[0], current->position[1] - p[1]);
-        double influence = smoothing_kernel(particles->influence_radius, dist);
+        real_t dx = particles->x[i] - px;
+        real_t dy = particles->y[i] - py;
+        real_t influence = density_kernel(&particles->kernel, dx * dx + dy * dy);
         density += mass * influence;
     }
 
     return density;
 }
 
-void calculate_pressure_force(Particles* particles, int idx, double pressure_force[2]) {
+void calculate_pressure_force(Particles* particles, int idx, real_t pressure_force[2]) {
     pressure_force[0] = pressure_force[1] = 0;
-    double mass = 1;
-    double p[2] = {particles->particles[idx].position[0], particles->particles[idx].position[1]};
+    real_t p[2] = {particles->x[idx], particles->y[idx]};
 
+    if (using_neighbor_lists(particles)) {
+        int start = particles->neighbor_offsets[idx];
+        int count = particles->neighbor_offsets[idx + 1] - start;
+        pressure_span(particles, particles->neighbor_indices + start, 1, count, idx, p[0], p[1], particles->density[idx], pressure_force);
+        return;
+    }
     for_each_point_within_radius(particles, p, pressure_force, idx);
 }
 
-void handle_wall_collisions(Particles* particles, Particle* p) {
-    if (p->position[0] <= particles->radius) {
-        p->position[0] = particles->radius;
-        p->velocity[0] *= -particles->collision_loss;
+// One pass over a run of neighbors of particle self, accumulating every term in terms.
+// Always inlined with a constant terms, so the terms left out cost nothing.
+static inline __attribute__((always_inline)) void sweep_neighbor_span(Particles* particles, const int* indices, int stride, int count, int self, unsigned terms, real_t pressure_force[2], real_t viscosity_force[2]) {
+    const SmoothingConstants* kernel = &particles->kernel;
+    real_t px = particles->x[self];
+    real_t py = particles->y[self];
+    real_t own_density = particles->density[self];
+
+    for (int k = 0; k < count; k++) {
+        int j = indices[k * stride];
+        if (j == self) continue;
+        real_t offset[2] = {particles->x[j] - px, particles->y[j] - py};
+        real_t d2 = offset[0] * offset[0] + offset[1] * offset[1];
+        if (d2 > kernel->h2) continue;
+
+        if (terms & TERM_PRESSURE) {
+            // The gradient is offset * slope / d, or a random direction times the slope
+            // when the two coincide
+            real_t gradient[2];
+            if (d2 == 0) {
+                getRandomDir(particles, self, j, gradient);
+                real_t slope = pressure_slope(kernel, 0);
+                gradient[0] *= slope;
+                gradient[1] *= slope;
+            } else {
+                real_t scale = pressure_slope_over_distance(kernel, d2);
+                gradient[0] = offset[0] * scale;
+                gradient[1] = offset[1] * scale;
+            }
+            real_t density = particles->density[j];
+            real_t shared_pressure = calculate_shared_pressure(particles, density, own_density);
+
+            pressure_force[0] += -gradient[0] * shared_pressure / density;
+            pressure_force[1] += -gradient[1] * shared_pressure / density;
+        }
+        if (terms & TERM_VISCOSITY) {
+            real_t influence = viscosity_weight(kernel, d2);
+            viscosity_force[0] += (particles->vx[j] - particles->vx[self]) * influence;
+            viscosity_force[1] += (particles->vy[j] - particles->vy[self]) * influence;
+        }
     }
-    if (p->position[0] >= particles->max_x - particles->radius) {
-        p->position[0] = particles->max_x - particles->radius;
-        p->velocity[0] *= -particles->collision_loss;
+}
+
+static inline __attribute__((always_inline)) void sweep_neighbors(Particles* particles, int idx, unsigned terms, real_t acceleration[2]) {
+    real_t pressure_force[2] = {0, 0};
+    real_t viscosity_force[2] = {0, 0};
+
+    if (terms == TERM_PRESSURE) {
+        // Pressure alone has vectorized span kernels
+        calculate_pressure_force(particles, idx, pressure_force);
+    } else if (using_neighbor_lists(particles)) {
+        int start = particles->neighbor_offsets[idx];
+        int count = particles->neighbor_offsets[idx + 1] - start;
+        sweep_neighbor_span(particles, particles->neighbor_indices + start, 1, count, idx, terms, pressure_force, viscosity_force);
+    } else {
+        int spans[MAX_NEIGHBOR_SPANS][2];
+        int num_spans = neighbor_spans(particles, particles->x[idx], particles->y[idx], spans);
+        for (int s = 0; s < num_spans; s++) {
+            sweep_neighbor_span(particles, &particles->spatial_lookup[spans[s][0]].idx, ENTRY_STRIDE, spans[s][1] - spans[s][0], idx, terms, pressure_force, viscosity_force);
+        }
+    }
+
+    real_t viscosity = (real_t)particles->viscosity;
+    acceleration[0] = pressure_force[0] / particles->density[idx] + viscosity * viscosity_force[0];
+    acceleration[1] = pressure_force[1] / particles->density[idx] + viscosity * viscosity_force[1];
+}
+
+// Acceleration of particle idx from all interaction terms, in a single neighbor sweep
+void calculate_acceleration(Particles* particles, int idx, real_t acceleration[2]) {
+    if (particles->viscosity != 0) {
+        sweep_neighbors(particles, idx, TERM_PRESSURE | TERM_VISCOSITY, acceleration);
+    } else {
+        sweep_neighbors(particles, idx, TERM_PRESSURE, acceleration);
     }
-    if (p->position[1] <= particles->radius) {
-        p->position[1] = particles->radius;
-        p->velocity[1] *= -particles->collision_loss;
+}
+
+// Grows a chunk's buffers to hold at least size particles, zeroing the new part
+static __attribute__((noinline)) void grow_pair_chunk(PairChunk* chunk, int size) {
+    int grown = chunk->size * 2 > size ? chunk->size * 2 : size;
+    real_t* ax = realloc(chunk->ax, grown * sizeof(real_t));
+    if (ax == NULL) {
+        perror("Memory allocation failed for the pair force buffers.");
+        exit(EXIT_FAILURE);
     }
-    if (p->position[1] >= particles->max_y - particles->radius) {
-        p->position[1] = particles->max_y - particles->radius;
-        p->velocity[1] *= -particles->collision_loss;
+    chunk->ax = ax;
+    real_t* ay = realloc(chunk->ay, grown * sizeof(real_t));
+    if (ay == NULL) {
+        perror("Memory allocation failed for the pair force buffers.");
+        exit(EXIT_FAILURE);
     }
+    chunk->ay = ay;
+    memset(chunk->ax + chunk->size, 0, (grown - chunk->size) * sizeof(real_t));
+    memset(chunk->ay + chunk->size, 0, (grown - chunk->size) * sizeof(real_t));
+    chunk->size = grown;
 }
 
-void getRandomDir(double dir[2]) {
-    dir[0] = (double)rand() / RAND_MAX;
-    dir[1] = 1.0 - dir[0];
+// Pair-once counterpart of sweep_neighbor_span: only neighbors j > self are visited, and
+// each pair's acceleration goes to self and, negated, to j. The pressure term divides by
+// both densities at once, which makes it exactly antisymmetric.
+static inline __attribute__((always_inline)) void sweep_pair_span(Particles* particles, const int* indices, int stride, int count, int self, unsigned terms, PairChunk* chunk) {
+    const SmoothingConstants* kernel = &particles->kernel;
+    real_t px = particles->x[self];
+    real_t py = particles->y[self];
+    real_t own_density = particles->density[self];
+    real_t viscosity = (real_t)particles->viscosity;
+    real_t own[2] = {0, 0};
+
+    for (int k = 0; k < count; k++) {
+        int j = indices[k * stride];
+        if (j <= self) continue;
+        real_t offset[2] = {particles->x[j] - px, particles->y[j] - py};
+        real_t d2 = offset[0] * offset[0] + offset[1] * offset[1];
+        if (d2 > kernel->h2) continue;
+        real_t a[2] = {0, 0};
+
+        if (terms & TERM_PRESSURE) {
+            real_t gradient[2];
+            if (d2 == 0) {
+                getRandomDir(particles, self, j, gradient);
+                real_t slope = pressure_slope(kernel, 0);
+                gradient[0] *= slope;
+                gradient[1] *= slope;
+            } else {
+                real_t scale = pressure_slope_over_distance(kernel, d2);
+                gradient[0] = offset[0] * scale;
+                gradient[1] = offset[1] * scale;
+            }
+            real_t density = particles->density[j];
+            real_t shared_pressure = calculate_shared_pressure(particles, density, own_density);
+            real_t magnitude = shared_pressure / (density * own_density);
+            a[0] -= gradient[0] * magnitude;
+            a[1] -= gradient[1] * magnitude;
+        }
+        if (terms & TERM_VISCOSITY) {
+            real_t influence = viscosity * viscosity_weight(kernel, d2);
+            a[0] += (particles->vx[j] - particles->vx[self]) * influence;
+            a[1] += (particles->vy[j] - particles->vy[self]) * influence;
+        }
+        own[0] += a[0];
+        own[1] += a[1];
+        int slot = j - chunk->first;
+        if (slot >= chunk->size) grow_pair_chunk(chunk, slot + 1);
+        if (j > chunk->reach) chunk->reach = j;
+        chunk->ax[slot] -= a[0];
+        chunk->ay[slot] -= a[1];
+    }
+    chunk->ax[self - chunk->first] += own[0];
+    chunk->ay[self - chunk->first] += own[1];
 }
 
+static inline __attribute__((always_inline)) void sweep_pairs(Particles* particles, int idx, unsigned terms, PairChunk* chunk) {
+    if (using_neighbor_lists(particles)) {
+        int start = particles->neighbor_offsets[idx];
+        int count = particles->neighbor_offsets[idx + 1] - start;
+        sweep_pair_span(particles, particles->neighbor_indices + start, 1, count, idx, terms, chunk);
+    } else {
+        int spans[MAX_NEIGHBOR_SPANS][2];
+        int num_spans = neighbor_spans(particles, particles->x[idx], particles->y[idx], spans);
+        for (int s = 0; s < num_spans; s++) {
+            sweep_pair_span(particles, &particles->spatial_lookup[spans[s][0]].idx, ENTRY_STRIDE, spans[s][1] - spans[s][0], idx, terms, chunk);
+        }
+    }
+}
 
-void update_spatial_lookup(Particles* particles) {
-    int cell[2];
-    uint cell_key;
-    uint key;
-    uint key_prev;
-    for(int i = 0; i < particles->num_particles; i++) {
-        position_to_cell_coord(particles->particles[i].position, cell, particles->influence_radius);
-        cell_key = get_key_from_hash(hash_cell(cell[0], cell[1]), particles->num_particles);
+// Pair-once version of compute_accelerations. The particles are split into PAIR_CHUNKS
+// fixed chunks, each swept in order into its own buffers by one thread, and every
+// particle's acceleration is then summed over the chunks in chunk order. The split does
+// not depend on the thread count, so neither do the rounding errors. A chunk's buffers
+// cover its own particles up to the highest partner it reaches, only that range is read
+// and cleared again. Partners past count (ghosts) are accumulated but discarded.
+void compute_pair_accelerations(Particles* particles, int count) {
+    PairChunk* chunks = particles->pair_chunks;
+    unsigned terms = particles->viscosity != 0 ? TERM_PRESSURE | TERM_VISCOSITY : TERM_PRESSURE;
+
+    PROFILE_BEGIN(FORCES);
+    #pragma omp parallel
+    {
+        PROFILE_WORK_BEGIN(FORCES);
+        #pragma omp for schedule(dynamic)
+        for (int c = 0; c < PAIR_CHUNKS; c++) {
+            PairChunk* chunk = &chunks[c];
+            int begin = (int)((long)count * c / PAIR_CHUNKS);
+            int end = (int)((long)count * (c + 1) / PAIR_CHUNKS);
+            chunk->first = begin;
+            chunk->reach = end - 1;
+            if (end > begin && chunk->size < end - begin) grow_pair_chunk(chunk, end - begin);
+            for (int i = begin; i < end; i++) {
+                if (terms == TERM_PRESSURE) {
+                    sweep_pairs(particles, i, TERM_PRESSURE, chunk);
+                } else {
+                    sweep_pairs(particles, i, TERM_PRESSURE | TERM_VISCOSITY, chunk);
+                }
+            }
+        }
+        PROFILE_WORK_END(FORCES);
+
+        #pragma omp for
+        for (int i = 0; i < count; i++) {
+            real_t sum[2] = {0, 0};
+            for (int c = 0; c < PAIR_CHUNKS && chunks[c].first <= i; c++) {
+                if (i > chunks[c].reach) continue;
+                int slot = i - chunks[c].first;
+                sum[0] += chunks[c].ax[slot];
+                sum[1] += chunks[c].ay[slot];
+                chunks[c].ax[slot] = 0;
+                chunks[c].ay[slot] = 0;
+            }
+            particles->accel_x[i] = sum[0];
+            particles->accel_y[i] = sum[1];
+        }
+
+        #pragma omp for
+        for (int c = 0; c < PAIR_CHUNKS; c++) {
+            int from = count > chunks[c].first ? count - chunks[c].first : 0;
+            int to = chunks[c].reach - chunks[c].first + 1;
+            if (to > from) {
+                memset(chunks[c].ax + from, 0, (to - from) * sizeof(real_t));
+                memset(chunks[c].ay + from, 0, (to - from) * sizeof(real_t));
+            }
+        }
+    }
+    PROFILE_END(FORCES);
+}
+
+void handle_wall_collisions(Particles* particles, int idx) {
+    real_t min_x = (real_t)particles->radius;
+    real_t min_y = (real_t)particles->radius;
+    real_t max_x = (real_t)(particles->max_x - particles->radius);
+    real_t max_y = (real_t)(particles->max_y - particles->radius);
+    real_t loss = (real_t)particles->collision_loss;
+
+    if (particles->x[idx] <= min_x) {
+        particles->x[idx] = min_x;
+        particles->vx[idx] *= -loss;
+    }
+    if (particles->x[idx] >= max_x) {
+        particles->x[idx] = max_x;
+        particles->vx[idx] *= -loss;
+    }
+    if (particles->y[idx] <= min_y) {
+        particles->y[idx] = min_y;
+        particles->vy[idx] *= -loss;
+    }
+    if (particles->y[idx] >= max_y) {
+        particles->y[idx] = max_y;
+        particles->vy[idx] *= -loss;
+    }
+}
+
+// Direction to push apart particles i and j when they coincide. Drawn from the pair's
+// ids and the step, so it does not depend on which thread evaluates the pair or on
+// where reordering has moved the two particles.
+void getRandomDir(const Particles* particles, int i, int j, real_t dir[2]) {
+    if (particles->ids != NULL) {
+        i = particles->ids[i];
+        j = particles->ids[j];
+    }
+    uint32_t r[4];
+    random_block(particles->seed, RANDOM_DIRECTION, particles->step, i, j, r);
+    dir[0] = (real_t)random_unit_from(r[0]);
+    dir[1] = 1 - dir[0];
+}
+
+// Moves the particles into Morton order of their grid cells, so the particles of a cell
+// and of the cells around it sit next to each other in memory and the neighbor sweeps
+// read a few short runs instead of gathering across the whole arrays. Runs between steps,
+// when the predicted positions and accelerations are free to serve as scratch. The lookup
+// and neighbor lists refer to the old slots, so both are rebuilt on the next step.
+void reorder_particles(Particles* particles) {
+    int n = particles->num_particles;
+    if (n <= 1) return;
+
+    PROFILE_BEGIN(REORDER);
+    if (particles->ids == NULL) {
+        particles->ids = malloc(particles->capacity * sizeof(int));
+        particles->slots = malloc(particles->capacity * sizeof(int));
+        if (particles->ids == NULL || particles->slots == NULL) {
+            perror("Memory allocation failed for particles.");
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < n; i++) particles->ids[i] = particles->slots[i] = i;
+    }
+
+    // The radix sort is stable, so particles sharing a cell keep their order
+    #pragma omp parallel for
+    for (int i = 0; i < n; i++) {
+        int cell[2];
+        position_to_cell_coord(particles->x[i], particles->y[i], cell, (real_t)particles->cell_size);
         particles->spatial_lookup[i].idx = i;
-        particles->spatial_lookup[i].cell_key = cell_key;
-        particles->start_indices[i] = INT_MAX;
+        particles->spatial_lookup[i].cell_key = morton_key(cell[0], cell[1]);
     }
+    parallel_radixsort(particles);
+    const Entry* order = particles->spatial_lookup;
 
-    radixsort(particles);
+    // Gathered into scratch and copied back rather than swapped, so arrays still mapped
+    // from a checkpoint stay where they are
+    real_t* arrays[5] = {particles->x, particles->y, particles->vx, particles->vy, particles->density};
+    real_t* scratch = particles->predicted_x;
+    for (int k = 0; k < 5; k++) {
+        real_t* values = arrays[k];
+        #pragma omp parallel for
+        for (int i = 0; i < n; i++) {
+            scratch[i] = values[order[i].idx];
+        }
+        memcpy(values, scratch, n * sizeof(real_t));
+    }
+
+    Entry* moved_ids = particles->sort_buffer;
+    #pragma omp parallel for
+    for (int i = 0; i < n; i++) {
+        moved_ids[i].idx = particles->ids[order[i].idx];
+    }
+    #pragma omp parallel for
+    for (int i = 0; i < n; i++) {
+        particles->ids[i] = moved_ids[i].idx;
+        particles->slots[moved_ids[i].idx] = i;
+    }
+
+    particles->lookup_valid = false;
+    particles->neighbor_lists_valid = false;
+    PROFILE_END(REORDER);
+}
+
+// Current slot of the particle with the given id
+int particle_slot(const Particles* particles, int id) {
+    return particles->slots != NULL ? particles->slots[id] : id;
+}
+
+// Copies one per-particle array into out in id order, as output code expects it
+void gather_by_id(const Particles* particles, const real_t* values, real_t* out) {
+    int n = particles->num_particles;
+    if (particles->slots == NULL) {
+        memcpy(out, values, n * sizeof(real_t));
+        return;
+    }
+    #pragma omp parallel for
+    for (int id = 0; id < n; id++) {
+        out[id] = values[particles->slots[id]];
+    }
+}
+
+
+// Sizes the cell table for the current domain and particle count
+void init_spatial_grid(Particles* particles) {
+    particles->cell_size = particles->influence_radius + particles->neighbor_skin;
+#ifdef SPATIAL_HASH
+    particles->grid_cols = particles->grid_rows = 0;
+    particles->num_cells = particles->capacity;
+#else
+    particles->grid_cols = (int)(particles->max_x / particles->cell_size) + 1;
+    particles->grid_rows = (int)(particles->max_y / particles->cell_size) + 1;
+    particles->num_cells = particles->grid_cols * particles->grid_rows;
+#endif
+    free(particles->cell_start);
+    free(particles->grid_histograms);
+    particles->cell_start = malloc((particles->num_cells + 1) * sizeof(int));
+    particles->grid_histograms = NULL;
+#ifndef SPATIAL_HASH
+    particles->grid_histograms = malloc((size_t)particles->sort_threads * particles->num_cells * sizeof(int));
+    if (particles->grid_histograms == NULL) {
+        perror("Memory allocation failed for the spatial grid.");
+        exit(EXIT_FAILURE);
+    }
+#endif
+    if (particles->cell_start == NULL) {
+        perror("Memory allocation failed for the spatial grid.");
+        exit(EXIT_FAILURE);
+    }
+    particles->lookup_valid = false;
+}
+
+void update_spatial_lookup(Particles* particles) {
+    PROFILE_BEGIN(LOOKUP);
+    bool patched = particles->incremental_lookup && particles->lookup_valid && patch_spatial_lookup(particles);
+    if (!patched) {
+#ifdef SPATIAL_HASH
+        build_hashed_lookup(particles);
+#else
+        build_dense_grid(particles);
+#endif
+        particles->lookup_valid = true;
+    }
+    PROFILE_END(LOOKUP);
+#ifdef DEBUG_SORT
     if (!check_sorted(particles)) {
         printf("Not sorted\n");
         exit(1);
     }
+#endif
+}
 
-    for(int i = 0; i < particles->num_particles; i++) {
-        key = particles->spatial_lookup[i].cell_key;
-        key_prev = i == 0 ? UINT_MAX : particles->spatial_lookup[i - 1].cell_key;
-        if (key != key_prev) {
-            particles->start_indices[key] = i;
+// Counting sort on exact cell ids. The per-thread histograms are turned into bucket
+// offsets in place, which also yields cell_start, and every particle is scattered
+// straight to its final slot.
+void build_dense_grid(Particles* particles) {
+    int n = particles->num_particles;
+    int num_cells = particles->num_cells;
+
+    PROFILE_BEGIN(SORT);
+    #pragma omp parallel num_threads(particles->sort_threads)
+    {
+        int t = omp_get_thread_num();
+        int nt = omp_get_num_threads();
+        int begin = (int)((long)n * t / nt);
+        int end = (int)((long)n * (t + 1) / nt);
+        int* count = particles->grid_histograms + (size_t)t * num_cells;
+
+        memset(count, 0, num_cells * sizeof(int));
+        for (int i = begin; i < end; i++) {
+            uint key = position_to_cell_key(particles, particles->x[i], particles->y[i]);
+            particles->prev_cell[i] = key;
+            particles->sort_buffer[i].idx = i;
+            particles->sort_buffer[i].cell_key = key;
+            count[key]++;
         }
+
+        #pragma omp barrier
+        #pragma omp single
+        {
+            int offset = 0;
+            for (int c = 0; c < num_cells; c++) {
+                particles->cell_start[c] = offset;
+                for (int k = 0; k < nt; k++) {
+                    int* slot = &particles->grid_histograms[(size_t)k * num_cells + c];
+                    int tmp = *slot;
+                    *slot = offset;
+                    offset += tmp;
+                }
+            }
+            particles->cell_start[num_cells] = offset;
+        }
+
+        for (int i = begin; i < end; i++) {
+            Entry e = particles->sort_buffer[i];
+            particles->spatial_lookup[count[e.cell_key]++] = e;
+        }
+    }
+    PROFILE_END(SORT);
+}
+
+// Hashed table: keys fold cell coordinates modulo num_particles, so distinct cells can
+// share a bucket. Sorted with the radix sort, then cell_start is filled per key.
+void build_hashed_lookup(Particles* particles) {
+    int n = particles->num_particles;
+
+    #pragma omp parallel for
+    for (int i = 0; i < n; i++) {
+        uint key = position_to_cell_key(particles, particles->x[i], particles->y[i]);
+        particles->prev_cell[i] = key;
+        particles->spatial_lookup[i].idx = i;
+        particles->spatial_lookup[i].cell_key = key;
     }
 
+    PROFILE_BEGIN(SORT);
+#ifdef LEGACY_RADIXSORT
+    radixsort(particles);
+#else
+    parallel_radixsort(particles);
+#endif
+    PROFILE_END(SORT);
+
+    fill_cell_start(particles);
 }
 
-void for_each_point_within_radius(Particles* particles, double sample_point[2], double pressure_force[2], int idx){
-    int centre[2];
-    position_to_cell_coord(sample_point, centre, particles->influence_radius);
-    double dir[2];
+// Recomputes cell_start from the sorted lookup. Emitted particles not inserted yet sit
+// at the end with a key past every cell and belong to no cell.
+void fill_cell_start(Particles* particles) {
+    int n = particles->num_particles;
+    int key = 0;
+    int k = 0;
+    for (; k < n && particles->spatial_lookup[k].cell_key < (uint)particles->num_cells; k++) {
+        while (key <= (int)particles->spatial_lookup[k].cell_key) {
+            particles->cell_start[key++] = k;
+        }
+    }
+    while (key <= particles->num_cells) {
+        particles->cell_start[key++] = k;
+    }
+}
 
-    double offset_x[3] = {0, -1, 1};
-    double offset_y[3] = {0, -1, 1};
+// Departures are sorted by position, arrivals by cell, which orders them by position too
+static inline uint lookup_event_order(const LookupEvent* event) {
+    return event->arrival ? event->entry.cell_key : (uint)event->pos;
+}
 
-    for(int i = 0; i < 3; i++){
-        for(int j = 0; j < 3; j++){
-            uint key = get_key_from_hash(hash_cell(centre[0] + offset_x[i], centre[1] + offset_y[j]), particles->num_particles);
-            int cell_start_index = particles->start_indices[key];
+// Stable LSD radix sort of departures or arrivals through scratch, skipping the bytes all
+// share. They are generated in particle order, which stability keeps among equal orders.
+static void sort_lookup_events(LookupEvent* events, LookupEvent* scratch, int count) {
+    LookupEvent* src = events;
+    LookupEvent* dst = scratch;
+    for (int shift = 0; shift < 32; shift += 8) {
+        int count_of[256] = {0};
+        for (int k = 0; k < count; k++) count_of[(lookup_event_order(&src[k]) >> shift) & 0xFF]++;
+        if (count_of[(lookup_event_order(&src[0]) >> shift) & 0xFF] == count) continue;
+        int offset = 0;
+        for (int b = 0; b < 256; b++) {
+            int tmp = count_of[b];
+            count_of[b] = offset;
+            offset += tmp;
+        }
+        for (int k = 0; k < count; k++) dst[count_of[(lookup_event_order(&src[k]) >> shift) & 0xFF]++] = src[k];
+        LookupEvent* tmp = src;
+        src = dst;
+        dst = tmp;
+    }
+    if (src != events) memcpy(events, src, count * sizeof(LookupEvent));
+}
 
-            for(int k = cell_start_index; k < particles->num_particles; k++){
-                if (particles->spatial_lookup[k].cell_key != key) break;
-                int particle_index = particles->spatial_lookup[k].idx;
-                double dst = hypot(sample_point[0] - particles->particles[particle_index].position[0], sample_point[1] - particles->particles[particle_index].position[1]);
+// Incremental update: only particles whose cell differs from prev_cell are moved. Each
+// mover leaves the slot it had in its old cell and enters at the end of its new one, so
+// the entries between two such events all shift by the same amount and are copied into
+// sort_buffer in parallel, which then becomes the lookup. cell_start likewise only shifts
+// between the cells the movers leave and enter. Returns false without touching the
+// lookup when the movers exceed rebuild_fraction, so the caller does a full rebuild.
+bool patch_spatial_lookup(Particles* particles) {
+    int n = particles->num_particles;
+    int num_cells = particles->num_cells;
+    const Entry* lookup = particles->spatial_lookup;
+    const int* cell_start = particles->cell_start;
+    // sort_buffer holds the new cells until the patched lookup is copied into it
+    Entry* keys = particles->sort_buffer;
+    int* counts = particles->sort_histograms;
+    int movers = 0;
+    bool patch = false;
 
-                if (dst <= particles->influence_radius){
-                    if(particle_index == idx) continue;
-                    Particle* current = &particles->particles[particle_index];
+    #pragma omp parallel num_threads(particles->sort_threads)
+    {
+        int t = omp_get_thread_num();
+        int nt = omp_get_num_threads();
+        int begin = (int)((long)n * t / nt);
+        int end = (int)((long)n * (t + 1) / nt);
 
-                    double offset[2] = {current->position[0] - sample_point[0], current->position[1] - sample_point[1]};
-                    double dst = hypot(offset[0], offset[1]);
-                    if (dst == 0){
-                        getRandomDir(dir);
-                    } else {
-                        dir[0] = offset[0] / dst;
-                        dir[1] = offset[1] / dst;
-                    }
-                    double slope = smoothing_kernel_gradient(dst, particles->influence_radius);
-                    double density = current->density;
-                    double shared_pressure = calculate_shared_pressure(current->density, particles->particles[idx].density);
+        int moved = 0;
+        for (int i = begin; i < end; i++) {
+            uint key = position_to_cell_key(particles, particles->x[i], particles->y[i]);
+            keys[i].cell_key = key;
+            moved += key != particles->prev_cell[i];
+        }
+        counts[t * RADIX_BUCKETS] = moved;
 
-                    pressure_force[0] += -dir[0] * slope * shared_pressure / density;
-                    pressure_force[1] += -dir[1] * slope * shared_pressure / density;
+        #pragma omp barrier
+        #pragma omp single
+        {
+            for (int k = 0; k < nt; k++) {
+                int moved_before = movers;
+                movers += counts[k * RADIX_BUCKETS];
+                counts[k * RADIX_BUCKETS] = moved_before;
+            }
+            particles->last_lookup_movers = movers;
+            patch = movers > 0 && movers <= particles->rebuild_fraction * n;
+            // A departure and an arrival per mover, and as many again to sort and merge them
+            if (patch && particles->lookup_event_capacity < 4 * movers) {
+                free(particles->lookup_events);
+                particles->lookup_event_capacity = 4 * movers;
+                particles->lookup_events = malloc(particles->lookup_event_capacity * sizeof(LookupEvent));
+                if (particles->lookup_events == NULL) {
+                    perror("Memory allocation failed for the spatial lookup.");
+                    exit(EXIT_FAILURE);
                 }
             }
+        }
+
+        if (patch) {
+            LookupEvent* departures = particles->lookup_events + counts[t * RADIX_BUCKETS];
+            LookupEvent* arrivals = departures + movers;
+            for (int i = begin; i < end; i++) {
+                uint key = keys[i].cell_key;
+                uint old_key = particles->prev_cell[i];
+                if (key == old_key) continue;
+                // Emitted particles wait past the last cell until their first update
+                int from = old_key < (uint)num_cells ? cell_start[old_key] : cell_start[num_cells];
+                while (lookup[from].idx != i) from++;
+                *departures++ = (LookupEvent) { from, 0, false, { i, old_key } };
+                *arrivals++ = (LookupEvent) { cell_start[key + 1], 0, true, { i, key } };
+                particles->prev_cell[i] = key;
+            }
+        }
+    }
+    if (!patch) return movers == 0;
+
+    PROFILE_BEGIN(SORT);
+    LookupEvent* departures = particles->lookup_events;
+    LookupEvent* arrivals = departures + movers;
+    LookupEvent* events = arrivals + movers;
+    int num_events = 2 * movers;
+    sort_lookup_events(departures, events, movers);
+    sort_lookup_events(arrivals, events, movers);
+    for (int a = 0, d = 0, e = 0; e < num_events; e++) {
+        bool take_arrival = d == movers || (a < movers && arrivals[a].pos <= departures[d].pos);
+        events[e] = take_arrival ? arrivals[a++] : departures[d++];
+    }
 
-            
+    // Events in position order are in cell order too. cell_start[c] gains the arrivals
+    // and loses the departures of the cells before c, so only the ranges between events
+    // with a nonzero balance change.
+    uint last_cell = (uint)num_cells - 1;
+    int shift = 0;
+    for (int e = 0; e < num_events; e++) {
+        shift += events[e].arrival ? 1 : -1;
+        events[e].shift = shift;
+        uint key = events[e].entry.cell_key;
+        if (key >= last_cell) continue;
+        uint next = e + 1 < num_events ? events[e + 1].entry.cell_key : last_cell;
+        if (next > last_cell) next = last_cell;
+        for (uint c = key + 1; shift != 0 && c <= next; c++) {
+            particles->cell_start[c] += shift;
         }
     }
+    particles->cell_start[num_cells] = n;
+
+    // Every run of unchanged entries lands shifted by the balance of the events before it
+    Entry* patched = particles->sort_buffer;
+    #pragma omp parallel for schedule(dynamic, 64)
+    for (int e = -1; e < num_events; e++) {
+        int from = 0;
+        int offset = 0;
+        if (e >= 0) {
+            from = events[e].arrival ? events[e].pos : events[e].pos + 1;
+            offset = events[e].shift;
+            if (events[e].arrival) patched[events[e].pos + offset - 1] = events[e].entry;
+        }
+        int to = e + 1 < num_events ? events[e + 1].pos : n;
+        memcpy(patched + from + offset, lookup + from, (to - from) * sizeof(Entry));
+    }
+    particles->sort_buffer = particles->spatial_lookup;
+    particles->spatial_lookup = patched;
+    PROFILE_END(SORT);
+    return true;
 }
 
+int compare_entries(const void* a, const void* b) {
+    const Entry* ea = a;
+    const Entry* eb = b;
+    if (ea->cell_key != eb->cell_key) return ea->cell_key < eb->cell_key ? -1 : 1;
+    return ea->idx - eb->idx;
+}
+
+// Indices of the particles stored in the 3x3 cells around (x, y), selected needs room
+// for num_particles entries. Returns how many were written.
+int gather_cell_neighbors(Particles* particles, real_t x, real_t y, int* selected) {
+    int spans[MAX_NEIGHBOR_SPANS][2];
+    int num_spans = neighbor_spans(particles, x, y, spans);
+    int count = 0;
+
+    for (int s = 0; s < num_spans; s++) {
+        for (int k = spans[s][0]; k < spans[s][1]; k++) {
+            selected[count++] = particles->spatial_lookup[k].idx;
+        }
+    }
+    return count;
+}
+
+void for_each_point_within_radius(Particles* particles, real_t sample_point[2], real_t pressure_force[2], int idx){
+    int spans[MAX_NEIGHBOR_SPANS][2];
+    int num_spans = neighbor_spans(particles, sample_point[0], sample_point[1], spans);
+
+    for(int s = 0; s < num_spans; s++){
+        pressure_span(particles, &particles->spatial_lookup[spans[s][0]].idx, ENTRY_STRIDE, spans[s][1] - spans[s][0], idx, sample_point[0], sample_point[1], particles->density[idx], pressure_force);
+    }
+}
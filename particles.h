@@ -4,9 +4,12 @@
 #define PARTICLES_H
 
 #include <stdlib.h>
-#include <SDL2/SDL.h>
+#include <stdbool.h>
 #include <omp.h>
 #include <limits.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
 
 #define WIN_WIDTH 2000
 #define WIN_HEIGHT 1300
@@ -21,61 +24,216 @@
 #define P_MULT 0.5
 #define NUM_PARTICLES 4000
 
+// Digit width of the parallel radix sort used by update_spatial_lookup (8, 11 or 16 bits)
+#ifndef RADIX_BITS
+#define RADIX_BITS 11
+#endif
+#if RADIX_BITS != 8 && RADIX_BITS != 11 && RADIX_BITS != 16
+#error "RADIX_BITS must be 8, 11 or 16"
+#endif
+#define RADIX_BUCKETS (1 << RADIX_BITS)
+
+// The spatial lookup is a dense grid over the bounded domain by default; build with
+// -DSPATIAL_HASH for the hashed table folded modulo the particle capacity
+#ifdef SPATIAL_HASH
+#define MAX_NEIGHBOR_SPANS 9
+#else
+#define MAX_NEIGHBOR_SPANS 3
+#endif
+
+// Incremental lookup updates fall back to a full rebuild when more than this fraction of
+// the particles changed cell since the previous update
+#define LOOKUP_REBUILD_FRACTION 0.1
+
+// Extra radius of the Verlet neighbor lists, 0 searches the grid every step instead
+#define NEIGHBOR_SKIN 0
+
+// Number of fixed particle chunks of the pair-once force mode. Each has its own
+// accumulation buffer, so results do not depend on the thread count; more chunks balance
+// more threads but need more buffer memory when neighbors are far apart in memory.
+#ifndef PAIR_CHUNKS
+#define PAIR_CHUNKS 8
+#endif
+
+// Interaction terms of the fused force sweep, combined as a compile-time bitmask
+#define TERM_PRESSURE 1
+#define TERM_VISCOSITY 2
+
+// Strength of the viscosity term, 0 leaves it out of the force sweep
+#define VISCOSITY_STRENGTH 0
+
+// Steps between reorderings of the particle arrays into Morton order of their grid cells,
+// 0 keeps the order particles were created in
+#define REORDER_INTERVAL 0
+
+// Floating point type of the particle state, build with -DUSE_FLOAT32 for single precision
+#ifdef USE_FLOAT32
+typedef float real_t;
+#define REAL_SQRT sqrtf
+#else
+typedef double real_t;
+#define REAL_SQRT sqrt
+#endif
+
+#include "kernels.h"
+
 // Structure definitions
 
+// Accumulated pair accelerations of one chunk for the particles first .. first + size - 1.
+// Grows on demand up to the highest index the chunk reaches and is left zeroed between steps.
+typedef struct {
+    real_t* ax;
+    real_t* ay;
+    int first;
+    int size;
+    int reach;
+} PairChunk;
+
 typedef struct {
     int idx;
     uint cell_key;
 } Entry;
 
+// A particle leaving (arrival false) or entering the sorted lookup at position pos of
+// the previous lookup, with the net number of entries gained up to and including it
 typedef struct {
-    int index;
-    double position[2];
-    double velocity[2];
-    double acceleration[2];
-    double density;
-    int prev_cell[2];
-} Particle;
+    int pos;
+    int shift;
+    bool arrival;
+    Entry entry;
+} LookupEvent;
+
+// Axis-aligned rectangle where particles are emitted or removed
+typedef struct {
+    double min_x;
+    double min_y;
+    double max_x;
+    double max_y;
+} Region;
 
+// Particle state is stored as one contiguous array per component
 typedef struct {
-    Particle* particles;
-    int index;
+    real_t* x;
+    real_t* y;
+    real_t* vx;
+    real_t* vy;
+    real_t* density;
+    real_t* predicted_x;
+    real_t* predicted_y;
+    real_t* accel_x;
+    real_t* accel_y;
     int num_particles;
+    int capacity;
+    void* mapping;
+    size_t mapping_size;
+    struct TrajectoryWriter* trajectory;
+    // Static obstacles, NULL for an empty box
+    struct Obstacles* obstacles;
+    // Random draws are keyed by seed, the step counter and, for emits, the emit counter
+    uint64_t seed;
+    uint32_t step;
+    uint32_t emitted;
     double max_x;
     double max_y;
     double forces[2];
     double radius;
     double influence_radius;
     double collision_loss;
+    double target_density;
+    double pressure_multiplier;
+    double viscosity;
+    SmoothingConstants kernel;
+    // Reordering moves particles between slots. ids[slot] is the index the particle would
+    // have without reordering and slots[id] the inverse, both NULL until the first reorder.
+    int reorder_interval;
+    int* ids;
+    int* slots;
     Entry* spatial_lookup;
-    int* start_indices;
+    uint* prev_cell;
+    bool lookup_valid;
+    bool incremental_lookup;
+    double rebuild_fraction;
+    int last_lookup_movers;
+    LookupEvent* lookup_events;
+    int lookup_event_capacity;
+    int* cell_start;
+    int num_cells;
+    int grid_cols;
+    int grid_rows;
+    double cell_size;
+    int* grid_histograms;
+    double neighbor_skin;
+    bool neighbor_lists_valid;
+    int neighbor_list_size;
+    int* neighbor_offsets;
+    int* neighbor_indices;
+    long neighbor_capacity;
+    real_t* neighbor_ref_x;
+    real_t* neighbor_ref_y;
+    int neighbor_list_builds;
+    Entry* sort_buffer;
+    int* sort_histograms;
+    int sort_threads;
+    // Pair-once force mode: every pair is evaluated once and applied to both particles,
+    // accumulated per chunk of the particles and summed in chunk order
+    bool pair_forces;
+    PairChunk pair_chunks[PAIR_CHUNKS];
 } Particles;
 
 
 // Function prototypes
 void init_particles(Particles* particles, int num_particles, double max_x, double max_y, double forces[2], double radius, double collision_loss, double influence_radius);
+void free_particles(Particles* particles);
 void add_particle(Particles* particles, double max_x, double max_y);
+void reserve_particles(Particles* particles, int count);
+void emit_particles(Particles* particles, int count, Region region);
+int remove_particles(Particles* particles, Region region);
+bool region_contains(Region region, real_t x, real_t y);
 void update_particles(Particles* particles, double dt, int frames);
-double calculate_density(Particles* particles, double p[2]);
-double smoothing_kernel(double r, double dst);
-double smoothing_kernel_gradient(double dst, double r);
-double convert_density_to_pressure(double density);
-double calculate_all_densities(Particles* particles, double** densities);
-void draw_densities(SDL_Renderer* renderer, double** densities, double max_density);
-void calculateColor(double pressure, double minmax[2], int *red, int *green, int *blue);
-void calculate_all_pressures(Particles* particles, double** pressures, double minmax[2]);
-void calculate_pressure_force(Particles* particles, int idx, double pressure_force[2]);
-double calculate_shared_pressure(double d_a, double d_b);
-void handle_wall_collisions(Particles* particles, Particle* p);
-void getRandomDir(double dir[2]);
+void predict_positions(Particles* particles, double dt, int count);
+void refresh_neighbors(Particles* particles);
+void compute_densities(Particles* particles, int count);
+void compute_accelerations(Particles* particles, int count);
+void compute_pair_accelerations(Particles* particles, int count);
+void integrate_particles(Particles* particles, double dt, int count);
+real_t calculate_density(Particles* particles, real_t px, real_t py);
+real_t calculate_particle_density(Particles* particles, int idx);
+real_t calculate_density_reference(Particles* particles, real_t px, real_t py);
+real_t smoothing_kernel(real_t r, real_t dst);
+real_t smoothing_kernel_gradient(real_t dst, real_t r);
+real_t viscosity_kernel(real_t r, real_t dst);
+void init_smoothing_constants(SmoothingConstants* constants, double h);
+real_t convert_density_to_pressure(const Particles* particles, real_t density);
+void calculate_pressure_force(Particles* particles, int idx, real_t pressure_force[2]);
+void calculate_acceleration(Particles* particles, int idx, real_t acceleration[2]);
+void swap_predicted_positions(Particles* particles);
+real_t calculate_shared_pressure(const Particles* particles, real_t d_a, real_t d_b);
+void handle_wall_collisions(Particles* particles, int idx);
+void reorder_particles(Particles* particles);
+int particle_slot(const Particles* particles, int id);
+void gather_by_id(const Particles* particles, const real_t* values, real_t* out);
+void getRandomDir(const Particles* particles, int i, int j, real_t dir[2]);
+void init_spatial_grid(Particles* particles);
 void update_spatial_lookup(Particles* particles);
+void build_dense_grid(Particles* particles);
+void build_hashed_lookup(Particles* particles);
+bool patch_spatial_lookup(Particles* particles);
+void fill_cell_start(Particles* particles);
+int compare_entries(const void* a, const void* b);
 int getMax(Particles* particles, int n);
 void countSort(Particles* particles, int n, int exp);
 void radixsort(Particles* particles);
-void position_to_cell_coord(double position[2], int cell[2], double influence_radius);
+void parallel_radixsort(Particles* particles);
+void position_to_cell_coord(real_t x, real_t y, int cell[2], real_t influence_radius);
 uint hash_cell(int x, int y);
+uint morton_key(int x, int y);
 uint get_key_from_hash(uint hash, int n);
-void for_each_point_within_radius(Particles* particles, double sample_point[2], double pressure_force[2], int idx);
+uint get_cell_key(Particles* particles, int cx, int cy);
+uint position_to_cell_key(Particles* particles, real_t x, real_t y);
+int cell_neighbor_spans(Particles* particles, int cx, int cy, int spans[MAX_NEIGHBOR_SPANS][2]);
+int neighbor_spans(Particles* particles, real_t x, real_t y, int spans[MAX_NEIGHBOR_SPANS][2]);
+int gather_cell_neighbors(Particles* particles, real_t x, real_t y, int* selected);
+void for_each_point_within_radius(Particles* particles, real_t sample_point[2], real_t pressure_force[2], int idx);
 bool check_sorted(Particles* particles);
 
 #endif /* PARTICLES_H */
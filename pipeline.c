@@ -0,0 +1,223 @@
+#include "pipeline.h"
+#include "checkpoint.h"
+#include <stdio.h>
+#include <time.h>
+
+void reserve_render_frame(RenderFrame* frame, int count) {
+    if (count <= frame->capacity) return;
+    real_t** arrays[5] = {&frame->view.x, &frame->view.y, &frame->view.vx, &frame->view.vy, &frame->view.density};
+    for (int k = 0; k < 5; k++) {
+        free(*arrays[k]);
+        *arrays[k] = malloc(count * sizeof(real_t));
+        if (*arrays[k] == NULL) {
+            perror("Memory allocation failed for a render frame.");
+            exit(EXIT_FAILURE);
+        }
+    }
+    free(frame->selected);
+    frame->selected = malloc(count * sizeof(int));
+    if (frame->selected == NULL) {
+        perror("Memory allocation failed for a render frame.");
+        exit(EXIT_FAILURE);
+    }
+    frame->capacity = count;
+}
+
+void free_render_frame(RenderFrame* frame) {
+    free(frame->view.x);
+    free(frame->view.y);
+    free(frame->view.vx);
+    free(frame->view.vy);
+    free(frame->view.density);
+    free(frame->selected);
+    free_field(&frame->field);
+}
+
+// Copies the solver state into the back buffer and swaps it with the latest one. Field
+// overlays and highlights need the spatial lookup, so they are evaluated here on the
+// solver thread rather than on the render thread.
+void publish_render_frame(Pipeline* pipeline, int step) {
+    Particles* particles = pipeline->particles;
+    RenderFrame* frame = &pipeline->frames[pipeline->back];
+    int n = particles->num_particles;
+
+    reserve_render_frame(frame, n);
+    memcpy(frame->view.x, particles->x, n * sizeof(real_t));
+    memcpy(frame->view.y, particles->y, n * sizeof(real_t));
+    memcpy(frame->view.vx, particles->vx, n * sizeof(real_t));
+    memcpy(frame->view.vy, particles->vy, n * sizeof(real_t));
+    memcpy(frame->view.density, particles->density, n * sizeof(real_t));
+    frame->view.num_particles = n;
+    frame->view.target_density = particles->target_density;
+    frame->step = step;
+
+    frame->overlay = pipeline->overlay;
+    frame->num_selected = 0;
+    if (pipeline->overlay != PIPELINE_NO_OVERLAY || pipeline->highlight) {
+        update_spatial_lookup(particles);
+    }
+    if (pipeline->overlay != PIPELINE_NO_OVERLAY) {
+        int width = (int)particles->max_x;
+        int height = (int)particles->max_y;
+        if (frame->field.width != width || frame->field.height != height) {
+            // A loaded checkpoint can change the domain; each frame catches up when it is the back buffer
+            free_field(&frame->field);
+            init_field(&frame->field, (FieldKind)pipeline->overlay, width, height, pipeline->resolution);
+        }
+        frame->field.kind = (FieldKind)pipeline->overlay;
+        if (frame->field.resolution != pipeline->resolution) {
+            set_field_resolution(&frame->field, pipeline->resolution);
+        }
+        sample_field(particles, &frame->field);
+    }
+    if (pipeline->highlight) {
+        frame->num_selected = gather_cell_neighbors(particles, (real_t)pipeline->highlight_point[0], (real_t)pipeline->highlight_point[1], frame->selected);
+    }
+
+    pipeline->back = atomic_exchange(&pipeline->latest, pipeline->back | PIPELINE_FRESH) & (PIPELINE_FRESH - 1);
+}
+
+void apply_pipeline_command(Pipeline* pipeline, PipelineCommand command) {
+    Particles* particles = pipeline->particles;
+    switch (command.type) {
+    case PIPELINE_RESET: {
+        double forces[2] = {particles->forces[0], particles->forces[1]};
+        double max_x = particles->max_x;
+        double max_y = particles->max_y;
+        double radius = particles->radius;
+        double collision_loss = particles->collision_loss;
+        double influence_radius = particles->influence_radius;
+        free_particles(particles);
+        init_particles(particles, NUM_PARTICLES, max_x, max_y, forces, radius, collision_loss, influence_radius);
+        break;
+    }
+    case PIPELINE_PAUSE:
+        pipeline->paused = !pipeline->paused;
+        break;
+    case PIPELINE_OVERLAY:
+        pipeline->overlay = command.value;
+        if (command.value != PIPELINE_NO_OVERLAY) {
+            // Sampled once here for the statistics, the frames sample their own copy
+            Field field;
+            init_field(&field, (FieldKind)command.value, (int)particles->max_x, (int)particles->max_y, pipeline->resolution);
+            update_spatial_lookup(particles);
+            sample_field(particles, &field);
+            const char* name = command.value == FIELD_DENSITY ? "Density" : "Pressure";
+            printf("Mean %s: %lf\n", name, field.mean);
+            printf("Min %s: %lf\n", name, field.min);
+            printf("Max %s: %lf\n", name, field.max);
+            free_field(&field);
+        }
+        break;
+    case PIPELINE_RESOLUTION:
+        pipeline->resolution = command.value;
+        break;
+    case PIPELINE_PROBE:
+        update_spatial_lookup(particles);
+        printf("Density at (%f, %f): %lf\n", command.x, command.y, (double)calculate_density(particles, (real_t)command.x, (real_t)command.y));
+        break;
+    case PIPELINE_HIGHLIGHT:
+        pipeline->highlight = command.value;
+        pipeline->highlight_point[0] = command.x;
+        pipeline->highlight_point[1] = command.y;
+        break;
+    case PIPELINE_SAVE:
+        if (save_checkpoint(particles, CHECKPOINT_FILE)) {
+            printf("Saved %d particles to %s\n", particles->num_particles, CHECKPOINT_FILE);
+        }
+        break;
+    case PIPELINE_LOAD: {
+        Particles loaded;
+        if (load_checkpoint(&loaded, CHECKPOINT_FILE)) {
+            free_particles(particles);
+            *particles = loaded;
+            printf("Loaded %d particles from %s\n", particles->num_particles, CHECKPOINT_FILE);
+        }
+        break;
+    }
+    }
+}
+
+void* pipeline_solver_main(void* arg) {
+    Pipeline* pipeline = arg;
+    int step = 0;
+    bool dirty = true;
+
+    while (!atomic_load(&pipeline->stopping)) {
+        int tail = atomic_load(&pipeline->command_tail);
+        while (tail != atomic_load(&pipeline->command_head)) {
+            apply_pipeline_command(pipeline, pipeline->commands[tail % PIPELINE_COMMANDS]);
+            atomic_store(&pipeline->command_tail, ++tail);
+            dirty = true;
+        }
+
+        if (!pipeline->paused) {
+            update_particles(pipeline->particles, 1, step++);
+            atomic_fetch_add(&pipeline->steps, 1);
+            dirty = true;
+        }
+        if (dirty) {
+            publish_render_frame(pipeline, step);
+            dirty = false;
+        } else {
+            struct timespec idle = {0, 1000000};
+            nanosleep(&idle, NULL);
+        }
+    }
+    return NULL;
+}
+
+// Starts the solver thread on particles, which belong to it until stop_pipeline returns
+bool start_pipeline(Pipeline* pipeline, Particles* particles, bool paused) {
+    memset(pipeline, 0, sizeof(*pipeline));
+    pipeline->particles = particles;
+    pipeline->paused = paused;
+    pipeline->overlay = PIPELINE_NO_OVERLAY;
+    pipeline->resolution = FIELD_RESOLUTION;
+    for (int k = 0; k < PIPELINE_FRAMES; k++) {
+        init_field(&pipeline->frames[k].field, FIELD_DENSITY, (int)particles->max_x, (int)particles->max_y, FIELD_RESOLUTION);
+        pipeline->frames[k].overlay = PIPELINE_NO_OVERLAY;
+    }
+    // Buffer 0 starts as the latest, published but empty, 1 is the back and 2 the front
+    atomic_init(&pipeline->latest, 0);
+    pipeline->back = 1;
+    pipeline->front = 2;
+    atomic_init(&pipeline->stopping, false);
+    atomic_init(&pipeline->command_head, 0);
+    atomic_init(&pipeline->command_tail, 0);
+    atomic_init(&pipeline->steps, 0);
+
+    if (pthread_create(&pipeline->thread, NULL, pipeline_solver_main, pipeline) != 0) {
+        perror("Could not start the solver thread");
+        return false;
+    }
+    return true;
+}
+
+void stop_pipeline(Pipeline* pipeline) {
+    atomic_store(&pipeline->stopping, true);
+    pthread_join(pipeline->thread, NULL);
+    for (int k = 0; k < PIPELINE_FRAMES; k++) {
+        free_render_frame(&pipeline->frames[k]);
+    }
+}
+
+// Queues a command for the solver thread, called from the render thread only. Returns
+// false if the ring is full.
+bool send_pipeline_command(Pipeline* pipeline, PipelineCommand command) {
+    int head = atomic_load(&pipeline->command_head);
+    if (head - atomic_load(&pipeline->command_tail) == PIPELINE_COMMANDS) return false;
+    pipeline->commands[head % PIPELINE_COMMANDS] = command;
+    atomic_store(&pipeline->command_head, head + 1);
+    return true;
+}
+
+// Newest published frame, swapped in if the solver published since the last call. fresh
+// tells whether it changed. The frame stays valid until the next call.
+RenderFrame* acquire_render_frame(Pipeline* pipeline, bool* fresh) {
+    *fresh = atomic_load(&pipeline->latest) & PIPELINE_FRESH;
+    if (*fresh) {
+        pipeline->front = atomic_exchange(&pipeline->latest, pipeline->front) & (PIPELINE_FRESH - 1);
+    }
+    return &pipeline->frames[pipeline->front];
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include "particles.h"
+#include "field.h"
+
+// Pipelined mode: a solver thread steps the particles as fast as it can and publishes a
+// copy of every step into a triple buffer, while the render thread draws the newest
+// published copy. Publishing and acquiring are a single atomic exchange each, so neither
+// thread ever waits for the other. Requests from the render thread (pause, reset,
+// overlays, probes) travel the other way through a single-producer command ring.
+#define PIPELINE_FRAMES 3
+#define PIPELINE_FRESH 4
+#define PIPELINE_COMMANDS 64
+#define PIPELINE_NO_OVERLAY -1
+
+typedef enum {
+    PIPELINE_RESET,
+    PIPELINE_PAUSE,
+    PIPELINE_OVERLAY,
+    PIPELINE_RESOLUTION,
+    PIPELINE_PROBE,
+    PIPELINE_HIGHLIGHT,
+    PIPELINE_SAVE,
+    PIPELINE_LOAD
+} PipelineCommandType;
+
+typedef struct {
+    PipelineCommandType type;
+    int value;
+    double x;
+    double y;
+} PipelineCommand;
+
+// One published step. view only carries the particle state arrays and count, which is
+// all the particle drawing reads.
+typedef struct {
+    Particles view;
+    int capacity;
+    int step;
+    int overlay;
+    Field field;
+    int* selected;
+    int num_selected;
+} RenderFrame;
+
+typedef struct {
+    Particles* particles;
+    pthread_t thread;
+    atomic_bool stopping;
+    atomic_int latest;
+    RenderFrame frames[PIPELINE_FRAMES];
+    int back;
+    int front;
+    PipelineCommand commands[PIPELINE_COMMANDS];
+    atomic_int command_head;
+    atomic_int command_tail;
+    atomic_int steps;
+    // Solver thread state
+    bool paused;
+    int overlay;
+    int resolution;
+    bool highlight;
+    double highlight_point[2];
+} Pipeline;
+
+// Function prototypes
+bool start_pipeline(Pipeline* pipeline, Particles* particles, bool paused);
+void stop_pipeline(Pipeline* pipeline);
+bool send_pipeline_command(Pipeline* pipeline, PipelineCommand command);
+RenderFrame* acquire_render_frame(Pipeline* pipeline, bool* fresh);
+
+#endif /* PIPELINE_H */
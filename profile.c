@@ -0,0 +1,199 @@
+#include "profile.h"
+
+#ifdef FLUID_PROFILE
+
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+// Set on the phase of trace events that are a thread's share of a parallel phase
+#define PROFILE_WORK_FLAG 0x8000
+
+Profiler profiler;
+// Small dense id per OS thread, used as the trace lane and the busy time slot
+static _Thread_local int profile_thread = -1;
+
+const char* profile_phase_names[PROFILE_PHASES] = {
+    "step", "predict", "lookup", "sort", "neighbor_lists", "density", "forces", "integrate", "reorder", "field", "render"
+};
+
+uint64_t profile_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+int profile_thread_id(void) {
+    if (profile_thread < 0) {
+        profile_thread = __atomic_fetch_add(&profiler.num_threads, 1, __ATOMIC_RELAXED);
+    }
+    return profile_thread < PROFILE_MAX_THREADS ? profile_thread : PROFILE_MAX_THREADS - 1;
+}
+
+int profile_bucket(uint64_t ns) {
+    int bucket = ns > 0 ? 63 - __builtin_clzll(ns) : 0;
+    return bucket < PROFILE_BUCKETS ? bucket : PROFILE_BUCKETS - 1;
+}
+
+// Ensemble members time the same phases from several threads at once, hence the atomics
+void add_to_histogram(ProfileHistogram* histogram, uint64_t ns, int bucket) {
+    __atomic_fetch_add(&histogram->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->total_ns, ns, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->buckets[bucket], 1, __ATOMIC_RELAXED);
+    uint64_t seen = __atomic_load_n(&histogram->max_ns, __ATOMIC_RELAXED);
+    while (ns > seen && !__atomic_compare_exchange_n(&histogram->max_ns, &seen, ns, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    seen = __atomic_load_n(&histogram->min_ns, __ATOMIC_RELAXED);
+    while ((seen == 0 || ns < seen) && !__atomic_compare_exchange_n(&histogram->min_ns, &seen, ns, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+void add_trace_event(ProfilePhase phase, uint64_t start_ns, uint64_t ns, int thread) {
+    uint64_t slot = __atomic_fetch_add(&profiler.num_events, 1, __ATOMIC_RELAXED) % PROFILE_TRACE_EVENTS;
+    profiler.events[slot] = (ProfileEvent) { start_ns, ns > UINT32_MAX ? UINT32_MAX : (uint32_t)ns, (uint16_t)phase, (uint16_t)thread };
+}
+
+void profile_record(ProfilePhase phase, uint64_t start_ns, uint64_t end_ns) {
+    uint64_t ns = end_ns - start_ns;
+    int bucket = profile_bucket(ns);
+    add_to_histogram(&profiler.total[phase], ns, bucket);
+    add_to_histogram(&profiler.window[phase], ns, bucket);
+    add_trace_event(phase, start_ns, ns, profile_thread_id());
+}
+
+// One thread's share of a parallel phase. Each thread only writes its own slots.
+void profile_record_work(ProfilePhase phase, uint64_t start_ns, uint64_t end_ns) {
+    int thread = profile_thread_id();
+    uint64_t ns = end_ns - start_ns;
+    profiler.busy_ns[phase][thread] += ns;
+    profiler.window_busy_ns[phase][thread] += ns;
+    add_trace_event(phase | PROFILE_WORK_FLAG, start_ns, ns, thread);
+}
+
+// q-quantile, interpolated linearly inside the bucket that holds it and clamped to the
+// observed range
+double histogram_quantile_us(const ProfileHistogram* histogram, double q) {
+    double target = q * histogram->count;
+    uint64_t seen = 0;
+    for (int k = 0; k < PROFILE_BUCKETS; k++) {
+        uint64_t in_bucket = histogram->buckets[k];
+        if (in_bucket > 0 && seen + in_bucket >= target) {
+            double low = k > 0 ? ldexp(1.0, k) : 0;
+            double ns = low + (ldexp(1.0, k + 1) - low) * (target - seen) / in_bucket;
+            return fmax(fmin(ns, (double)histogram->max_ns), (double)histogram->min_ns) / 1000;
+        }
+        seen += in_bucket;
+    }
+    return histogram->max_ns / 1000.0;
+}
+
+// Busiest thread over the mean of the threads that worked on the phase, 1 is perfect
+double busy_imbalance(const uint64_t* busy_ns, int num_threads) {
+    uint64_t total = 0, max = 0;
+    int workers = 0;
+    for (int t = 0; t < num_threads; t++) {
+        if (busy_ns[t] == 0) continue;
+        total += busy_ns[t];
+        if (busy_ns[t] > max) max = busy_ns[t];
+        workers++;
+    }
+    return total > 0 ? (double)max * workers / total : 0;
+}
+
+// Prints the phases timed since the last report and starts a new window
+void profile_report(FILE* stream) {
+    uint64_t now = profile_now();
+    int num_threads = profiler.num_threads < PROFILE_MAX_THREADS ? profiler.num_threads : PROFILE_MAX_THREADS;
+    uint64_t step_ns = profiler.window[PROFILE_STEP].total_ns;
+    if (profiler.window_start_ns != 0) {
+        fprintf(stream, "Profile over the last %.2f s:\n", (now - profiler.window_start_ns) / 1e9);
+    }
+    fprintf(stream, "  %-15s %8s %10s %10s %10s %10s %7s %9s\n", "phase", "calls", "mean us", "p50 us", "p99 us", "max us", "step %", "imbalance");
+    for (int p = 0; p < PROFILE_PHASES; p++) {
+        ProfileHistogram* histogram = &profiler.window[p];
+        if (histogram->count == 0) continue;
+        double imbalance = busy_imbalance(profiler.window_busy_ns[p], num_threads);
+        fprintf(stream, "  %-15s %8llu %10.1f %10.1f %10.1f %10.1f %7.1f ", profile_phase_names[p], (unsigned long long)histogram->count,
+                histogram->total_ns / 1000.0 / histogram->count, histogram_quantile_us(histogram, 0.5), histogram_quantile_us(histogram, 0.99),
+                histogram->max_ns / 1000.0, step_ns > 0 ? 100.0 * histogram->total_ns / step_ns : 0);
+        if (imbalance > 0) fprintf(stream, "%9.2f\n", imbalance);
+        else fprintf(stream, "%9s\n", "-");
+    }
+
+    memset(profiler.window, 0, sizeof(profiler.window));
+    memset(profiler.window_busy_ns, 0, sizeof(profiler.window_busy_ns));
+    profiler.window_start_ns = now;
+}
+
+// One row per phase with its cumulative histogram, then one per thread and parallel phase
+// with the busy and idle time
+bool profile_write_csv(const char* path) {
+    FILE* file = fopen(path, "w");
+    if (file == NULL) {
+        perror("Could not open the profile file");
+        return false;
+    }
+    int num_threads = profiler.num_threads < PROFILE_MAX_THREADS ? profiler.num_threads : PROFILE_MAX_THREADS;
+
+    fprintf(file, "phase,thread,count,total_ms,mean_us,min_us,max_us,p50_us,p99_us,busy_ms,idle_ms");
+    for (int k = 0; k < PROFILE_BUCKETS; k++) {
+        fprintf(file, ",lt_%.0fns", ldexp(1.0, k + 1));
+    }
+    fprintf(file, "\n");
+
+    for (int p = 0; p < PROFILE_PHASES; p++) {
+        const ProfileHistogram* histogram = &profiler.total[p];
+        if (histogram->count == 0) continue;
+        fprintf(file, "%s,all,%llu,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,,", profile_phase_names[p], (unsigned long long)histogram->count,
+                histogram->total_ns / 1e6, histogram->total_ns / 1000.0 / histogram->count, histogram->min_ns / 1000.0,
+                histogram->max_ns / 1000.0, histogram_quantile_us(histogram, 0.5), histogram_quantile_us(histogram, 0.99));
+        for (int k = 0; k < PROFILE_BUCKETS; k++) {
+            fprintf(file, ",%llu", (unsigned long long)histogram->buckets[k]);
+        }
+        fprintf(file, "\n");
+    }
+    for (int p = 0; p < PROFILE_PHASES; p++) {
+        for (int t = 0; t < num_threads; t++) {
+            uint64_t busy = profiler.busy_ns[p][t];
+            if (busy == 0) continue;
+            uint64_t phase_ns = profiler.total[p].total_ns;
+            double idle = phase_ns > busy ? (phase_ns - busy) / 1e6 : 0;
+            fprintf(file, "%s,%d,,,,,,,,%.3f,%.3f", profile_phase_names[p], t, busy / 1e6, idle);
+            for (int k = 0; k < PROFILE_BUCKETS; k++) fprintf(file, ",");
+            fprintf(file, "\n");
+        }
+    }
+
+    fclose(file);
+    return true;
+}
+
+// Chrome trace-event JSON of the spans still in the ring, one lane per thread. Load it in
+// chrome://tracing or Perfetto.
+bool profile_write_trace(const char* path) {
+    FILE* file = fopen(path, "w");
+    if (file == NULL) {
+        perror("Could not open the trace file");
+        return false;
+    }
+    uint64_t end = profiler.num_events;
+    uint64_t begin = end > PROFILE_TRACE_EVENTS ? end - PROFILE_TRACE_EVENTS : 0;
+    uint64_t origin = UINT64_MAX;
+    for (uint64_t k = begin; k < end; k++) {
+        uint64_t start_ns = profiler.events[k % PROFILE_TRACE_EVENTS].start_ns;
+        if (start_ns < origin) origin = start_ns;
+    }
+
+    fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    for (uint64_t k = begin; k < end; k++) {
+        const ProfileEvent* event = &profiler.events[k % PROFILE_TRACE_EVENTS];
+        bool work = event->phase & PROFILE_WORK_FLAG;
+        fprintf(file, "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":0,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}%s\n",
+                profile_phase_names[event->phase & ~PROFILE_WORK_FLAG], work ? "work" : "phase", event->thread,
+                (event->start_ns - origin) / 1000.0, event->duration_ns / 1000.0, k + 1 < end ? "," : "");
+    }
+    fprintf(file, "]}\n");
+
+    fclose(file);
+    return true;
+}
+
+#endif /* FLUID_PROFILE */
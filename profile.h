@@ -0,0 +1,95 @@
+#pragma once
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Built-in phase timing, compiled in with -DFLUID_PROFILE and to nothing otherwise.
+//
+// PROFILE_BEGIN/PROFILE_END time one phase on the thread that runs it. Inside an OpenMP
+// region, PROFILE_WORK_BEGIN/PROFILE_WORK_END around a thread's share of the loop record
+// its busy time; whatever is left of the enclosing phase is that thread's idle time.
+// Durations go to log2 histograms, kept both since the start and since the last report,
+// and the most recent spans to a ring that exports as a Chrome trace.
+typedef enum {
+    PROFILE_STEP,
+    PROFILE_PREDICT,
+    PROFILE_LOOKUP,
+    PROFILE_SORT,
+    PROFILE_NEIGHBOR_LISTS,
+    PROFILE_DENSITY,
+    PROFILE_FORCES,
+    PROFILE_INTEGRATE,
+    PROFILE_REORDER,
+    PROFILE_FIELD,
+    PROFILE_RENDER,
+    PROFILE_PHASES
+} ProfilePhase;
+
+// Where the viewer exports on exit
+#define PROFILE_CSV_FILE "fluid_profile.csv"
+#define PROFILE_TRACE_FILE "fluid_trace.json"
+
+#ifdef FLUID_PROFILE
+
+// Bucket k counts durations in [2^k, 2^(k+1)) ns
+#define PROFILE_BUCKETS 40
+#define PROFILE_MAX_THREADS 256
+#define PROFILE_TRACE_EVENTS (1 << 16)
+
+typedef struct {
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t min_ns;
+    uint64_t max_ns;
+    uint64_t buckets[PROFILE_BUCKETS];
+} ProfileHistogram;
+
+typedef struct {
+    uint64_t start_ns;
+    uint32_t duration_ns;
+    uint16_t phase;
+    uint16_t thread;
+} ProfileEvent;
+
+typedef struct {
+    ProfileHistogram total[PROFILE_PHASES];
+    ProfileHistogram window[PROFILE_PHASES];
+    uint64_t busy_ns[PROFILE_PHASES][PROFILE_MAX_THREADS];
+    uint64_t window_busy_ns[PROFILE_PHASES][PROFILE_MAX_THREADS];
+    uint64_t window_start_ns;
+    ProfileEvent events[PROFILE_TRACE_EVENTS];
+    uint64_t num_events;
+    int num_threads;
+} Profiler;
+
+// Function prototypes
+uint64_t profile_now(void);
+void profile_record(ProfilePhase phase, uint64_t start_ns, uint64_t end_ns);
+void profile_record_work(ProfilePhase phase, uint64_t start_ns, uint64_t end_ns);
+void profile_report(FILE* stream);
+bool profile_write_csv(const char* path);
+bool profile_write_trace(const char* path);
+
+#define PROFILE_BEGIN(phase) uint64_t profile_start_##phase = profile_now()
+#define PROFILE_END(phase) profile_record(PROFILE_##phase, profile_start_##phase, profile_now())
+#define PROFILE_WORK_BEGIN(phase) uint64_t profile_work_##phase = profile_now()
+#define PROFILE_WORK_END(phase) profile_record_work(PROFILE_##phase, profile_work_##phase, profile_now())
+#define PROFILE_REPORT(stream) profile_report(stream)
+#define PROFILE_EXPORT(csv_path, trace_path) (profile_write_csv(csv_path) && profile_write_trace(trace_path))
+
+#else
+
+#define PROFILE_BEGIN(phase)
+#define PROFILE_END(phase)
+#define PROFILE_WORK_BEGIN(phase)
+#define PROFILE_WORK_END(phase)
+#define PROFILE_REPORT(stream)
+#define PROFILE_EXPORT(csv_path, trace_path) false
+
+#endif /* FLUID_PROFILE */
+
+#endif /* PROFILE_H */
@@ -0,0 +1,211 @@
+#include "render.h"
+#include <stdio.h>
+#include <math.h>
+
+// Uploads the field as a texture with one texel per sample and lets the renderer stretch
+// it over the window with linear filtering, which interpolates between samples
+void draw_field(SDL_Renderer* renderer, FieldTexture* view, const Field* field) {
+    if (view->texture == NULL || view->cols != field->cols || view->rows != field->rows) {
+        free_field_texture(view);
+        SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "linear");
+        view->texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, field->cols, field->rows);
+        view->pixels = malloc((size_t)field->cols * field->rows * sizeof(Uint32));
+        if (view->texture == NULL || view->pixels == NULL) {
+            printf("Field texture creation failed: %s\n", SDL_GetError());
+            free_field_texture(view);
+            return;
+        }
+        view->cols = field->cols;
+        view->rows = field->rows;
+    }
+
+    double minmax[2] = {field->min, field->max};
+    int count = field->cols * field->rows;
+    #pragma omp parallel for
+    for (int i = 0; i < count; i++) {
+        int r, g, b;
+        if (field->kind == FIELD_PRESSURE) {
+            calculateColor(field->values[i], minmax, &r, &g, &b);
+        } else {
+            r = g = b = field->max > 0 ? (int)(255 * field->values[i] / field->max) : 0;
+        }
+        view->pixels[i] = 0xFF000000u | (Uint32)r << 16 | (Uint32)g << 8 | (Uint32)b;
+    }
+
+    SDL_UpdateTexture(view->texture, NULL, view->pixels, field->cols * sizeof(Uint32));
+    int res = field->resolution;
+    SDL_Rect dst = {-res / 2, -res / 2, field->cols * res, field->rows * res};
+    SDL_RenderCopy(renderer, view->texture, NULL, &dst);
+}
+
+void free_field_texture(FieldTexture* view) {
+    if (view->texture != NULL) SDL_DestroyTexture(view->texture);
+    free(view->pixels);
+    view->texture = NULL;
+    view->pixels = NULL;
+    view->cols = view->rows = 0;
+}
+
+void calculateColor(double pressure, double minmax[2], int *red, int *green, int *blue) {
+    // Normalize the pressure value between 0 and 1
+    double normalizedPressure = (pressure - minmax[0]) / (minmax[1] - minmax[0]);
+    // Initialize RGB values
+    *red = 255;
+    *green = 255;
+    *blue = 255;
+    
+    // Interpolate between blue, white, and red based on pressure
+    if (normalizedPressure < 0.5) {
+        *red = (int)(255 * normalizedPressure * 2);
+        *green = (int)(255 * normalizedPressure * 2);
+        *blue = 255;
+    } else {
+        *red = 255;
+        *green = (int)((1-(normalizedPressure - 0.5) * 2) * 255);
+        *blue = (int)((1-(normalizedPressure - 0.5) * 2) * 255);
+    }
+}
+
+// Pre-renders a white disc of BALL_RADIUS that every particle quad samples from, so the
+// vertex color decides the particle color
+bool create_disc_texture(SDL_Renderer* renderer, ParticleBatch* batch) {
+    int radius = BALL_RADIUS;
+    int size = 2 * radius + 1;
+    Uint32* pixels = malloc(size * size * sizeof(Uint32));
+    if (pixels == NULL) return false;
+
+    for (int y = -radius; y <= radius; ++y) {
+        for (int x = -radius; x <= radius; ++x) {
+            pixels[(y + radius) * size + (x + radius)] = x*x + y*y <= radius*radius ? 0xFFFFFFFFu : 0x00FFFFFFu;
+        }
+    }
+
+    batch->disc = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STATIC, size, size);
+    if (batch->disc != NULL) {
+        SDL_UpdateTexture(batch->disc, NULL, pixels, size * sizeof(Uint32));
+        SDL_SetTextureBlendMode(batch->disc, SDL_BLENDMODE_BLEND);
+    }
+    free(pixels);
+    return batch->disc != NULL;
+}
+
+bool reserve_particle_batch(ParticleBatch* batch, int count) {
+    if (count <= batch->capacity) return true;
+    int capacity = batch->capacity > 0 ? batch->capacity : 1024;
+    while (capacity < count) capacity *= 2;
+
+    SDL_Vertex* vertices = realloc(batch->vertices, capacity * 4 * sizeof(SDL_Vertex));
+    if (vertices == NULL) return false;
+    batch->vertices = vertices;
+    int* indices = realloc(batch->indices, capacity * 6 * sizeof(int));
+    if (indices == NULL) return false;
+    batch->indices = indices;
+
+    // Two triangles per quad, the pattern never changes so it is written once
+    for (int i = batch->capacity; i < capacity; i++) {
+        int v = 4 * i;
+        int* idx = &batch->indices[6 * i];
+        idx[0] = v; idx[1] = v + 1; idx[2] = v + 2;
+        idx[3] = v + 2; idx[4] = v + 3; idx[5] = v;
+    }
+    batch->capacity = capacity;
+    return true;
+}
+
+SDL_Color particle_color(Particles* particles, int i, ParticleColoring coloring, SDL_Color solid, double max_speed) {
+    if (coloring == COLORING_SOLID) return solid;
+
+    double minmax[2] = {0, max_speed};
+    double value = 0;
+    if (coloring == COLORING_VELOCITY) {
+        value = sqrt(particles->vx[i] * particles->vx[i] + particles->vy[i] * particles->vy[i]);
+    } else {
+        value = particles->density[i];
+        minmax[1] = 2 * particles->target_density;
+    }
+    if (value > minmax[1]) value = minmax[1];
+
+    int r, g, b;
+    calculateColor(value, minmax, &r, &g, &b);
+    SDL_Color color = {(Uint8)r, (Uint8)g, (Uint8)b, SDL_ALPHA_OPAQUE};
+    return color;
+}
+
+// Draws the given particles (all of them when subset is NULL) as textured quads submitted
+// in a single SDL_RenderGeometry call. Falls back to one SDL_RenderCopy per particle on
+// SDL versions without RenderGeometry, which still avoids the per-pixel point calls.
+void draw_particle_batch(SDL_Renderer* renderer, ParticleBatch* batch, Particles* particles, const int* subset, int count, ParticleColoring coloring, SDL_Color solid) {
+    if (count <= 0) return;
+    if (batch->disc == NULL && !create_disc_texture(renderer, batch)) {
+        printf("Particle texture creation failed: %s\n", SDL_GetError());
+        return;
+    }
+    if (!reserve_particle_batch(batch, count)) {
+        printf("Memory allocation failed for the particle batch\n");
+        return;
+    }
+
+    double max_speed = 0;
+    if (coloring == COLORING_VELOCITY) {
+        #pragma omp parallel for reduction(max:max_speed)
+        for (int k = 0; k < count; k++) {
+            int i = subset ? subset[k] : k;
+            double speed = sqrt(particles->vx[i] * particles->vx[i] + particles->vy[i] * particles->vy[i]);
+            if (speed > max_speed) max_speed = speed;
+        }
+        if (max_speed == 0) max_speed = 1;
+    }
+
+    float half = BALL_RADIUS + 0.5f;
+    #pragma omp parallel for
+    for (int k = 0; k < count; k++) {
+        int i = subset ? subset[k] : k;
+        float cx = (float)(int)particles->x[i] + 0.5f;
+        float cy = (float)(int)particles->y[i] + 0.5f;
+        SDL_Color color = particle_color(particles, i, coloring, solid, max_speed);
+
+        SDL_Vertex* v = &batch->vertices[4 * k];
+        v[0].position.x = cx - half; v[0].position.y = cy - half; v[0].tex_coord.x = 0; v[0].tex_coord.y = 0;
+        v[1].position.x = cx + half; v[1].position.y = cy - half; v[1].tex_coord.x = 1; v[1].tex_coord.y = 0;
+        v[2].position.x = cx + half; v[2].position.y = cy + half; v[2].tex_coord.x = 1; v[2].tex_coord.y = 1;
+        v[3].position.x = cx - half; v[3].position.y = cy + half; v[3].tex_coord.x = 0; v[3].tex_coord.y = 1;
+        v[0].color = v[1].color = v[2].color = v[3].color = color;
+    }
+
+#if SDL_VERSION_ATLEAST(2, 0, 18)
+    SDL_RenderGeometry(renderer, batch->disc, batch->vertices, 4 * count, batch->indices, 6 * count);
+#else
+    for (int k = 0; k < count; k++) {
+        SDL_Vertex* v = &batch->vertices[4 * k];
+        SDL_Rect dst = {(int)v[0].position.x, (int)v[0].position.y, 2 * BALL_RADIUS + 1, 2 * BALL_RADIUS + 1};
+        SDL_SetTextureColorMod(batch->disc, v[0].color.r, v[0].color.g, v[0].color.b);
+        SDL_RenderCopy(renderer, batch->disc, NULL, &dst);
+    }
+#endif
+}
+
+void draw_particles(SDL_Renderer* renderer, ParticleBatch* batch, Particles* particles, ParticleColoring coloring) {
+    SDL_Color white = {255, 255, 255, SDL_ALPHA_OPAQUE};
+    draw_particle_batch(renderer, batch, particles, NULL, particles->num_particles, coloring, white);
+}
+
+void free_particle_batch(ParticleBatch* batch) {
+    if (batch->disc != NULL) SDL_DestroyTexture(batch->disc);
+    free(batch->vertices);
+    free(batch->indices);
+    batch->disc = NULL;
+    batch->vertices = NULL;
+    batch->indices = NULL;
+    batch->capacity = 0;
+}
+
+// Highlights the particles stored in the 3x3 cells around the sample point
+void paint_each_point_within_radius(SDL_Renderer* renderer, ParticleBatch* batch, Particles* particles, double sample_point[2]){
+    int* selected = malloc(particles->num_particles * sizeof(int));
+    if (selected == NULL) return;
+    int count = gather_cell_neighbors(particles, (real_t)sample_point[0], (real_t)sample_point[1], selected);
+
+    SDL_Color red = {255, 0, 0, SDL_ALPHA_OPAQUE};
+    draw_particle_batch(renderer, batch, particles, selected, count, COLORING_SOLID, red);
+    free(selected);
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#ifndef RENDER_H
+#define RENDER_H
+
+#include <SDL2/SDL.h>
+#include "particles.h"
+#include "field.h"
+
+// Streaming texture the field overlays are uploaded into, created on first use
+typedef struct {
+    SDL_Texture* texture;
+    Uint32* pixels;
+    int cols;
+    int rows;
+} FieldTexture;
+
+typedef enum {
+    COLORING_SOLID,
+    COLORING_VELOCITY,
+    COLORING_DENSITY,
+    COLORING_COUNT
+} ParticleColoring;
+
+// Particles are drawn as quads textured with one pre-rendered disc; the vertex and index
+// buffers are kept between frames and only grow
+typedef struct {
+    SDL_Texture* disc;
+    SDL_Vertex* vertices;
+    int* indices;
+    int capacity;
+} ParticleBatch;
+
+// Function prototypes
+void draw_field(SDL_Renderer* renderer, FieldTexture* view, const Field* field);
+void free_field_texture(FieldTexture* view);
+void calculateColor(double pressure, double minmax[2], int *red, int *green, int *blue);
+bool create_disc_texture(SDL_Renderer* renderer, ParticleBatch* batch);
+bool reserve_particle_batch(ParticleBatch* batch, int count);
+SDL_Color particle_color(Particles* particles, int i, ParticleColoring coloring, SDL_Color solid, double max_speed);
+void draw_particle_batch(SDL_Renderer* renderer, ParticleBatch* batch, Particles* particles, const int* subset, int count, ParticleColoring coloring, SDL_Color solid);
+void draw_particles(SDL_Renderer* renderer, ParticleBatch* batch, Particles* particles, ParticleColoring coloring);
+void free_particle_batch(ParticleBatch* batch);
+void paint_each_point_within_radius(SDL_Renderer* renderer, ParticleBatch* batch, Particles* particles, double sample_point[2]);
+
+#endif /* RENDER_H */
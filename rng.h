@@ -0,0 +1,54 @@
+#pragma once
+
+#ifndef RNG_H
+#define RNG_H
+
+#include <stdint.h>
+
+// Counter-based random numbers (Philox4x32-10). A draw is a pure function of the seed
+// and a counter built from the stream, step and particle index, so there is no shared
+// state to lock and every particle gets the same numbers whichever thread handles it.
+#define RANDOM_DEFAULT_SEED 1
+
+// Independent streams, so draws for different purposes never share a counter
+typedef enum {
+    RANDOM_INIT,
+    RANDOM_EMIT,
+    RANDOM_DIRECTION,
+    RANDOM_SCENARIO,
+    RANDOM_CLUSTERS
+} RandomStream;
+
+static inline uint32_t philox_mulhilo(uint32_t a, uint32_t b, uint32_t* hi) {
+    uint64_t product = (uint64_t)a * b;
+    *hi = (uint32_t)(product >> 32);
+    return (uint32_t)product;
+}
+
+// Four 32-bit words for counter (index, step, stream, extra) under seed
+static inline void random_block(uint64_t seed, RandomStream stream, uint32_t step, uint32_t index, uint32_t extra, uint32_t out[4]) {
+    uint32_t c0 = index, c1 = step, c2 = (uint32_t)stream, c3 = extra;
+    uint32_t k0 = (uint32_t)seed, k1 = (uint32_t)(seed >> 32);
+    for (int round = 0; round < 10; round++) {
+        uint32_t hi0, hi1;
+        uint32_t lo0 = philox_mulhilo(0xD2511F53u, c0, &hi0);
+        uint32_t lo1 = philox_mulhilo(0xCD9E8D57u, c2, &hi1);
+        c0 = hi1 ^ c1 ^ k0;
+        c1 = lo1;
+        c2 = hi0 ^ c3 ^ k1;
+        c3 = lo0;
+        k0 += 0x9E3779B9u;
+        k1 += 0xBB67AE85u;
+    }
+    out[0] = c0;
+    out[1] = c1;
+    out[2] = c2;
+    out[3] = c3;
+}
+
+// Maps a word to [0, 1)
+static inline double random_unit_from(uint32_t word) {
+    return word * (1.0 / 4294967296.0);
+}
+
+#endif /* RNG_H */
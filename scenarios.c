@@ -0,0 +1,93 @@
+#include "scenarios.h"
+#include "rng.h"
+#include <math.h>
+#include <string.h>
+#include <float.h>
+
+const char* scenario_names[SCENARIO_COUNT] = {"uniform", "dam_break", "clustered"};
+
+const char* scenario_name(Scenario scenario) {
+    return scenario_names[scenario];
+}
+
+bool parse_scenario(const char* name, Scenario* scenario) {
+    for (int i = 0; i < SCENARIO_COUNT; i++) {
+        if (strcmp(name, scenario_names[i]) == 0) {
+            *scenario = (Scenario)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Gravity a scenario is meant to run with, for drivers whose user did not choose one
+void scenario_gravity(Scenario scenario, double gravity[2]) {
+    gravity[0] = GRAVITY_X;
+    gravity[1] = scenario == SCENARIO_DAM_BREAK ? SCENARIO_GRAVITY : GRAVITY_Y;
+}
+
+// Overwrites the layout of an initialised Particles with a reproducible scene. Only the
+// positions and velocities change, forces stay as the caller set them.
+void apply_scenario(Particles* particles, Scenario scenario, unsigned int seed) {
+    particles->seed = seed;
+    double min_x = particles->radius, max_x = particles->max_x - particles->radius;
+    double min_y = particles->radius, max_y = particles->max_y - particles->radius;
+    int n = particles->num_particles;
+
+    if (scenario == SCENARIO_UNIFORM) {
+        #pragma omp parallel for
+        for (int i = 0; i < n; i++) {
+            uint32_t r[4];
+            random_block(seed, RANDOM_SCENARIO, 0, i, 0, r);
+            particles->x[i] = (real_t)(min_x + random_unit_from(r[0]) * (max_x - min_x));
+            particles->y[i] = (real_t)(min_y + random_unit_from(r[1]) * (max_y - min_y));
+        }
+    }
+    else if (scenario == SCENARIO_DAM_BREAK) {
+        // Jittered lattice filling the lower-left block of the domain
+        double block_w = 0.4 * (max_x - min_x);
+        double block_h = 0.8 * (max_y - min_y);
+        int cols = (int)ceil(sqrt(n * block_w / block_h));
+        int rows = (n + cols - 1) / cols;
+        double spacing_x = block_w / cols;
+        double spacing_y = block_h / rows;
+        #pragma omp parallel for
+        for (int i = 0; i < n; i++) {
+            int c = i % cols;
+            int r = i / cols;
+            uint32_t jitter[4];
+            random_block(seed, RANDOM_SCENARIO, 0, i, 0, jitter);
+            particles->x[i] = (real_t)(min_x + (c + 0.25 + 0.5 * random_unit_from(jitter[0])) * spacing_x);
+            particles->y[i] = (real_t)(max_y - (r + 0.25 + 0.5 * random_unit_from(jitter[1])) * spacing_y);
+        }
+    }
+    else if (scenario == SCENARIO_CLUSTERED) {
+        double centres[SCENARIO_CLUSTERS][2];
+        double spread = 0.05 * fmin(max_x - min_x, max_y - min_y);
+        for (int c = 0; c < SCENARIO_CLUSTERS; c++) {
+            uint32_t r[4];
+            random_block(seed, RANDOM_CLUSTERS, 0, c, 0, r);
+            centres[c][0] = min_x + (0.1 + 0.8 * random_unit_from(r[0])) * (max_x - min_x);
+            centres[c][1] = min_y + (0.1 + 0.8 * random_unit_from(r[1])) * (max_y - min_y);
+        }
+        #pragma omp parallel for
+        for (int i = 0; i < n; i++) {
+            // Box-Muller around one of the cluster centres
+            uint32_t r[4];
+            random_block(seed, RANDOM_SCENARIO, 0, i, 0, r);
+            double u1 = fmax(random_unit_from(r[0]), DBL_MIN);
+            double u2 = random_unit_from(r[1]);
+            double mag = spread * sqrt(-2 * log(u1));
+            double px = centres[i % SCENARIO_CLUSTERS][0] + mag * cos(2 * M_PI * u2);
+            double py = centres[i % SCENARIO_CLUSTERS][1] + mag * sin(2 * M_PI * u2);
+            particles->x[i] = (real_t)fmin(fmax(px, min_x), max_x);
+            particles->y[i] = (real_t)fmin(fmax(py, min_y), max_y);
+        }
+    }
+
+    #pragma omp parallel for
+    for (int i = 0; i < n; i++) {
+        particles->vx[i] = particles->vy[i] = 0;
+        particles->density[i] = 0;
+    }
+}
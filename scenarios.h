@@ -0,0 +1,27 @@
+#pragma once
+
+#ifndef SCENARIOS_H
+#define SCENARIOS_H
+
+#include "particles.h"
+
+// Default downward gravity of the dam-break scenario
+#define SCENARIO_GRAVITY 0.05
+#define SCENARIO_CLUSTERS 8
+
+typedef enum {
+    SCENARIO_UNIFORM,
+    SCENARIO_DAM_BREAK,
+    SCENARIO_CLUSTERED,
+    SCENARIO_COUNT
+} Scenario;
+
+extern const char* scenario_names[SCENARIO_COUNT];
+
+// Function prototypes
+void scenario_gravity(Scenario scenario, double gravity[2]);
+void apply_scenario(Particles* particles, Scenario scenario, unsigned int seed);
+const char* scenario_name(Scenario scenario);
+bool parse_scenario(const char* name, Scenario* scenario);
+
+#endif /* SCENARIOS_H */
@@ -0,0 +1,321 @@
+#include "sdf.h"
+#include "rng.h"
+#include <stdio.h>
+#include <math.h>
+#include <float.h>
+
+void init_obstacles(Obstacles* obstacles, double width, double height, double resolution) {
+    obstacles->shapes = NULL;
+    obstacles->num_shapes = 0;
+    obstacles->shape_capacity = 0;
+    obstacles->width = width;
+    obstacles->height = height;
+    obstacles->resolution = resolution > 0 ? resolution : SDF_RESOLUTION;
+    obstacles->inv_resolution = 1 / obstacles->resolution;
+    // One extra sample past the far edge so interpolation covers the whole domain
+    obstacles->cols = (int)(width / obstacles->resolution) + 2;
+    obstacles->rows = (int)(height / obstacles->resolution) + 2;
+    obstacles->distance = NULL;
+    obstacles->layer = SDF_LAYER;
+    obstacles->pressure = SDF_PRESSURE;
+}
+
+void free_obstacles(Obstacles* obstacles) {
+    for (int s = 0; s < obstacles->num_shapes; s++) {
+        free(obstacles->shapes[s].vertices);
+    }
+    free(obstacles->shapes);
+    free(obstacles->distance);
+    obstacles->shapes = NULL;
+    obstacles->distance = NULL;
+    obstacles->num_shapes = 0;
+    obstacles->shape_capacity = 0;
+}
+
+Shape* append_shape(Obstacles* obstacles, ShapeKind kind) {
+    if (obstacles->num_shapes == obstacles->shape_capacity) {
+        int capacity = obstacles->shape_capacity > 0 ? obstacles->shape_capacity * 2 : 8;
+        Shape* shapes = realloc(obstacles->shapes, capacity * sizeof(Shape));
+        if (shapes == NULL) {
+            perror("Memory allocation failed for obstacles.");
+            exit(EXIT_FAILURE);
+        }
+        obstacles->shapes = shapes;
+        obstacles->shape_capacity = capacity;
+    }
+    Shape* shape = &obstacles->shapes[obstacles->num_shapes++];
+    memset(shape, 0, sizeof(Shape));
+    shape->kind = kind;
+    return shape;
+}
+
+void add_circle(Obstacles* obstacles, double cx, double cy, double radius) {
+    Shape* shape = append_shape(obstacles, SHAPE_CIRCLE);
+    shape->a[0] = cx;
+    shape->a[1] = cy;
+    shape->radius = radius;
+}
+
+// angle in radians, counterclockwise
+void add_box(Obstacles* obstacles, double cx, double cy, double half_width, double half_height, double angle) {
+    Shape* shape = append_shape(obstacles, SHAPE_BOX);
+    shape->a[0] = cx;
+    shape->a[1] = cy;
+    shape->b[0] = half_width;
+    shape->b[1] = half_height;
+    shape->angle = angle;
+}
+
+void add_capsule(Obstacles* obstacles, double ax, double ay, double bx, double by, double radius) {
+    Shape* shape = append_shape(obstacles, SHAPE_CAPSULE);
+    shape->a[0] = ax;
+    shape->a[1] = ay;
+    shape->b[0] = bx;
+    shape->b[1] = by;
+    shape->radius = radius;
+}
+
+// The vertices are copied
+void add_polygon(Obstacles* obstacles, const double* vertices, int num_vertices) {
+    if (num_vertices < 3) return;
+    double* copy = malloc(2 * num_vertices * sizeof(double));
+    if (copy == NULL) {
+        perror("Memory allocation failed for obstacles.");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(copy, vertices, 2 * num_vertices * sizeof(double));
+    Shape* shape = append_shape(obstacles, SHAPE_POLYGON);
+    shape->vertices = copy;
+    shape->num_vertices = num_vertices;
+}
+
+// Reads obstacles from a text file, one per line, and rasterizes them:
+//   circle <cx> <cy> <radius>
+//   box <cx> <cy> <half width> <half height> [angle in degrees]
+//   capsule <ax> <ay> <bx> <by> <radius>
+//   polygon <x0> <y0> <x1> <y1> <x2> <y2> ...
+// Blank lines and lines starting with # are skipped. Returns false on the first bad line.
+bool load_obstacles(Obstacles* obstacles, const char* path) {
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        perror("Could not open the obstacle file");
+        return false;
+    }
+
+    char* line = NULL;
+    size_t line_capacity = 0;
+    int line_number = 0;
+    int vertex_capacity = 0;
+    double* values = NULL;
+    bool ok = true;
+    while (ok && getline(&line, &line_capacity, file) > 0) {
+        line_number++;
+        char kind[16];
+        int consumed = 0;
+        if (sscanf(line, " %15s%n", kind, &consumed) != 1 || kind[0] == '#') continue;
+
+        // Every number on the rest of the line
+        int count = 0;
+        char* cursor = line + consumed;
+        for (;;) {
+            char* end;
+            double value = strtod(cursor, &end);
+            if (end == cursor) break;
+            if (count == vertex_capacity) {
+                vertex_capacity = vertex_capacity > 0 ? vertex_capacity * 2 : 16;
+                double* grown = realloc(values, vertex_capacity * sizeof(double));
+                if (grown == NULL) {
+                    perror("Memory allocation failed for obstacles.");
+                    exit(EXIT_FAILURE);
+                }
+                values = grown;
+            }
+            values[count++] = value;
+            cursor = end;
+        }
+
+        if (strcmp(kind, "circle") == 0 && count == 3) {
+            add_circle(obstacles, values[0], values[1], values[2]);
+        } else if (strcmp(kind, "box") == 0 && (count == 4 || count == 5)) {
+            add_box(obstacles, values[0], values[1], values[2], values[3], count == 5 ? values[4] * M_PI / 180 : 0);
+        } else if (strcmp(kind, "capsule") == 0 && count == 5) {
+            add_capsule(obstacles, values[0], values[1], values[2], values[3], values[4]);
+        } else if (strcmp(kind, "polygon") == 0 && count >= 6 && count % 2 == 0) {
+            add_polygon(obstacles, values, count / 2);
+        } else {
+            fprintf(stderr, "%s:%d: expected circle, box, capsule or polygon with its coordinates\n", path, line_number);
+            ok = false;
+        }
+    }
+    free(line);
+    free(values);
+    fclose(file);
+
+    if (ok) build_obstacle_field(obstacles);
+    return ok;
+}
+
+double segment_distance(double px, double py, double ax, double ay, double bx, double by) {
+    double ex = bx - ax, ey = by - ay;
+    double wx = px - ax, wy = py - ay;
+    double length2 = ex * ex + ey * ey;
+    double t = length2 > 0 ? (wx * ex + wy * ey) / length2 : 0;
+    if (t < 0) t = 0;
+    if (t > 1) t = 1;
+    return hypot(wx - t * ex, wy - t * ey);
+}
+
+// Exact signed distance from (x, y) to one shape, negative inside
+double shape_distance(const Shape* shape, double x, double y) {
+    switch (shape->kind) {
+    case SHAPE_CIRCLE:
+        return hypot(x - shape->a[0], y - shape->a[1]) - shape->radius;
+    case SHAPE_BOX: {
+        double c = cos(shape->angle), s = sin(shape->angle);
+        double dx = x - shape->a[0], dy = y - shape->a[1];
+        double qx = fabs(c * dx + s * dy) - shape->b[0];
+        double qy = fabs(-s * dx + c * dy) - shape->b[1];
+        return hypot(fmax(qx, 0), fmax(qy, 0)) + fmin(fmax(qx, qy), 0);
+    }
+    case SHAPE_CAPSULE:
+        return segment_distance(x, y, shape->a[0], shape->a[1], shape->b[0], shape->b[1]) - shape->radius;
+    case SHAPE_POLYGON: {
+        const double* v = shape->vertices;
+        int n = shape->num_vertices;
+        double nearest = DBL_MAX;
+        bool inside = false;
+        for (int i = 0, j = n - 1; i < n; j = i++) {
+            double d = segment_distance(x, y, v[2 * j], v[2 * j + 1], v[2 * i], v[2 * i + 1]);
+            if (d < nearest) nearest = d;
+            // Even-odd rule: count edges crossed by a ray towards +x
+            if ((v[2 * i + 1] > y) != (v[2 * j + 1] > y) &&
+                x < v[2 * j] + (y - v[2 * j + 1]) * (v[2 * i] - v[2 * j]) / (v[2 * i + 1] - v[2 * j + 1])) {
+                inside = !inside;
+            }
+        }
+        return inside ? -nearest : nearest;
+    }
+    }
+    return DBL_MAX;
+}
+
+// Samples the union of all shapes over the grid. Runs once per scene, the cost is one
+// exact distance per sample and shape.
+void build_obstacle_field(Obstacles* obstacles) {
+    size_t samples = (size_t)obstacles->cols * obstacles->rows;
+    if (obstacles->distance == NULL) {
+        obstacles->distance = malloc(samples * sizeof(float));
+        if (obstacles->distance == NULL) {
+            perror("Memory allocation failed for the obstacle field.");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Without shapes every sample is far outside, but finite so gradients stay zero
+    double far = obstacles->width + obstacles->height;
+    #pragma omp parallel for
+    for (int r = 0; r < obstacles->rows; r++) {
+        double y = r * obstacles->resolution;
+        for (int c = 0; c < obstacles->cols; c++) {
+            double x = c * obstacles->resolution;
+            double d = far;
+            for (int s = 0; s < obstacles->num_shapes; s++) {
+                d = fmin(d, shape_distance(&obstacles->shapes[s], x, y));
+            }
+            obstacles->distance[(size_t)r * obstacles->cols + c] = (float)d;
+        }
+    }
+}
+
+// Bilinear distance at (x, y) and its gradient, which points away from the nearest
+// solid. Points outside the domain are clamped to its edge.
+real_t obstacle_distance(const Obstacles* obstacles, real_t x, real_t y, real_t gradient[2]) {
+    real_t fx = x * (real_t)obstacles->inv_resolution;
+    real_t fy = y * (real_t)obstacles->inv_resolution;
+    if (fx < 0) fx = 0;
+    if (fy < 0) fy = 0;
+    int c = (int)fx;
+    int r = (int)fy;
+    if (c > obstacles->cols - 2) c = obstacles->cols - 2;
+    if (r > obstacles->rows - 2) r = obstacles->rows - 2;
+    real_t tx = fx - c;
+    real_t ty = fy - r;
+    if (tx > 1) tx = 1;
+    if (ty > 1) ty = 1;
+
+    const float* row = obstacles->distance + (size_t)r * obstacles->cols + c;
+    real_t d00 = row[0], d10 = row[1];
+    real_t d01 = row[obstacles->cols], d11 = row[obstacles->cols + 1];
+    real_t bottom = d00 + (d10 - d00) * tx;
+    real_t top = d01 + (d11 - d01) * tx;
+    gradient[0] = ((d10 - d00) * (1 - ty) + (d11 - d01) * ty) * (real_t)obstacles->inv_resolution;
+    gradient[1] = (top - bottom) * (real_t)obstacles->inv_resolution;
+    return bottom + (top - bottom) * ty;
+}
+
+// Moves particles that start inside or touching an obstacle to random free spots of the
+// domain, so a scene laid out without obstacles can be used with them. Gives up on a
+// particle after a fixed number of draws. Returns how many particles were moved.
+int relocate_covered_particles(Particles* particles) {
+    const Obstacles* obstacles = particles->obstacles;
+    double min_x = particles->radius, max_x = particles->max_x - particles->radius;
+    double min_y = particles->radius, max_y = particles->max_y - particles->radius;
+    int moved = 0;
+
+    #pragma omp parallel for reduction(+:moved)
+    for (int i = 0; i < particles->num_particles; i++) {
+        real_t gradient[2];
+        if (obstacle_distance(obstacles, particles->x[i], particles->y[i], gradient) >= particles->radius) continue;
+        for (uint32_t attempt = 1; attempt <= 64; attempt++) {
+            uint32_t r[4];
+            random_block(particles->seed, RANDOM_SCENARIO, particles->step, i, attempt, r);
+            real_t x = (real_t)(min_x + random_unit_from(r[0]) * (max_x - min_x));
+            real_t y = (real_t)(min_y + random_unit_from(r[1]) * (max_y - min_y));
+            if (obstacle_distance(obstacles, x, y, gradient) >= particles->radius) {
+                particles->x[i] = x;
+                particles->y[i] = y;
+                particles->vx[i] = particles->vy[i] = 0;
+                moved++;
+                break;
+            }
+        }
+    }
+    particles->lookup_valid = false;
+    particles->neighbor_lists_valid = false;
+    return moved;
+}
+
+// Boundary handling for one particle after it moved. Within layer radii of a surface it is
+// pushed outwards, harder the closer it gets, which stands in for the pressure of the
+// missing fluid on the solid side. A particle that overlaps the surface is moved back onto
+// it and its velocity into the solid is reflected with collision_loss, like at the walls.
+void resolve_obstacle_contact(Particles* particles, int idx, real_t dt) {
+    const Obstacles* obstacles = particles->obstacles;
+    real_t radius = (real_t)particles->radius;
+    real_t layer = (real_t)(obstacles->layer * particles->radius);
+    real_t gradient[2];
+    real_t d = obstacle_distance(obstacles, particles->x[idx], particles->y[idx], gradient);
+    if (d >= layer) return;
+
+    real_t norm = REAL_SQRT(gradient[0] * gradient[0] + gradient[1] * gradient[1]);
+    if (norm == 0) return;
+    real_t nx = gradient[0] / norm;
+    real_t ny = gradient[1] / norm;
+
+    if (d > radius) {
+        real_t u = (layer - d) / (layer - radius);
+        real_t push = (real_t)obstacles->pressure * u * u * dt;
+        particles->vx[idx] += push * nx;
+        particles->vy[idx] += push * ny;
+        return;
+    }
+
+    particles->x[idx] += (radius - d) * nx;
+    particles->y[idx] += (radius - d) * ny;
+    real_t inward = particles->vx[idx] * nx + particles->vy[idx] * ny;
+    if (inward < 0) {
+        real_t bounce = (1 + (real_t)particles->collision_loss) * inward;
+        particles->vx[idx] -= bounce * nx;
+        particles->vy[idx] -= bounce * ny;
+    }
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#ifndef SDF_H
+#define SDF_H
+
+#include "particles.h"
+
+// Spacing in pixels between samples of the obstacle distance field
+#define SDF_RESOLUTION 4
+// Width of the layer around obstacles where particles are pushed away, in particle radii
+#define SDF_LAYER 2
+// Strength of that push at the obstacle surface
+#define SDF_PRESSURE 0.1
+
+typedef enum {
+    SHAPE_CIRCLE,
+    SHAPE_BOX,
+    SHAPE_CAPSULE,
+    SHAPE_POLYGON
+} ShapeKind;
+
+// One solid obstacle. Circles use a and radius, boxes are centred on a with half extents
+// b rotated by angle, capsules are the segment a-b thickened by radius and polygons are
+// closed outlines of num_vertices points in vertices (x0, y0, x1, y1, ...), filled by the
+// even-odd rule.
+typedef struct {
+    ShapeKind kind;
+    double a[2];
+    double b[2];
+    double radius;
+    double angle;
+    double* vertices;
+    int num_vertices;
+} Shape;
+
+// Static obstacles rasterized once into a signed distance field, negative inside a solid,
+// sampled every `resolution` pixels over the domain. Collision and boundary queries read
+// one bilinear cell, so their cost does not depend on the number or shape of obstacles.
+typedef struct Obstacles {
+    Shape* shapes;
+    int num_shapes;
+    int shape_capacity;
+    double width;
+    double height;
+    double resolution;
+    double inv_resolution;
+    int cols;
+    int rows;
+    float* distance;
+    double layer;
+    double pressure;
+} Obstacles;
+
+// Function prototypes
+void init_obstacles(Obstacles* obstacles, double width, double height, double resolution);
+void free_obstacles(Obstacles* obstacles);
+void add_circle(Obstacles* obstacles, double cx, double cy, double radius);
+void add_box(Obstacles* obstacles, double cx, double cy, double half_width, double half_height, double angle);
+void add_capsule(Obstacles* obstacles, double ax, double ay, double bx, double by, double radius);
+void add_polygon(Obstacles* obstacles, const double* vertices, int num_vertices);
+bool load_obstacles(Obstacles* obstacles, const char* path);
+double shape_distance(const Shape* shape, double x, double y);
+void build_obstacle_field(Obstacles* obstacles);
+real_t obstacle_distance(const Obstacles* obstacles, real_t x, real_t y, real_t gradient[2]);
+int relocate_covered_particles(Particles* particles);
+void resolve_obstacle_contact(Particles* particles, int idx, real_t dt);
+
+#endif /* SDF_H */
@@ -0,0 +1,173 @@
+#include "simd.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <math.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SIMD_X86
+#include <immintrin.h>
+#endif
+
+DensitySpanFn density_span = density_span_scalar;
+PressureSpanFn pressure_span = pressure_span_scalar;
+SimdLevel simd_level = SIMD_SCALAR;
+bool simd_initialised = false;
+
+const char* simd_level_names[SIMD_LEVEL_COUNT] = {"scalar", "sse", "avx2", "avx512"};
+
+const char* simd_level_name(SimdLevel level) {
+    return simd_level_names[level];
+}
+
+// Reference kernels, the vector versions must match these up to rounding
+
+real_t density_span_scalar(const Particles* particles, const int* indices, int stride, int count, real_t px, real_t py) {
+    const SmoothingConstants* kernel = &particles->kernel;
+    real_t density = 0;
+    for (int k = 0; k < count; k++) {
+        int j = indices[k * stride];
+        real_t dx = particles->x[j] - px;
+        real_t dy = particles->y[j] - py;
+        density += density_kernel(kernel, dx * dx + dy * dy);
+    }
+    return density;
+}
+
+void pressure_span_scalar(const Particles* particles, const int* indices, int stride, int count, int self, real_t px, real_t py, real_t own_density, real_t force[2]) {
+    const SmoothingConstants* kernel = &particles->kernel;
+    for (int k = 0; k < count; k++) {
+        int j = indices[k * stride];
+        real_t offset[2] = {particles->x[j] - px, particles->y[j] - py};
+        real_t d2 = offset[0] * offset[0] + offset[1] * offset[1];
+
+        if (d2 <= kernel->h2) {
+            if (j == self) continue;
+
+            real_t gradient[2];
+            if (d2 == 0) {
+                getRandomDir(particles, self, j, gradient);
+                real_t slope = pressure_slope(kernel, 0);
+                gradient[0] *= slope;
+                gradient[1] *= slope;
+            } else {
+                real_t scale = pressure_slope_over_distance(kernel, d2);
+                gradient[0] = offset[0] * scale;
+                gradient[1] = offset[1] * scale;
+            }
+            real_t density = particles->density[j];
+            real_t shared_pressure = calculate_shared_pressure(particles, density, own_density);
+
+            force[0] += -gradient[0] * shared_pressure / density;
+            force[1] += -gradient[1] * shared_pressure / density;
+        }
+    }
+}
+
+#ifdef SIMD_X86
+
+#ifdef USE_FLOAT32
+typedef int32_t simd_lane_int;
+#define SIMD_SQRT_128(v) ((__typeof__(v))_mm_sqrt_ps((__m128)(v)))
+#define SIMD_SQRT_256(v) ((__typeof__(v))_mm256_sqrt_ps((__m256)(v)))
+#define SIMD_SQRT_512(v) ((__typeof__(v))_mm512_sqrt_ps((__m512)(v)))
+#else
+typedef int64_t simd_lane_int;
+#define SIMD_SQRT_128(v) ((__typeof__(v))_mm_sqrt_pd((__m128d)(v)))
+#define SIMD_SQRT_256(v) ((__typeof__(v))_mm256_sqrt_pd((__m256d)(v)))
+#define SIMD_SQRT_512(v) ((__typeof__(v))_mm512_sqrt_pd((__m512d)(v)))
+#endif
+
+#define SIMD_SUFFIX sse
+#define SIMD_TARGET "sse4.2"
+#define SIMD_BYTES 16
+#define SIMD_SQRT(v) SIMD_SQRT_128(v)
+#include "simd_kernels.h"
+#undef SIMD_SUFFIX
+#undef SIMD_TARGET
+#undef SIMD_BYTES
+#undef SIMD_SQRT
+
+#define SIMD_SUFFIX avx2
+#define SIMD_TARGET "avx2"
+#define SIMD_BYTES 32
+#define SIMD_SQRT(v) SIMD_SQRT_256(v)
+#include "simd_kernels.h"
+#undef SIMD_SUFFIX
+#undef SIMD_TARGET
+#undef SIMD_BYTES
+#undef SIMD_SQRT
+
+#define SIMD_SUFFIX avx512
+#define SIMD_TARGET "avx512f"
+#define SIMD_BYTES 64
+#define SIMD_SQRT(v) SIMD_SQRT_512(v)
+#include "simd_kernels.h"
+#undef SIMD_SUFFIX
+#undef SIMD_TARGET
+#undef SIMD_BYTES
+#undef SIMD_SQRT
+
+#endif /* SIMD_X86 */
+
+SimdLevel detect_simd_level(void) {
+#ifdef SIMD_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) return SIMD_AVX512;
+    if (__builtin_cpu_supports("avx2")) return SIMD_AVX2;
+    if (__builtin_cpu_supports("sse4.2")) return SIMD_SSE;
+#endif
+    return SIMD_SCALAR;
+}
+
+// Switches the span kernels, refusing levels the CPU does not support
+bool set_simd_level(SimdLevel level) {
+    if (level > detect_simd_level()) return false;
+    switch (level) {
+#ifdef SIMD_X86
+    case SIMD_SSE:
+        density_span = density_span_sse;
+        pressure_span = pressure_span_sse;
+        break;
+    case SIMD_AVX2:
+        density_span = density_span_avx2;
+        pressure_span = pressure_span_avx2;
+        break;
+    case SIMD_AVX512:
+        density_span = density_span_avx512;
+        pressure_span = pressure_span_avx512;
+        break;
+#endif
+    default:
+        density_span = density_span_scalar;
+        pressure_span = pressure_span_scalar;
+        level = SIMD_SCALAR;
+        break;
+    }
+    simd_level = level;
+    return true;
+}
+
+SimdLevel get_simd_level(void) {
+    return simd_level;
+}
+
+// Picks the widest supported ISA once per process. FLUID_SIMD=scalar|sse|avx2|avx512
+// caps the choice, which is how the scalar reference path is selected at run time.
+void init_simd(void) {
+    if (simd_initialised) return;
+    simd_initialised = true;
+
+    SimdLevel level = detect_simd_level();
+    const char* requested = getenv("FLUID_SIMD");
+    if (requested != NULL) {
+        bool known = false;
+        for (int i = 0; i < SIMD_LEVEL_COUNT; i++) {
+            if (strcmp(requested, simd_level_names[i]) == 0) {
+                known = true;
+                if ((SimdLevel)i < level) level = (SimdLevel)i;
+            }
+        }
+        if (!known) printf("Unknown FLUID_SIMD value %s, using %s\n", requested, simd_level_names[level]);
+    }
+    set_simd_level(level);
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#ifndef SIMD_H
+#define SIMD_H
+
+#include "particles.h"
+
+typedef enum {
+    SIMD_SCALAR,
+    SIMD_SSE,
+    SIMD_AVX2,
+    SIMD_AVX512,
+    SIMD_LEVEL_COUNT
+} SimdLevel;
+
+// Kernels over a run of `count` particle indices read every `stride` ints, which covers
+// both a span of the spatial lookup (stride ENTRY_STRIDE) and a neighbor list (stride 1).
+// The density kernel returns the summed smoothing kernel at (px, py); the pressure kernel
+// adds the pressure force on particle `self` into force.
+#define ENTRY_STRIDE ((int)(sizeof(Entry) / sizeof(int)))
+
+typedef real_t (*DensitySpanFn)(const Particles* particles, const int* indices, int stride, int count, real_t px, real_t py);
+typedef void (*PressureSpanFn)(const Particles* particles, const int* indices, int stride, int count, int self, real_t px, real_t py, real_t own_density, real_t force[2]);
+
+extern DensitySpanFn density_span;
+extern PressureSpanFn pressure_span;
+
+// Function prototypes
+void init_simd(void);
+SimdLevel detect_simd_level(void);
+bool set_simd_level(SimdLevel level);
+SimdLevel get_simd_level(void);
+const char* simd_level_name(SimdLevel level);
+real_t density_span_scalar(const Particles* particles, const int* indices, int stride, int count, real_t px, real_t py);
+void pressure_span_scalar(const Particles* particles, const int* indices, int stride, int count, int self, real_t px, real_t py, real_t own_density, real_t force[2]);
+
+#endif /* SIMD_H */
@@ -0,0 +1,116 @@
+// Neighbor-span kernels written once with GCC vector extensions and instantiated per ISA
+// by simd.c. The including file defines:
+//   SIMD_SUFFIX   name suffix of the generated functions (sse, avx2, avx512)
+//   SIMD_TARGET   target attribute string
+//   SIMD_BYTES    vector width in bytes
+//   SIMD_SQRT(v)  lane-wise square root of a vreal
+// Lanes past the end of a span repeat the span's last entry and are masked out, so the
+// gathers stay unconditional.
+
+#define SIMD_CONCAT_(a, b) a##_##b
+#define SIMD_CONCAT(a, b) SIMD_CONCAT_(a, b)
+#define SIMD_FN(name) SIMD_CONCAT(name, SIMD_SUFFIX)
+#define SIMD_LANES ((int)(SIMD_BYTES / sizeof(real_t)))
+// Clamp at zero for the kernel shapes of kernels.h, needs the vreal and vmask typedefs
+#define SIMD_POS(v) ((vreal)((vmask)(v) & ((v) > 0)))
+
+typedef real_t SIMD_FN(vreal) __attribute__((vector_size(SIMD_BYTES)));
+typedef simd_lane_int SIMD_FN(vmask) __attribute__((vector_size(SIMD_BYTES)));
+
+__attribute__((target(SIMD_TARGET)))
+real_t SIMD_FN(density_span)(const Particles* particles, const int* indices, int stride, int count, real_t px, real_t py) {
+    typedef SIMD_FN(vreal) vreal;
+    typedef SIMD_FN(vmask) vmask;
+    const SmoothingConstants* kernel = &particles->kernel;
+    vreal h2v = (vreal){0} + kernel->h2;
+    vreal sum = (vreal){0};
+    vmask lane;
+    for (int l = 0; l < SIMD_LANES; l++) lane[l] = l;
+
+    for (int k = 0; k < count; k += SIMD_LANES) {
+        vreal dx, dy;
+        for (int l = 0; l < SIMD_LANES; l++) {
+            int j = indices[(k + l < count ? k + l : count - 1) * stride];
+            dx[l] = particles->x[j] - px;
+            dy[l] = particles->y[j] - py;
+        }
+        vreal d2 = dx * dx + dy * dy;
+        vmask inside = (d2 < h2v) & (lane < count - k);
+        vreal dst = SMOOTHING_NEEDS_DISTANCE(DENSITY_KERNEL) ? SIMD_SQRT(d2) : d2;
+        (void)dst;
+        vreal w = SMOOTHING_VALUE(DENSITY_KERNEL, kernel, d2, dst, SIMD_POS);
+        sum += (vreal)((vmask)w & inside);
+    }
+
+    real_t density = 0;
+    for (int l = 0; l < SIMD_LANES; l++) density += sum[l];
+    return density;
+}
+
+__attribute__((target(SIMD_TARGET)))
+void SIMD_FN(pressure_span)(const Particles* particles, const int* indices, int stride, int count, int self, real_t px, real_t py, real_t own_density, real_t force[2]) {
+    typedef SIMD_FN(vreal) vreal;
+    typedef SIMD_FN(vmask) vmask;
+    const SmoothingConstants* kernel = &particles->kernel;
+    real_t own_pressure = convert_density_to_pressure(particles, own_density);
+    real_t target_density = (real_t)particles->target_density;
+    real_t pressure_multiplier = (real_t)particles->pressure_multiplier;
+    vreal h2v = (vreal){0} + kernel->h2;
+    vreal zero = (vreal){0};
+    vreal fx = zero, fy = zero;
+    vmask lane;
+    for (int l = 0; l < SIMD_LANES; l++) lane[l] = l;
+
+    for (int k = 0; k < count; k += SIMD_LANES) {
+        vreal dx, dy, dens;
+        for (int l = 0; l < SIMD_LANES; l++) {
+            int j = indices[(k + l < count ? k + l : count - 1) * stride];
+            dx[l] = particles->x[j] - px;
+            dy[l] = particles->y[j] - py;
+            dens[l] = particles->density[j];
+        }
+        vreal d2 = dx * dx + dy * dy;
+        vmask valid = lane < count - k;
+        vmask coincident = (d2 == zero) & valid;
+        vmask active = (d2 <= h2v) & valid & ~coincident;
+
+        // Coincident neighbors need a random direction, they go through the scalar path
+        bool any_coincident = false;
+        for (int l = 0; l < SIMD_LANES; l++) any_coincident |= coincident[l] != 0;
+        if (any_coincident) {
+            for (int l = 0; l < SIMD_LANES && k + l < count; l++) {
+                int j = indices[(k + l) * stride];
+                if (coincident[l] == 0 || j == self) continue;
+                real_t dir[2];
+                getRandomDir(particles, self, j, dir);
+                real_t shared = calculate_shared_pressure(particles, dens[l], own_density);
+                real_t slope = pressure_slope(kernel, 0);
+                force[0] += -dir[0] * slope * shared / dens[l];
+                force[1] += -dir[1] * slope * shared / dens[l];
+            }
+        }
+
+        // Inactive lanes get d = h so every term stays finite before masking
+        vreal safe_d2 = (vreal)(((vmask)d2 & active) | ((vmask)h2v & ~active));
+        vreal dst = SMOOTHING_NEEDS_DISTANCE(PRESSURE_KERNEL) ? SIMD_SQRT(safe_d2) : safe_d2;
+        (void)dst;
+        vreal scale = SMOOTHING_SLOPE_OVER_DISTANCE(PRESSURE_KERNEL, kernel, safe_d2, dst, SIMD_POS);
+        vreal pressure = (dens - target_density) * pressure_multiplier;
+        vreal shared = (pressure + own_pressure) / 2;
+        vreal w = scale * shared / dens;
+        w = (vreal)((vmask)w & active);
+        fx -= dx * w;
+        fy -= dy * w;
+    }
+
+    for (int l = 0; l < SIMD_LANES; l++) {
+        force[0] += fx[l];
+        force[1] += fy[l];
+    }
+}
+
+#undef SIMD_POS
+#undef SIMD_LANES
+#undef SIMD_FN
+#undef SIMD_CONCAT
+#undef SIMD_CONCAT_
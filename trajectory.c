@@ -0,0 +1,464 @@
+#include "trajectory.h"
+#include <stdio.h>
+#include <stddef.h>
+#include <math.h>
+#include <sys/types.h>
+
+// Half precision conversions, rounding to nearest even. Values past the half range
+// become infinities and values below its subnormals become zero.
+uint16_t float_to_half(float value) {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    uint16_t sign = (uint16_t)((bits >> 16) & 0x8000);
+    int raw_exponent = (bits >> 23) & 0xff;
+    int exponent = raw_exponent - 127 + 15;
+    uint32_t mantissa = bits & 0x7fffff;
+
+    if (raw_exponent == 0xff) return sign | 0x7c00 | (mantissa ? 0x200 : 0);
+    if (exponent >= 31) return sign | 0x7c00;
+    if (exponent <= 0) {
+        if (exponent < -10) return sign;
+        mantissa |= 0x800000;
+        int shift = 14 - exponent;
+        uint32_t half = mantissa >> shift;
+        uint32_t rest = mantissa & ((1u << shift) - 1);
+        uint32_t halfway = 1u << (shift - 1);
+        if (rest > halfway || (rest == halfway && (half & 1))) half++;
+        return sign | (uint16_t)half;
+    }
+
+    // A carry out of the mantissa correctly bumps the exponent
+    uint32_t half = ((uint32_t)exponent << 10) | (mantissa >> 13);
+    uint32_t rest = mantissa & 0x1fff;
+    if (rest > 0x1000 || (rest == 0x1000 && (half & 1))) half++;
+    return sign | (uint16_t)half;
+}
+
+float half_to_float(uint16_t half) {
+    uint32_t sign = (uint32_t)(half & 0x8000) << 16;
+    int exponent = (half >> 10) & 0x1f;
+    uint32_t mantissa = half & 0x3ff;
+    uint32_t bits;
+
+    if (exponent == 0) {
+        float value = ldexpf((float)mantissa, -24);
+        return sign ? -value : value;
+    }
+    if (exponent == 0x1f) {
+        bits = sign | 0x7f800000 | (mantissa << 13);
+    } else {
+        bits = sign | ((uint32_t)(exponent - 15 + 127) << 23) | (mantissa << 13);
+    }
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+uint32_t zigzag_encode(int32_t value) {
+    return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+}
+
+int32_t zigzag_decode(uint32_t value) {
+    return (int32_t)(value >> 1) ^ -(int32_t)(value & 1);
+}
+
+uint8_t* put_varint(uint8_t* out, uint32_t value) {
+    while (value >= 0x80) {
+        *out++ = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    *out++ = (uint8_t)value;
+    return out;
+}
+
+bool get_varint(const uint8_t** in, const uint8_t* end, uint32_t* value) {
+    uint32_t result = 0;
+    for (int shift = 0; shift < 35 && *in < end; shift += 7) {
+        uint8_t byte = *(*in)++;
+        result |= (uint32_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            *value = result;
+            return true;
+        }
+    }
+    return false;
+}
+
+int32_t quantize_position(real_t value) {
+    return (int32_t)lrint((double)value * TRAJECTORY_POSITION_SCALE);
+}
+
+void reserve_trajectory_frame(TrajectoryFrame* frame, int count) {
+    if (count <= frame->capacity) return;
+    real_t** arrays[5] = {&frame->x, &frame->y, &frame->vx, &frame->vy, &frame->density};
+    for (int k = 0; k < 5; k++) {
+        free(*arrays[k]);
+        *arrays[k] = malloc(count * sizeof(real_t));
+        if (*arrays[k] == NULL) {
+            perror("Memory allocation failed for a trajectory frame.");
+            exit(EXIT_FAILURE);
+        }
+    }
+    frame->capacity = count;
+}
+
+void free_trajectory_frame(TrajectoryFrame* frame) {
+    free(frame->x);
+    free(frame->y);
+    free(frame->vx);
+    free(frame->vy);
+    free(frame->density);
+    memset(frame, 0, sizeof(*frame));
+}
+
+// Worst case payload: two 5-byte varints and three halves per particle
+void reserve_payload(uint8_t** payload, size_t* capacity, size_t size) {
+    if (size <= *capacity) return;
+    free(*payload);
+    *payload = malloc(size);
+    if (*payload == NULL) {
+        perror("Memory allocation failed for the trajectory payload.");
+        exit(EXIT_FAILURE);
+    }
+    *capacity = size;
+}
+
+void resize_previous_positions(int32_t** previous_x, int32_t** previous_y, int* previous_count, int count) {
+    if (count == *previous_count) return;
+    free(*previous_x);
+    free(*previous_y);
+    *previous_x = malloc((count + 1) * sizeof(int32_t));
+    *previous_y = malloc((count + 1) * sizeof(int32_t));
+    if (*previous_x == NULL || *previous_y == NULL) {
+        perror("Memory allocation failed for the trajectory positions.");
+        exit(EXIT_FAILURE);
+    }
+    *previous_count = count;
+}
+
+// Encodes and appends one frame, on the writer thread
+void write_trajectory_frame(TrajectoryWriter* writer, const TrajectoryFrame* frame) {
+    int n = frame->num_particles;
+    bool keyframe = writer->frames_written % TRAJECTORY_KEYFRAME_INTERVAL == 0 || n != writer->previous_count;
+    resize_previous_positions(&writer->previous_x, &writer->previous_y, &writer->previous_count, n);
+    reserve_payload(&writer->payload, &writer->payload_capacity, (size_t)n * 16 + 1);
+
+    uint8_t* out = writer->payload;
+    const real_t* positions[2] = {frame->x, frame->y};
+    int32_t* previous[2] = {writer->previous_x, writer->previous_y};
+    for (int axis = 0; axis < 2; axis++) {
+        int32_t last = 0;
+        for (int i = 0; i < n; i++) {
+            int32_t q = quantize_position(positions[axis][i]);
+            int32_t reference = keyframe ? last : previous[axis][i];
+            out = put_varint(out, zigzag_encode(q - reference));
+            previous[axis][i] = last = q;
+        }
+    }
+    const real_t* halves[3] = {frame->vx, frame->vy, frame->density};
+    for (int k = 0; k < 3; k++) {
+        for (int i = 0; i < n; i++) {
+            uint16_t h = float_to_half((float)halves[k][i]);
+            *out++ = (uint8_t)(h & 0xff);
+            *out++ = (uint8_t)(h >> 8);
+        }
+    }
+
+    TrajectoryFrameHeader header = {
+        .magic = TRAJECTORY_FRAME_MAGIC,
+        .keyframe = keyframe,
+        .step = frame->step,
+        .num_particles = n,
+        .payload_size = (uint64_t)(out - writer->payload),
+    };
+    if (fwrite(&header, sizeof(header), 1, writer->file) != 1 ||
+        fwrite(writer->payload, 1, header.payload_size, writer->file) != header.payload_size) {
+        // The bytes already written cannot be taken back and previous_x/y now hold
+        // positions the file never got, so stop rather than append bad deltas
+        perror("Could not write the trajectory frame");
+        pthread_mutex_lock(&writer->lock);
+        writer->failed = true;
+        pthread_mutex_unlock(&writer->lock);
+        return;
+    }
+
+    if (writer->frames_written == writer->index_capacity) {
+        writer->index_capacity = writer->index_capacity ? writer->index_capacity * 2 : 256;
+        writer->index = realloc(writer->index, writer->index_capacity * sizeof(TrajectoryIndexEntry));
+        if (writer->index == NULL) {
+            perror("Memory allocation failed for the trajectory index.");
+            exit(EXIT_FAILURE);
+        }
+    }
+    writer->index[writer->frames_written++] = (TrajectoryIndexEntry) { writer->offset, frame->step, keyframe };
+    writer->offset += sizeof(header) + header.payload_size;
+}
+
+void* trajectory_writer_main(void* arg) {
+    TrajectoryWriter* writer = arg;
+    pthread_mutex_lock(&writer->lock);
+    for (;;) {
+        while (writer->pending == 0 && !writer->stopping) {
+            pthread_cond_wait(&writer->ready, &writer->lock);
+        }
+        if (writer->pending == 0) break;
+        int slot = (writer->head - writer->pending + TRAJECTORY_RING) % TRAJECTORY_RING;
+        bool failed = writer->failed;
+        pthread_mutex_unlock(&writer->lock);
+
+        if (!failed) write_trajectory_frame(writer, &writer->ring[slot]);
+
+        pthread_mutex_lock(&writer->lock);
+        if (writer->failed) writer->frames_dropped++;
+        writer->pending--;
+    }
+    pthread_mutex_unlock(&writer->lock);
+    return NULL;
+}
+
+// Opens path for writing and starts the writer thread. Every `every`-th step passed to
+// record_trajectory_frame is recorded.
+TrajectoryWriter* open_trajectory(const char* path, int every, double max_x, double max_y) {
+    TrajectoryWriter* writer = calloc(1, sizeof(TrajectoryWriter));
+    if (writer == NULL) {
+        perror("Memory allocation failed for the trajectory writer.");
+        exit(EXIT_FAILURE);
+    }
+    writer->file = fopen(path, "wb");
+    if (writer->file == NULL) {
+        perror("Could not open the trajectory file");
+        free(writer);
+        return NULL;
+    }
+    writer->every = every > 0 ? every : 1;
+
+    TrajectoryHeader header = {0};
+    memcpy(header.magic, TRAJECTORY_MAGIC, sizeof(header.magic));
+    header.version = TRAJECTORY_VERSION;
+    header.position_scale = TRAJECTORY_POSITION_SCALE;
+    header.max_x = max_x;
+    header.max_y = max_y;
+    fwrite(&header, sizeof(header), 1, writer->file);
+    writer->offset = sizeof(header);
+
+    pthread_mutex_init(&writer->lock, NULL);
+    pthread_cond_init(&writer->ready, NULL);
+    if (pthread_create(&writer->thread, NULL, trajectory_writer_main, writer) != 0) {
+        perror("Could not start the trajectory writer");
+        fclose(writer->file);
+        free(writer);
+        return NULL;
+    }
+    return writer;
+}
+
+// Called by update_particles. Only copies the state into a free ring slot; encoding and
+// I/O happen on the writer thread. Drops the frame if the ring is full or a write failed.
+void record_trajectory_frame(TrajectoryWriter* writer, Particles* particles, int step) {
+    if (step % writer->every != 0) return;
+
+    pthread_mutex_lock(&writer->lock);
+    bool drop = writer->pending == TRAJECTORY_RING || writer->failed;
+    if (drop) writer->frames_dropped++;
+    pthread_mutex_unlock(&writer->lock);
+    if (drop) return;
+
+    // The slot at head is not visible to the writer thread until pending is bumped
+    TrajectoryFrame* frame = &writer->ring[writer->head];
+    int n = particles->num_particles;
+    reserve_trajectory_frame(frame, n);
+    frame->step = step;
+    frame->num_particles = n;
+    // In id order, so a particle keeps its index across frames when the solver reorders
+    gather_by_id(particles, particles->x, frame->x);
+    gather_by_id(particles, particles->y, frame->y);
+    gather_by_id(particles, particles->vx, frame->vx);
+    gather_by_id(particles, particles->vy, frame->vy);
+    gather_by_id(particles, particles->density, frame->density);
+
+    pthread_mutex_lock(&writer->lock);
+    writer->head = (writer->head + 1) % TRAJECTORY_RING;
+    writer->pending++;
+    pthread_cond_signal(&writer->ready);
+    pthread_mutex_unlock(&writer->lock);
+}
+
+// Drains the ring, appends the frame index and closes the file. Returns the file size, or
+// -1 if a write failed, and, when the pointers are not NULL, the frame counts. A failed
+// file has no index; the reader rebuilds it from the frames before the failure.
+int64_t close_trajectory(TrajectoryWriter* writer, int* frames_written, int* frames_dropped) {
+    pthread_mutex_lock(&writer->lock);
+    writer->stopping = true;
+    pthread_cond_signal(&writer->ready);
+    pthread_mutex_unlock(&writer->lock);
+    pthread_join(writer->thread, NULL);
+    if (frames_written != NULL) *frames_written = writer->frames_written;
+    if (frames_dropped != NULL) *frames_dropped = writer->frames_dropped;
+
+    TrajectoryTrailer trailer = {
+        .index_offset = (uint64_t)writer->offset,
+        .num_frames = (uint32_t)writer->frames_written,
+        .magic = TRAJECTORY_INDEX_MAGIC,
+    };
+    bool failed = writer->failed;
+    if (!failed) {
+        failed = fwrite(writer->index, sizeof(TrajectoryIndexEntry), writer->frames_written, writer->file) !=
+                     (size_t)writer->frames_written ||
+                 fwrite(&trailer, sizeof(trailer), 1, writer->file) != 1;
+        if (failed) perror("Could not write the trajectory index");
+    }
+    if (fclose(writer->file) != 0) {
+        perror("Could not close the trajectory file");
+        failed = true;
+    }
+    int64_t size = failed ? -1 : writer->offset + (int64_t)writer->frames_written * sizeof(TrajectoryIndexEntry) + sizeof(trailer);
+
+    for (int k = 0; k < TRAJECTORY_RING; k++) {
+        free_trajectory_frame(&writer->ring[k]);
+    }
+    pthread_mutex_destroy(&writer->lock);
+    pthread_cond_destroy(&writer->ready);
+    free(writer->previous_x);
+    free(writer->previous_y);
+    free(writer->payload);
+    free(writer->index);
+    free(writer);
+    return size;
+}
+
+// Rebuilds the index by walking the frame chunks, for files whose writer never closed.
+// A chunk cut short by the end of the file is left out.
+int scan_trajectory_frames(TrajectoryReader* reader) {
+    int capacity = 0;
+    int64_t offset = sizeof(TrajectoryHeader);
+    TrajectoryFrameHeader header;
+    fseeko(reader->file, 0, SEEK_END);
+    int64_t file_size = ftello(reader->file);
+    reader->num_frames = 0;
+    fseeko(reader->file, offset, SEEK_SET);
+    while (fread(&header, sizeof(header), 1, reader->file) == 1 && header.magic == TRAJECTORY_FRAME_MAGIC) {
+        if (offset + (int64_t)sizeof(header) + (int64_t)header.payload_size > file_size) break;
+        if (fseeko(reader->file, (off_t)header.payload_size, SEEK_CUR) != 0) break;
+        if (reader->num_frames == capacity) {
+            capacity = capacity ? capacity * 2 : 256;
+            reader->index = realloc(reader->index, capacity * sizeof(TrajectoryIndexEntry));
+            if (reader->index == NULL) {
+                perror("Memory allocation failed for the trajectory index.");
+                exit(EXIT_FAILURE);
+            }
+        }
+        reader->index[reader->num_frames++] = (TrajectoryIndexEntry) { offset, header.step, header.keyframe };
+        offset += sizeof(header) + header.payload_size;
+    }
+    return reader->num_frames;
+}
+
+TrajectoryReader* open_trajectory_reader(const char* path) {
+    TrajectoryReader* reader = calloc(1, sizeof(TrajectoryReader));
+    if (reader == NULL) {
+        perror("Memory allocation failed for the trajectory reader.");
+        exit(EXIT_FAILURE);
+    }
+    reader->current = -1;
+    reader->file = fopen(path, "rb");
+    if (reader->file == NULL) {
+        perror("Could not open the trajectory file");
+        free(reader);
+        return NULL;
+    }
+    if (fread(&reader->header, sizeof(reader->header), 1, reader->file) != 1 ||
+        memcmp(reader->header.magic, TRAJECTORY_MAGIC, sizeof(reader->header.magic)) != 0 ||
+        reader->header.version != TRAJECTORY_VERSION) {
+        fprintf(stderr, "%s is not a version %d trajectory\n", path, TRAJECTORY_VERSION);
+        close_trajectory_reader(reader);
+        return NULL;
+    }
+
+    TrajectoryTrailer trailer;
+    bool indexed = fseeko(reader->file, -(off_t)sizeof(trailer), SEEK_END) == 0 &&
+                   fread(&trailer, sizeof(trailer), 1, reader->file) == 1 &&
+                   trailer.magic == TRAJECTORY_INDEX_MAGIC;
+    if (indexed) {
+        reader->num_frames = trailer.num_frames;
+        reader->index = malloc((reader->num_frames + 1) * sizeof(TrajectoryIndexEntry));
+        if (reader->index == NULL) {
+            perror("Memory allocation failed for the trajectory index.");
+            exit(EXIT_FAILURE);
+        }
+        indexed = fseeko(reader->file, (off_t)trailer.index_offset, SEEK_SET) == 0 &&
+                  fread(reader->index, sizeof(TrajectoryIndexEntry), reader->num_frames, reader->file) == (size_t)reader->num_frames;
+    }
+    if (!indexed) {
+        scan_trajectory_frames(reader);
+    }
+    return reader;
+}
+
+bool decode_trajectory_frame(TrajectoryReader* reader, int frame, TrajectoryFrame* out) {
+    TrajectoryFrameHeader header;
+    if (fseeko(reader->file, (off_t)reader->index[frame].offset, SEEK_SET) != 0 ||
+        fread(&header, sizeof(header), 1, reader->file) != 1 ||
+        header.magic != TRAJECTORY_FRAME_MAGIC || header.num_particles < 0) {
+        return false;
+    }
+    int n = header.num_particles;
+    if (!header.keyframe && n != reader->previous_count) return false;
+    reserve_payload(&reader->payload, &reader->payload_capacity, header.payload_size + 1);
+    if (fread(reader->payload, 1, header.payload_size, reader->file) != header.payload_size) return false;
+    resize_previous_positions(&reader->previous_x, &reader->previous_y, &reader->previous_count, n);
+    reserve_trajectory_frame(out, n);
+    out->step = header.step;
+    out->num_particles = n;
+
+    const uint8_t* in = reader->payload;
+    const uint8_t* end = reader->payload + header.payload_size;
+    real_t* positions[2] = {out->x, out->y};
+    int32_t* previous[2] = {reader->previous_x, reader->previous_y};
+    real_t scale = (real_t)1 / reader->header.position_scale;
+    for (int axis = 0; axis < 2; axis++) {
+        int32_t last = 0;
+        for (int i = 0; i < n; i++) {
+            uint32_t value;
+            if (!get_varint(&in, end, &value)) return false;
+            int32_t reference = header.keyframe ? last : previous[axis][i];
+            previous[axis][i] = last = reference + zigzag_decode(value);
+            positions[axis][i] = last * scale;
+        }
+    }
+    if (end - in != (ptrdiff_t)n * 6) return false;
+    real_t* halves[3] = {out->vx, out->vy, out->density};
+    for (int k = 0; k < 3; k++) {
+        for (int i = 0; i < n; i++) {
+            halves[k][i] = half_to_float((uint16_t)(in[0] | in[1] << 8));
+            in += 2;
+        }
+    }
+    return true;
+}
+
+// Decodes frame number `frame` (not step) into out. Seeks back to the closest keyframe,
+// or continues from the last frame read when that is closer.
+bool read_trajectory_frame(TrajectoryReader* reader, int frame, TrajectoryFrame* out) {
+    if (frame < 0 || frame >= reader->num_frames) return false;
+    int start = frame;
+    while (start > 0 && !reader->index[start].keyframe) start--;
+    if (reader->current >= start && reader->current < frame) start = reader->current + 1;
+
+    for (int k = start; k <= frame; k++) {
+        if (!decode_trajectory_frame(reader, k, out)) {
+            reader->current = -1;
+            return false;
+        }
+    }
+    reader->current = frame;
+    return true;
+}
+
+void close_trajectory_reader(TrajectoryReader* reader) {
+    if (reader->file != NULL) fclose(reader->file);
+    free(reader->index);
+    free(reader->previous_x);
+    free(reader->previous_y);
+    free(reader->payload);
+    free(reader);
+}
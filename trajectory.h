@@ -0,0 +1,118 @@
+#pragma once
+
+#ifndef TRAJECTORY_H
+#define TRAJECTORY_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "particles.h"
+
+// Trajectory file: a TrajectoryHeader, one chunk per recorded frame (a
+// TrajectoryFrameHeader and its payload), then the frame index and a TrajectoryTrailer.
+// Payload of a frame with n particles:
+//   x, y   n zigzag varints each, positions quantized to 1 / TRAJECTORY_POSITION_SCALE
+//          pixels, as deltas to the same particle in the previous frame, or on keyframes
+//          to the previous particle in the same frame
+//   vx, vy, density   n float16 values each
+#define TRAJECTORY_MAGIC "FLUIDTRJ"
+#define TRAJECTORY_VERSION 1
+#define TRAJECTORY_FRAME_MAGIC 0x454d4152
+#define TRAJECTORY_INDEX_MAGIC 0x58444e49
+#define TRAJECTORY_POSITION_SCALE 64
+#define TRAJECTORY_KEYFRAME_INTERVAL 32
+// Frames waiting for the writer thread. When all are in use new frames are dropped
+// rather than stalling the step.
+#define TRAJECTORY_RING 8
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t position_scale;
+    double max_x;
+    double max_y;
+} TrajectoryHeader;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t keyframe;
+    int32_t step;
+    int32_t num_particles;
+    uint64_t payload_size;
+} TrajectoryFrameHeader;
+
+typedef struct {
+    int64_t offset;
+    int32_t step;
+    uint32_t keyframe;
+} TrajectoryIndexEntry;
+
+typedef struct {
+    uint64_t index_offset;
+    uint32_t num_frames;
+    uint32_t magic;
+} TrajectoryTrailer;
+
+// Decoded frame, also the ring slot the solver copies into
+typedef struct {
+    int step;
+    int num_particles;
+    int capacity;
+    real_t* x;
+    real_t* y;
+    real_t* vx;
+    real_t* vy;
+    real_t* density;
+} TrajectoryFrame;
+
+typedef struct TrajectoryWriter {
+    FILE* file;
+    int every;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    bool stopping;
+    TrajectoryFrame ring[TRAJECTORY_RING];
+    int head;
+    int pending;
+    // Writer thread state
+    int32_t* previous_x;
+    int32_t* previous_y;
+    int previous_count;
+    uint8_t* payload;
+    size_t payload_capacity;
+    int64_t offset;
+    TrajectoryIndexEntry* index;
+    int index_capacity;
+    // Set under lock when a write fails; nothing is written after it
+    bool failed;
+    // Counters
+    int frames_written;
+    int frames_dropped;
+} TrajectoryWriter;
+
+typedef struct {
+    FILE* file;
+    TrajectoryHeader header;
+    TrajectoryIndexEntry* index;
+    int num_frames;
+    int current;
+    int32_t* previous_x;
+    int32_t* previous_y;
+    int previous_count;
+    uint8_t* payload;
+    size_t payload_capacity;
+} TrajectoryReader;
+
+// Function prototypes
+TrajectoryWriter* open_trajectory(const char* path, int every, double max_x, double max_y);
+void record_trajectory_frame(TrajectoryWriter* writer, Particles* particles, int step);
+int64_t close_trajectory(TrajectoryWriter* writer, int* frames_written, int* frames_dropped);
+TrajectoryReader* open_trajectory_reader(const char* path);
+bool read_trajectory_frame(TrajectoryReader* reader, int frame, TrajectoryFrame* out);
+void close_trajectory_reader(TrajectoryReader* reader);
+void free_trajectory_frame(TrajectoryFrame* frame);
+uint16_t float_to_half(float value);
+float half_to_float(uint16_t half);
+
+#endif /* TRAJECTORY_H */